@@ -1,86 +1,574 @@
 #include "bin_logger.h"
+#include "util/compress.h"
+#include "util/crc32c.h"
+
+#include <cstdio>
+#include <cstring>
 
 namespace portal_db {
 
-Status BinLogger::Read(Key& ret, char* alloc_ptr, bool& put) {
-  put = false;
+std::string BinLogger::SegmentName(uint64_t id) const {
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%06llu", static_cast<unsigned long long>(id));
+  return name_ + suffix;
+}
+Status BinLogger::Open() {
+  Status ret = manifest_.Open();
+  if(!ret.ok()) return ret;
+  char buffer[manifest_size_];
+  uint32_t crc = 0;
+  if(manifest_.size() >= manifest_size_) {
+    ret *= manifest_.Read(0, manifest_size_, buffer);
+    if(!ret.ok()) return ret;
+    memcpy(&crc, buffer + 32, 4);
+  }
+  if(manifest_.size() >= manifest_size_ && crc == crc32c::Value(buffer, 32)) {
+    memcpy(&first_segment_, buffer, 8);
+    memcpy(&first_offset_, buffer + 8, 8);
+    memcpy(&last_segment_, buffer + 16, 8);
+    memcpy(&first_lsn_, buffer + 24, 8);
+    fresh_ = true;
+    return OpenSegment(first_segment_, first_offset_, false);
+  }
+  // new log
+  fresh_ = false;
+  first_segment_ = last_segment_ = 1;
+  first_offset_ = 0;
+  first_lsn_ = 0;
+  ret *= manifest_.SetEnd(manifest_size_);
+  if(ret.ok()) ret *= SaveManifest();
+  if(ret.ok()) ret *= OpenSegment(first_segment_, 0, true);
+  return ret;
+}
+Status BinLogger::Close() {
+  Status ret;
+  for(auto& region : regions_) {
+    if(!region->unmapped) ret *= region->file->Unmap(region->base, region->size);
+    if(region->file->opened()) ret *= region->file->Close();
+  }
+  regions_.clear();
+  region_ = NULL;
+  retired_ = 0;
+  if(active_ && active_->opened()) ret *= active_->Close();
+  active_.reset();
+  if(manifest_.opened()) ret *= manifest_.Close();
+  return ret;
+}
+Status BinLogger::Delete() {
   if(!opened()) {
-    Status status = Open();
+    Status ret = Open();
+    if(!ret.ok()) return ret;
+  }
+  Status ret = Close();
+  for(uint64_t id = first_segment_; id <= last_segment_; id++) {
+    SequentialFile(SegmentName(id)).Delete(); // may not exist
+  }
+  if(ret.ok()) ret *= manifest_.Delete();
+  return ret;
+}
+Status BinLogger::Sync() {
+  if(mode_ == LogMode::kMapped) {
+    Status ret;
+    {
+      std::lock_guard<std::mutex> lk(map_lock_);
+      for(size_t i = retired_; i < regions_.size(); i++) {
+        MappedRegion* region = regions_[i].get();
+        size_t reserved = region->reserved.load();
+        ret *= FlushMapped(region, 0, min(reserved, region->size));
+      }
+    }
+    // sealed ones are synced whole
+    if(ret.ok()) ret *= RetireMapped();
+    return ret;
+  }
+  if(!active_) return Status::IOError("File Not Opened");
+  return active_->Sync();
+}
+Status BinLogger::SaveManifest() {
+  char buffer[manifest_size_];
+  memcpy(buffer, &first_segment_, 8);
+  memcpy(buffer + 8, &first_offset_, 8);
+  memcpy(buffer + 16, &last_segment_, 8);
+  memcpy(buffer + 24, &first_lsn_, 8);
+  uint32_t crc = crc32c::Value(buffer, 32);
+  memcpy(buffer + 32, &crc, 4);
+  Status ret = manifest_.Write(0, manifest_size_, buffer);
+  if(ret.ok()) ret *= manifest_.Sync();
+  return ret;
+}
+Status BinLogger::OpenSegment(uint64_t id, 
+                              size_t offset, 
+                              bool fresh, 
+                              bool append) {
+  if(active_ && active_->opened()) {
+    Status ret = active_->Close();
+    if(!ret.ok()) return ret;
+  }
+  const size_t align = SequentialFile::DirectAlignment();
+  active_direct_ = mode_ == LogMode::kDirect && (fresh || append);
+  active_.reset(new SequentialFile(SegmentName(id), active_direct_));
+  Status ret = active_->Open();
+  if(ret.ok() && fresh) { // zero stale content
+    ret *= active_->SetEnd(0);
+    // whole blocks in direct mode
+    size_t size = active_direct_ ? (segment_size_ + align - 1) / align * align : segment_size_;
+    if(ret.ok()) ret *= active_->SetEnd(size);
+  }
+  if(fresh) tail_.clear();
+  // position before id, see `Checkpoint`
+  cursor_ = offset;
+  segment_ = id;
+  read_size_ = 0;
+  entry_pos_ = frame_end_ = 0;
+  return ret;
+}
+Status BinLogger::Roll() {
+  // seal is durable before any frame of next segment
+  char seal[header_];
+  EncodeHeader(seal, segment_.load() + 1, 0);
+  size_t cur = cursor_.load();
+  Status ret = mode_ == LogMode::kDirect ? WriteAligned(cur, seal, header_) 
+                                         : active_->Write(cur, header_, seal);
+  if(ret.ok()) ret *= active_->Sync();
+  if(!ret.ok()) return ret;
+  last_segment_ = segment_.load() + 1;
+  ret *= OpenSegment(last_segment_, 0, true);
+  if(ret.ok()) ret *= SaveManifest();
+  return ret;
+}
+Status BinLogger::Reset() {
+  uint64_t first = first_segment_;
+  uint64_t last = last_segment_;
+  first_segment_ = last_segment_ = last + 1;
+  first_offset_ = 0;
+  first_lsn_ = 0;
+  logged_ = checkpoint_logged_ = compacted_logged_ = 0;
+  Status ret = OpenSegment(first_segment_, 0, true);
+  if(ret.ok()) ret *= SaveManifest();
+  for(uint64_t id = first; id <= last && ret.ok(); id++) {
+    SequentialFile(SegmentName(id)).Delete();
+  }
+  return ret;
+}
+Status BinLogger::DropStale() {
+  // cut at cursor and grow back, the rest reads as zeros
+  size_t size = active_->size();
+  Status ret = active_->SetEnd(cursor_.load());
+  if(ret.ok()) ret *= active_->SetEnd(size);
+  if(ret.ok()) ret *= active_->Sync();
+  read_size_ = 0;
+  // later segments follow an unsealed one, no prefix either
+  uint64_t last = last_segment_;
+  if(ret.ok() && last > segment_.load()) {
+    last_segment_ = segment_.load();
+    ret *= SaveManifest();
+    for(uint64_t id = segment_.load() + 1; id <= last && ret.ok(); id++) {
+      SequentialFile(SegmentName(id)).Delete();
+    }
+  }
+  if(ret.ok()) stale_tail_ = false;
+  return ret;
+}
+Status BinLogger::Rewind() { 
+  if(!opened()) return Open();
+  fresh_ = false;
+  return OpenSegment(first_segment_, first_offset_, false); 
+}
+Status BinLogger::Fill(size_t offset, size_t len) {
+  if(offset + len > active_->size()) return Status::NotFound("EOF");
+  if(offset >= read_offset_ && offset + len <= read_offset_ + read_size_)
+    return Status::OK();
+  size_t size = min(max(len, read_chunk_), active_->size() - offset);
+  if(read_buf_.size() < size) read_buf_.resize(size);
+  read_offset_ = offset;
+  read_size_ = 0;
+  Status status = active_->Read(offset, size, read_buf_.data());
+  if(status.ok()) read_size_ = size;
+  return status;
+}
+Status BinLogger::NextFrame() {
+  size_t cur = cursor_.load();
+  Status status = Fill(cur, header_);
+  bool end = status.IsNotFound();
+  if(status.ok()) {
+    uint64_t zero[2] = {0, 0};
+    end = memcmp(read_buf_.data() + (cur - read_offset_), zero, header_) == 0;
+  } else if(!end) return status;
+  if(end) {
+    ended_ = true;
+    if(segment_.load() >= last_segment_) return Status::NotFound("EOF");
+    // rolled segment lost its tail, later ones are no prefix
+    return Status::Corruption("unsealed log segment");
+  }
+  const char* p = read_buf_.data() + (cur - read_offset_);
+  uint32_t crc, length;
+  uint64_t lsn;
+  memcpy(&crc, p, 4);
+  memcpy(&length, p + 4, 4);
+  memcpy(&lsn, p + 8, 8);
+  if(length == 0) { // seal names next segment
+    if(lsn != segment_.load() + 1 || segment_.load() >= last_segment_ ||
+       crc32c::Value(p + 8, 8) != crc) {
+      ended_ = true;
+      return Status::Corruption("torn log tail");
+    }
+    status = OpenSegment(lsn, 0, false);
     if(!status.ok()) return status;
+    return NextFrame();
   }
-  size_t cur = std::atomic_fetch_add(&cursor_, 12);
-  if(cur + 256 + 8 > SequentialFile::size()) return Status::NotFound("EOF");
-  Status status = SequentialFile::Read(cur, 12, alloc_ptr);
+  bool packed = (length & kPacked) != 0;
+  length &= ~kPacked;
+  if(length == 0 || cur + header_ + length > active_->size()) {
+    ended_ = true;
+    return Status::Corruption("torn log tail");
+  }
+  status = Fill(cur, header_ + length);
   if(!status.ok()) return status;
-  for(int i = 0; i < 8; i++) ret[i] = alloc_ptr[i];
-  uint32_t tmp = *(reinterpret_cast<uint32_t*>(alloc_ptr + 4));
-  if( tmp == 0 ) {
-    cur = std::atomic_fetch_add(&cursor_, 256);
-    if(cur + 256 > SequentialFile::size()) return Status::NotFound("EOF");
-    status *= SequentialFile::Read(cur, 256, alloc_ptr);
-    if(status.ok()) put = true;
-    return status;
-  } else if(tmp == marker_) {
-    return Status::OK();
+  p = read_buf_.data() + (cur - read_offset_);
+  if(crc32c::Value(p + 8, 8 + length) != crc) {
+    ended_ = true;
+    return Status::Corruption("torn log tail");
+  }
+  unpacked_ = packed;
+  if(packed) {
+    uint32_t raw = 0;
+    if(length >= 4) memcpy(&raw, p + header_, 4);
+    if(frame_buf_.size() < raw) frame_buf_.resize(raw);
+    if(length < 4 || !lz::Decompress(p + header_ + 4, length - 4, 
+                                     frame_buf_.data(), raw))
+      return Status::Corruption("malformed packed frame");
+    entry_pos_ = 0;
+    frame_end_ = raw;
   } else {
-    memcpy(alloc_ptr, alloc_ptr + 8, 4);
-    cur = std::atomic_fetch_add(&cursor_, 256 - 4);
-    status *= SequentialFile::Read(cur, 256 - 4, alloc_ptr + 4);
-    if(status.ok()) put = true;
-    return status;
+    entry_pos_ = cur - read_offset_ + header_;
+    frame_end_ = entry_pos_ + length;
   }
+  frame_lsn_ = lsn;
+  cursor_ = cur + header_ + length;
+  logged_ += header_ + length;
+  if(lsn >= lsn_.load()) lsn_ = lsn + 1;
+  return Status::OK();
 }
-Status BinLogger::AppendDelete(const Key& key) {
+Status BinLogger::Read(Key& ret, char* alloc_ptr, bool& put, uint64_t& lsn) {
+  put = false;
+  ended_ = false;
+  if(!opened()) {
+    Status status = Open();
+    if(!status.ok()) return status;
+  }
+  fresh_ = false;
+  while(entry_pos_ >= frame_end_) {
+    Status status = NextFrame();
+    if(!status.ok()) {
+      stale_tail_ = true;
+      return status;
+    }
+  }
+  const char* p = (unpacked_ ? frame_buf_ : read_buf_).data() + entry_pos_;
+  uint8_t type = static_cast<uint8_t>(p[0]);
+  bool sequenced = (type & kSequenced) != 0;
+  type &= static_cast<uint8_t>(~kSequenced);
+  size_t len = 1 + (sequenced ? 8 : 0) + 8 + (type == kPut ? 256 : 0);
+  if((type != kPut && type != kDelete) || entry_pos_ + len > frame_end_) {
+    entry_pos_ = frame_end_;
+    return Status::Corruption("malformed log entry");
+  }
+  p ++;
+  lsn = frame_lsn_;
+  if(sequenced) {
+    memcpy(&lsn, p, 8);
+    p += 8;
+  }
+  for(int i = 0; i < 8; i++) ret[i] = p[i];
+  if(type == kPut) {
+    memcpy(alloc_ptr, p + 8, 256);
+    put = true;
+  }
+  entry_pos_ += len;
+  return Status::OK();
+}
+size_t BinLogger::EncodeDelete(char* dst, const Key& key, uint64_t lsn) {
+  size_t len = 1;
+  dst[0] = static_cast<char>(kDelete | (lsn ? kSequenced : 0));
+  if(lsn) {
+    memcpy(dst + len, &lsn, 8);
+    len += 8;
+  }
+  memcpy(dst + len, key.raw_ptr(), 8);
+  return len + 8;
+}
+size_t BinLogger::EncodePut(char* dst, 
+                            const Key& key, 
+                            const Value& value, 
+                            uint64_t lsn) {
+  size_t len = 1;
+  dst[0] = static_cast<char>(kPut | (lsn ? kSequenced : 0));
+  if(lsn) {
+    memcpy(dst + len, &lsn, 8);
+    len += 8;
+  }
+  memcpy(dst + len, key.raw_ptr(), 8);
+  value.write<0, 256>(dst + len + 8);
+  return len + 8 + 256;
+}
+void BinLogger::EncodeHeader(char* dst, 
+                             uint64_t lsn, 
+                             size_t length, 
+                             bool packed) {
+  uint32_t len = static_cast<uint32_t>(length) | (packed ? kPacked : 0);
+  memcpy(dst + 4, &len, 4);
+  memcpy(dst + 8, &lsn, 8);
+  uint32_t crc = crc32c::Value(dst + 8, 8 + length);
+  memcpy(dst, &crc, 4);
+}
+size_t BinLogger::MaxPacked(size_t length) {
+  return 4 + lz::MaxCompressedLength(length);
+}
+size_t BinLogger::Pack(char* dst, const char* payload, size_t length) {
+  uint32_t raw = static_cast<uint32_t>(length);
+  memcpy(dst, &raw, 4);
+  size_t packed = 4 + lz::Compress(payload, length, dst + 4);
+  // keep raw unless it saves an eighth
+  return packed < length - length / 8 ? packed : 0;
+}
+Status BinLogger::Reserve(size_t len, size_t& cur, IoEngine* engine) {
   if(!opened()) {
     Status ret = Open();
     if(!ret.ok()) return ret;
   }
-  size_t cur = std::atomic_fetch_add(&cursor_, 8 + padding_);
-  if(size() <= cur + 8 + padding_) SetEnd(size() + page_);
-  Status ret = Write(cur, 8, key.raw_ptr());
-  if(ret.ok()) ret *= Write(cur + 8, 4, 
-    reinterpret_cast<const char*>(&marker_));
+  if(fresh_) {
+    fresh_ = false;
+    Status ret = Reset();
+    if(!ret.ok()) return ret;
+  }
+  if(stale_tail_) {
+    Status ret = DropStale();
+    if(!ret.ok()) return ret;
+  }
+  cur = cursor_.load();
+  // frames leave room for seal of segment
+  bool full = cur > 0 && cur + len + header_ > segment_size_;
+  if(mode_ == LogMode::kDirect && !active_direct_ && !full) {
+    // continue recovered segment, keep its partial tail block
+    const size_t align = SequentialFile::DirectAlignment();
+    tail_.resize(cur % align);
+    Status ret = active_->Read(cur - tail_.size(), tail_.size(), tail_.data());
+    if(ret.ok()) ret *= OpenSegment(segment_.load(), cur, false, true);
+    if(!ret.ok()) return ret;
+  }
+  if(full) {
+    // sealed segment is closed with its writes done
+    Status ret = engine ? engine->Drain() : Status::OK();
+    if(ret.ok()) ret *= Roll();
+    if(!ret.ok()) return ret;
+    cur = 0;
+  }
+  if(active_->size() < cur + len + header_) { // oversized frame
+    Status ret = active_->SetEnd((cur + len + header_ + page_) / page_ * page_);
+    if(!ret.ok()) return ret;
+  }
+  return Status::OK();
+}
+Status BinLogger::AppendRaw(const char* data, size_t len) {
+  if(mode_ == LogMode::kMapped) {
+    MappedRegion* region;
+    char* dst;
+    Status ret = ReserveMapped(len, region, dst);
+    if(ret.ok()) {
+      memcpy(dst, data, len);
+      Written(region, len);
+    }
+    return ret;
+  }
+  size_t cur;
+  Status ret = Reserve(len, cur, NULL);
+  if(ret.ok()) ret *= mode_ == LogMode::kDirect ? WriteAligned(cur, data, len) : active_->Write(cur, len, data);
+  if(ret.ok()) {
+    cursor_ = cur + len;
+    logged_ += len;
+  }
   return ret;
 }
-Status BinLogger::AppendPut(const Key& key, const Value& value) {
+Status BinLogger::AppendAsync(IoEngine& engine, 
+                              const char* data, 
+                              size_t len, 
+                              bool sync, 
+                              uint64_t& ticket) {
+  size_t cur;
+  ticket = engine.issued();
+  // staging buffer is single, mapping takes no writes
+  if(mode_ != LogMode::kBuffered) {
+    Status ret = engine.Drain();
+    return ret.ok() ? AppendRaw(data, len) : ret;
+  }
+  Status ret = Reserve(len, cur, &engine);
+  if(ret.ok()) ret *= engine.Write(*active_, cur, data, len, sync, ticket);
+  if(ret.ok()) {
+    cursor_ = cur + len;
+    logged_ += len;
+  }
+  return ret;
+}
+Status BinLogger::MapActive() {
   if(!opened()) {
     Status ret = Open();
     if(!ret.ok()) return ret;
   }
-  size_t len = 8 + 256;
-  uint32_t tmp = *((uint32_t*)value.pointer_to_slice<0,8>());
-  if(tmp == 0 || tmp == marker_) len += padding_; // padding
-  tmp = 0;
-  size_t cur = std::atomic_fetch_add(&cursor_, len);
-  if(size() <= cur + len) SetEnd(size() + page_);
-  Status ret = Write(cur, 8, key.raw_ptr());
-  if(len > 8 + 256 && ret.ok()) {
-    ret *= Write(cur + 8, 4,
-     reinterpret_cast<const char*>(&tmp)); // 0 pad
-    tmp = 4;
+  if(fresh_) {
+    fresh_ = false;
+    Status ret = Reset();
+    if(!ret.ok()) return ret;
   }
+  if(stale_tail_) {
+    Status ret = DropStale();
+    if(!ret.ok()) return ret;
+  }
+  // region takes over the segment, continuing at cursor
+  std::unique_ptr<MappedRegion> region(new MappedRegion);
+  region->id = segment_.load();
+  region->size = active_->size();
+  region->reserved = cursor_.load();
+  Status ret = active_->Map(0, region->size, region->base);
+  if(!ret.ok()) return ret;
+  region->file = std::move(active_);
+  regions_.push_back(std::move(region));
+  region_.store(regions_.back().get(), std::memory_order_release);
+  return ret;
+}
+Status BinLogger::RollMapped(MappedRegion* full) {
+  std::lock_guard<std::mutex> lk(map_lock_);
+  if(region_.load() != full) return Status::OK(); // rolled by another
+  std::unique_ptr<MappedRegion> region(new MappedRegion);
+  region->id = full->id + 1;
+  region->size = segment_size_;
+  region->file.reset(new SequentialFile(SegmentName(region->id)));
+  Status ret = region->file->Open();
+  if(ret.ok()) ret *= region->file->SetEnd(0); // zero stale content
+  if(ret.ok()) ret *= region->file->SetEnd(segment_size_);
+  if(ret.ok()) ret *= region->file->Map(0, region->size, region->base);
+  if(!ret.ok()) return ret;
+  last_segment_ = region->id;
+  ret *= SaveManifest();
+  segment_ = region->id;
+  cursor_ = 0;
+  regions_.push_back(std::move(region));
+  region_.store(regions_.back().get(), std::memory_order_release);
+  return ret;
+}
+Status BinLogger::ReserveMapped(size_t len, MappedRegion*& region, char*& dst) {
+  if(len + header_ > segment_size_) return Status::InvalidArgument("Frame exceeds segment.");
+  while(true) {
+    region = region_.load(std::memory_order_acquire);
+    if(region == NULL) {
+      std::lock_guard<std::mutex> lk(map_lock_);
+      if(region_.load() != NULL) continue;
+      Status ret = MapActive();
+      if(!ret.ok()) return ret;
+      continue;
+    }
+    size_t offset = region->reserved.fetch_add(len);
+    // frames leave room for seal of segment
+    if(offset + len + header_ <= region->size) {
+      dst = region->base + offset;
+      logged_ += len;
+      return Status::OK();
+    }
+    // frames before it are the only ones placed in segment
+    if(offset + header_ <= region->size) {
+      EncodeHeader(region->base + offset, region->id + 1, 0);
+      region->sealed.store(offset);
+    }
+    Status ret = RollMapped(region);
+    if(!ret.ok()) return ret;
+  }
+}
+Status BinLogger::FlushMapped(MappedRegion* region, size_t begin, size_t end) {
+  if(region->unmapped || begin >= end) return Status::OK();
+  size_t from = begin / SequentialFile::MapAlignment() * SequentialFile::MapAlignment();
+  Status ret = region->file->Flush(region->base + from, end - from);
+  if(ret.ok()) ret *= region->file->Sync();
+  return ret;
+}
+Status BinLogger::RetireMapped(uint64_t dropped) {
+  Status ret;
+  std::lock_guard<std::mutex> lk(map_lock_);
+  for(size_t i = retired_; i < regions_.size(); i++) {
+    MappedRegion* region = regions_[i].get();
+    size_t sealed = region->sealed.load();
+    if(region->unmapped || region == region_.load() || 
+       sealed == static_cast<size_t>(-1) || 
+       region->written.load(std::memory_order_acquire) != sealed) continue;
+    Status status;
+    if(region->id >= dropped) status *= FlushMapped(region, 0, sealed + header_);
+    if(status.ok()) status *= region->file->Unmap(region->base, region->size);
+    if(status.ok()) status *= region->file->Close();
+    region->unmapped = status.ok();
+    ret *= status;
+  }
+  while(retired_ < regions_.size() && regions_[retired_]->unmapped) retired_ ++;
+  return ret;
+}
+size_t BinLogger::mapped_segments() {
+  std::lock_guard<std::mutex> lk(map_lock_);
+  size_t count = 0;
+  for(size_t i = retired_; i < regions_.size(); i++) {
+    if(!regions_[i]->unmapped) count ++;
+  }
+  return count;
+}
+Status BinLogger::WriteAligned(size_t cur, const char* data, size_t len) {
+  const size_t align = SequentialFile::DirectAlignment();
+  size_t base = cur - tail_.size();
+  size_t total = (tail_.size() + len + align - 1) / align * align;
+  if(staging_size_ < total) {
+    staging_buf_.resize(total + align);
+    uintptr_t p = reinterpret_cast<uintptr_t>(staging_buf_.data());
+    staging_ = staging_buf_.data() + (align - p % align) % align;
+    staging_size_ = total;
+  }
+  memcpy(staging_, tail_.data(), tail_.size());
+  memcpy(staging_ + tail_.size(), data, len);
+  // padding reads as end of segment until overwritten
+  memset(staging_ + tail_.size() + len, 0, total - tail_.size() - len);
+  Status ret = active_->Write(base, total, staging_);
   if(ret.ok()) {
-    ret *= Write(cur + tmp + 8, 256,
-      value.pointer_to_slice<0, 256>());
+    size_t end = cur + len;
+    size_t keep = end % align;
+    tail_.assign(staging_ + (end - keep - base), staging_ + (end - base));
   }
   return ret;
 }
+Status BinLogger::AppendDelete(const Key& key) {
+  char buffer[header_ + max_entry_];
+  size_t len = EncodeDelete(buffer + header_, key);
+  EncodeHeader(buffer, NextLsn(), len);
+  return AppendRaw(buffer, header_ + len);
+}
+Status BinLogger::AppendPut(const Key& key, const Value& value) {
+  char buffer[header_ + max_entry_];
+  size_t len = EncodePut(buffer + header_, key, value);
+  EncodeHeader(buffer, NextLsn(), len);
+  return AppendRaw(buffer, header_ + len);
+}
 
 Status BinLogger::Compact() { // snapshot is finished
   if(!opened()) {
     Status ret = Open();
     if(!ret.ok()) return ret;
   }
-  size_t tmp;
-  do {
-    tmp = cursor_.load();
-  } while(!std::atomic_compare_exchange_strong(&cursor_, &tmp, tmp - checkpoint_));
-  char* buffer = new char[tmp - checkpoint_];
-  Status ret = SequentialFile::Read(checkpoint_, tmp - checkpoint_, buffer);
-  if(ret.ok()) ret *= Write(0, tmp - checkpoint_, buffer);
-  if(ret.ok()) ret *= SetEnd(max((cursor_.load() + page_) / page_ * page_, (size() / 2 + page_ ) / page_ * page_ ));
-  checkpoint_ = 0;
+  if(checkpoint_segment_ < first_segment_) return Status::OK();
+  uint64_t first = first_segment_;
+  first_segment_ = checkpoint_segment_;
+  first_offset_ = checkpoint_;
+  first_lsn_ = checkpoint_lsn_;
+  Status ret = SaveManifest();
+  if(ret.ok()) compacted_logged_ = checkpoint_logged_.load();
+  // manifest no longer refers to them
+  if(ret.ok() && mode_ == LogMode::kMapped) ret *= RetireMapped(first_segment_);
+  for(uint64_t id = first; id < first_segment_ && ret.ok(); id++) {
+    SequentialFile(SegmentName(id)).Delete();
+  }
   return ret;
 }
 
-} // namespace portal_db
\ No newline at end of file
+} // namespace portal_db
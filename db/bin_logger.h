@@ -2,51 +2,270 @@
 #define PORTAL_DB_BIN_LOGGER_H_
 
 #include "util/file.h" // File
+#include "util/io_engine.h"
+#include "util/util.h"
 #include "portal_db/status.h"
 #include "portal_db/piece.h"
 
 #include <cstdint>
 #include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 namespace portal_db {
 
-// Logger for operations including:
-// + Put (key, value): key - value (254 byte)
-//    additionally, if value shares prefix with marker/0
-//    pad 0s in front (268 byte)
-// + Delete (key, value): key - marker (12 byte)
-class BinLogger : public SequentialFile {
+// Logger for operations, split into segment files `name.<id>` of
+// `segment_size` bytes, preallocated and filled one after another.
+// File `name` is a manifest of live segments and checkpoint:
+// + first (8) - offset (8) - last (8) - checkpoint lsn (8) - crc (4)
+//    checkpoint lsn is kept for a caller stamping entries
+// Log is framed as (little endian):
+// + header: crc (4) - length (4) - lsn (8)
+//    crc is crc32c of lsn and stored payload
+//    `kPacked` bit of length marks a compressed payload:
+//    raw length (4) - lz block, see util/compress.h
+// + payload of `length` bytes, a batch of entries:
+//    + Put: type (1) - [lsn (8)] - key (8) - value (256)
+//    + Delete: type (1) - [lsn (8)] - key (8)
+//    lsn is present with `kSequenced` bit, else frame lsn applies
+// A full segment ends with a seal, a header of zero length whose lsn
+// is id of next segment. Zero header marks end of last segment, crc
+// mismatch marks torn tail, and so does an unsealed earlier segment.
+// Appending without reading first starts a new log, appending after
+// reading drops whatever follows the last valid frame first.
+// Append modes:
+// + kBuffered -- positional writes through page cache
+// + kDirect -- writes bypass page cache: each covers whole blocks of
+//    `DirectAlignment`, rewriting the partial tail block and padding
+//    with zeros after the last frame
+// + kMapped -- active segment is mapped, concurrent writers reserve
+//    frames in it and copy them in place, see `ReserveMapped`
+// Reads stay buffered.
+enum class LogMode { kBuffered, kDirect, kMapped };
+
+class BinLogger : public NoMove {
  public:
-  BinLogger(std::string name)
-    : SequentialFile(name), cursor_(0) { }
+  enum EntryType : uint8_t { kPut = 1, kDelete = 2, kSequenced = 0x80 };
+  static constexpr uint32_t kPacked = 0x80000000;
+  BinLogger(std::string name, 
+            size_t segment_size = default_segment_, 
+            LogMode mode = LogMode::kBuffered)
+    : name_(name), 
+      segment_size_(segment_size), 
+      mode_(mode),
+      manifest_(name), 
+      segment_(0), 
+      cursor_(0), 
+      lsn_(1),
+      logged_(0),
+      checkpoint_logged_(0),
+      compacted_logged_(0),
+      region_(NULL) { }
   ~BinLogger() { }
+  // load manifest and open first live segment
+  Status Open();
+  Status Close();
+  // close then unlink manifest and every segment
+  Status Delete();
+  bool opened() const { return manifest_.opened(); }
+  LogMode mode() const { return mode_; }
+  const std::string& name() const { return name_; }
+  // flush active segment to device, every live one in mapped mode,
+  // unmapping sealed ones
+  Status Sync();
   // recovery routine //
-  Status Rewind() { cursor_ = 0; return Status::OK(); }
-  // read one record at a time
-  Status Read(Key& ret, char* alloc_ptr, bool& put);
-  // logging routine //
+  // back to checkpoint of manifest
+  Status Rewind();
+  // read one entry at a time
+  // leaves cursor at end of last valid frame, see `ended`
+  Status Read(Key& ret, char* alloc_ptr, bool& put) {
+    uint64_t lsn;
+    return Read(ret, alloc_ptr, put, lsn);
+  }
+  Status Read(Key& ret, char* alloc_ptr, bool& put, uint64_t& lsn);
+  // last failed `Read` stopped at end of log or its torn tail, other
+  // failures are errors or damage before it
+  bool ended() const { return ended_; }
+  // logging routine, single writer //
   Status AppendDelete(const Key& key);
   Status AppendPut(const Key& key, const Value& value);
   Status AppendPut(const KeyValue& kv) {
     return AppendPut(kv, kv);
   }
+  // append encoded frames with one write, or one copy in mapped mode
+  Status AppendRaw(const char* data, size_t len);
+  // queue frames on `engine`, `data` must live until `ticket` completes
+  // `sync` syncs them, a segment roll waits for writes in flight
+  Status AppendAsync(IoEngine& engine, 
+                     const char* data, 
+                     size_t len, 
+                     bool sync, 
+                     uint64_t& ticket);
+  // encode entry into `dst` with room of `max_entry_`
+  // non-zero `lsn` is stamped on entry, return encoded length
+  static size_t EncodeDelete(char* dst, const Key& key, uint64_t lsn = 0);
+  static size_t EncodePut(char* dst, 
+                          const Key& key, 
+                          const Value& value, 
+                          uint64_t lsn = 0);
+  // fill header in front of `length` bytes of payload at `dst + header_`
+  static void EncodeHeader(char* dst, 
+                           uint64_t lsn, 
+                           size_t length, 
+                           bool packed = false);
+  // compress `length` bytes of payload into `dst` with room of
+  // `MaxPacked(length)`, return packed length or 0 if not worth it
+  static size_t Pack(char* dst, const char* payload, size_t length);
+  static size_t MaxPacked(size_t length);
+  uint64_t NextLsn() { return std::atomic_fetch_add(&lsn_, 1); }
   // checkpoint logging
-  void Checkpoint() { // on-going snapshot
+  // `lsn` is first stamp not covered by snapshot, see `first_lsn`
+  void Checkpoint(uint64_t lsn = 0) { // on-going snapshot
+    checkpoint_lsn_ = lsn;
+    // bytes first, a racing append is replayed anyway
+    checkpoint_logged_ = logged_.load();
+    // segment first, a racing roll only moves checkpoint backward
+    checkpoint_segment_ = segment_.load();
     checkpoint_ = cursor_.load();
+    // mapped writers only move reservation of their region
+    MappedRegion* region = region_.load();
+    if(region != NULL) {
+      size_t reserved = region->reserved.load();
+      checkpoint_segment_ = region->id;
+      size_t sealed = region->sealed.load();
+      checkpoint_ = reserved < sealed ? reserved : sealed;
+    }
   }
   // called when snapshot of checkpoint is finished
+  // records checkpoint in manifest and unlinks segments before it
   Status Compact();
+  // checkpoint lsn of manifest, 0 if none
+  uint64_t first_lsn() const { return first_lsn_; }
+  // bytes of log a recovery replays, read or appended since the
+  // last compacted checkpoint
+  uint64_t backlog() const {
+    return logged_.load() - compacted_logged_.load();
+  }
+  // segments mapped for mapped appends, active one included
+  size_t mapped_segments();
+  // name of segment file
+  std::string SegmentName(uint64_t id) const;
+  static constexpr size_t header_ = 16;
+  static constexpr size_t max_entry_ = 1 + 8 + 8 + 256;
+  static constexpr size_t default_segment_ = (1 << 24); // 16 MB
  protected:
+  // mapped segment, unmapped once sealed and its frames are synced or
+  // its segment is compacted away, entry is kept until close for late
+  // reservations and slots pointing at it
+  // frames are reserved by `reserved` fetch-add, leaving room for the
+  // seal, the one crossing end seals it at its offset
+  struct MappedRegion {
+    uint64_t id;
+    std::unique_ptr<SequentialFile> file;
+    char* base = NULL;
+    size_t size = 0;
+    std::atomic<size_t> reserved{0};
+    std::atomic<size_t> written{0}; // bytes copied in
+    std::atomic<size_t> sealed{static_cast<size_t>(-1)}; // seal offset
+    bool unmapped = false; // flushed and released, daemon only
+  };
+  // mapped append family, thread safe //
+  // reserve `len` bytes of frames in mapped active segment, rolling a
+  // full one, then copy them to `dst` and call `Written`
+  Status ReserveMapped(size_t len, MappedRegion*& region, char*& dst);
+  static void Written(MappedRegion* region, size_t len) {
+    region->written.fetch_add(len, std::memory_order_release);
+  }
+  // flush [begin, end) of `region` to device, already done once retired
+  Status FlushMapped(MappedRegion* region, size_t begin, size_t end);
+  // flush, unmap and close sealed segments whose frames are all copied,
+  // segments before `dropped` are unlinked and not flushed
+  Status RetireMapped(uint64_t dropped = 0);
   // each page is allocated contiguously
   static constexpr size_t page_ = (1 << 12); // 4 KB page
-  // padding for id DEL with PUT
-  static constexpr size_t padding_ = 4;
-  static const uint32_t marker_ = 0xDEADBEEF;
+  // recovery reads ahead in large chunks
+  static constexpr size_t read_chunk_ = (1 << 20); // 1 MB
+  static constexpr size_t manifest_size_ = 8 * 4 + 4;
+  const std::string name_;
+  const size_t segment_size_;
+  const LogMode mode_;
+  SequentialFile manifest_;
+  // live segments [first_segment_, last_segment_]
+  // replay starts at `first_offset_` of first segment
+  uint64_t first_segment_ = 1;
+  uint64_t first_offset_ = 0;
+  uint64_t last_segment_ = 1;
+  uint64_t first_lsn_ = 0;
   // checkpoint log
+  uint64_t checkpoint_lsn_ = 0;
+  uint64_t checkpoint_segment_ = 0; // none
   size_t checkpoint_ = 0; // offset
+  // position of reader and writer
+  std::unique_ptr<SequentialFile> active_;
+  std::atomic<uint64_t> segment_;
   std::atomic<size_t> cursor_;
+  std::atomic<uint64_t> lsn_; // next lsn
+  // bytes passed by cursor since log started, see `backlog`
+  std::atomic<uint64_t> logged_;
+  std::atomic<uint64_t> checkpoint_logged_;
+  std::atomic<uint64_t> compacted_logged_;
+  // nothing read or written since open
+  bool fresh_ = false;
+  // reader stopped at cursor, bytes after it may hold stale frames
+  bool stale_tail_ = false;
+  bool ended_ = false;
+ private:
+  // read-ahead buffer holding range of active segment
+  // [read_offset_, read_offset_ + read_size_)
+  std::vector<char> read_buf_;
+  size_t read_offset_ = 0;
+  size_t read_size_ = 0;
+  // payload of packed frame after decompression
+  std::vector<char> frame_buf_;
+  bool unpacked_ = false;
+  // unread entries of current frame in `read_buf_` or `frame_buf_`
+  size_t entry_pos_ = 0;
+  size_t frame_end_ = 0;
+  uint64_t frame_lsn_ = 0;
+  // direct append state
+  bool active_direct_ = false; // active segment opened for direct append
+  std::vector<char> tail_; // partial block before cursor
+  std::vector<char> staging_buf_;
+  char* staging_ = NULL; // aligned into `staging_buf_`
+  size_t staging_size_ = 0;
+  // mapped append state, `regions_` guarded by `map_lock_`
+  std::mutex map_lock_;
+  std::atomic<MappedRegion*> region_; // active
+  std::vector<std::unique_ptr<MappedRegion>> regions_;
+  size_t retired_ = 0; // regions before it are unmapped
+  Status SaveManifest();
+  // map active segment for mapped appends, under `map_lock_`
+  Status MapActive();
+  // continue on a new mapped segment after full `region`
+  Status RollMapped(MappedRegion* region);
+  // make segment `id` active at `offset`
+  // `fresh` truncates and preallocates it, `fresh` or `append`
+  // opens it for direct append in direct mode
+  Status OpenSegment(uint64_t id, size_t offset, bool fresh, bool append = false);
+  // write whole blocks covering [cur, cur + len) from staging buffer
+  Status WriteAligned(size_t cur, const char* data, size_t len);
+  // seal and sync active segment, continue on a new one
+  Status Roll();
+  // drop live segments and start empty log after them
+  Status Reset();
+  // zero active segment after cursor and unlink segments after it,
+  // a new frame must not line up with stale ones behind it
+  Status DropStale();
+  // make room for `len` bytes at `cur`, rolling a full segment
+  Status Reserve(size_t len, size_t& cur, IoEngine* engine);
+  // make range [offset, offset + len) of active segment resident
+  Status Fill(size_t offset, size_t len);
+  // verify frame at cursor and advance past it
+  Status NextFrame();
 };
 
 } // namespace portal_db
 
-#endif // PORTAL_DB_BIN_LOGGER_H_
\ No newline at end of file
+#endif // PORTAL_DB_BIN_LOGGER_H_
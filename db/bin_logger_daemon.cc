@@ -1,54 +1,208 @@
 #include "bin_logger_daemon.h"
 
+#include <chrono>
+#include <cstring>
+
 namespace portal_db {
 
-bool BinLoggerDaemon::Enqueue(OpStruct* node) {
-  OpStruct* n = node;
-  OpStruct *t, *s;
-  n->next = NULL;
-  while(true) {
-    t = tail_.load();
-    s = t->next;
-    if( t == tail_) {
-      if(s == NULL) {
-        if(std::atomic_compare_exchange_strong(&t->next, &s, n)){
-          std::atomic_compare_exchange_strong(&tail_, &t, n);
-          return true;
-        }
+char* BinLoggerDaemon::Place(Slot& slot, 
+                             size_t ticket, 
+                             size_t length, 
+                             uint64_t& lsn) {
+  slot.region = NULL;
+  slot.stamp = lsn = 0;
+  if(mode() != LogMode::kMapped && sequence_ == NULL) return slot.entry;
+  // stamps and offsets follow tickets: stamps ascend through the file
+  // of each logger, and frames before a committed one belong to
+  // committed tickets so no hole can end the segment early
+  Stall([&]() -> bool { 
+    return placed_.load(std::memory_order_acquire) == ticket; 
+  });
+  char* dst = slot.entry;
+  if(length > 0) {
+    slot.stamp = lsn = Stamp();
+    if(lsn) length += 8;
+  }
+  if(length > 0 && mode() == LogMode::kMapped) {
+    if(ReserveMapped(header_ + length, slot.region, dst).inspect()) {
+      slot.offset = dst - slot.region->base;
+      slot.lsn = NextLsn(); // frame lsns ascend in file
+      dst += header_;
+    } else {
+      slot.region = NULL; // daemon appends it
+      dst = slot.entry;
+    }
+  }
+  placed_.store(ticket + 1, std::memory_order_release);
+  Unstall();
+  return dst;
+}
+size_t BinLoggerDaemon::Publish(Slot& slot, size_t ticket) {
+  if(slot.region != NULL) {
+    char* frame = slot.region->base + slot.offset;
+    EncodeHeader(frame, slot.lsn, slot.length);
+    slot.length += header_;
+    Written(slot.region, slot.length);
+  }
+  slot.seq.store(ticket + 1, std::memory_order_release);
+  // pairs with fence in `Idle`: either daemon sees slot or we see it
+  // sleeping, store-load order needs a full fence on both sides
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(sleeping_.load()) {
+    std::lock_guard<std::mutex> lk(lock_);
+    pending_.notify_one();
+  }
+  return ticket + 1; // start from 1
+}
+void BinLoggerDaemon::Commit(size_t version, uint64_t stamp) {
+  if(failed_.load()) return; // later ops may depend on lost ones
+  Raise(stamp);
+  finished_version_ = version;
+  if(waiters_.load() > 0) {
+    std::lock_guard<std::mutex> lk(lock_);
+    committed_.notify_all();
+  }
+}
+void BinLoggerDaemon::Fail(const Status& status) {
+  std::lock_guard<std::mutex> lk(lock_);
+  if(!failed_.load()) {
+    error_ = status;
+    failed_ = true;
+  }
+  committed_.notify_all();
+}
+void BinLoggerDaemon::Idle(bool timed) {
+  std::unique_lock<std::mutex> lk(lock_);
+  sleeping_ = true;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  auto ready = [&]() -> bool {
+    return Ready() || close_.load();
+  };
+  if(timed) pending_.wait_for(lk, std::chrono::milliseconds(sync_interval_), ready);
+  else pending_.wait(lk, ready);
+  sleeping_ = false;
+}
+size_t BinLoggerDaemon::Gather(Batch& batch) {
+  size_t last = 0;
+  batch.length = header_;
+  batch.compact = false;
+  batch.stamp = 0;
+  batch.ranges.clear();
+  // bounded by ring, so frame fits `data`
+  for(size_t n = 0; n < ring_size_ && Ready(); n++) {
+    Slot& slot = ring_[read_ & (ring_size_ - 1)];
+    last = ++ read_;
+    batch.compact = slot.type == kCompact;
+    if(slot.stamp) batch.stamp = slot.stamp; // ascend with tickets
+    if(slot.region != NULL) { // in place, flush covers it
+      size_t end = slot.offset + slot.length;
+      if(batch.ranges.empty() || batch.ranges.back().region != slot.region) {
+        batch.ranges.push_back({slot.region, slot.offset, end});
       } else {
-        std::atomic_compare_exchange_strong(&tail_, &t, s);
+        MappedRange& range = batch.ranges.back();
+        range.begin = min(range.begin, slot.offset);
+        range.end = max(range.end, end);
       }
+    } else if(!batch.compact) {
+      memcpy(batch.data.data() + batch.length, slot.entry, slot.length);
+      batch.length += slot.length;
     }
+    // release slot for producer one lap ahead
+    slot.seq.store(last - 1 + ring_size_, std::memory_order_release);
+    if(batch.compact) break;
   }
+  if(last > 0) Unstall();
+  batch.last = last;
+  return last;
 }
-bool BinLoggerDaemon::Dequeue(OpStruct& ret) { // single-thread
-  OpStruct *first;
-  first = head_->next;
-  if(first == NULL) return false;
-  first = head_;
-  head_ = head_->next.load();
-  ret = *head_;
-  delete first;
-  return true;
+void BinLoggerDaemon::Submit(Batch& batch) {
+  batch.start = std::chrono::steady_clock::now();
+  batch.ticket = engine_.issued();
+  batch.status = Status::OK();
+  bool sync = durability_ == Durability::kCommit;
+  if(mode() == LogMode::kMapped) { // frames already in place
+    if(sync) {
+      for(const MappedRange& range : batch.ranges) 
+        batch.status *= FlushMapped(range.region, range.begin, range.end);
+    }
+    batch.status *= RetireMapped();
+  }
+  if(batch.length == header_) return; // compaction or mapped only
+  size_t raw = batch.length - header_;
+  size_t packed = 0;
+  if(raw >= pack_threshold_) 
+    packed = Pack(batch.packed.data() + header_, batch.data.data() + header_, raw);
+  const char* frame = batch.data.data();
+  size_t length = batch.length;
+  if(packed > 0) {
+    frame = batch.packed.data();
+    length = header_ + packed;
+    EncodeHeader(batch.packed.data(), NextLsn(), packed, true);
+  } else {
+    EncodeHeader(batch.data.data(), NextLsn(), raw);
+  }
+  // nothing to overlap with, skip queue round trip
+  // direct appends share one staging buffer, mapped ones take no writes
+  if(mode() != LogMode::kBuffered || (inflight_ == 0 && !Ready())) {
+    batch.status *= BinLogger::AppendRaw(frame, length);
+    if(batch.status.ok() && sync) batch.status *= Sync();
+    return;
+  }
+  batch.status *= AppendAsync(engine_, frame, length, sync, batch.ticket);
+}
+void BinLoggerDaemon::Retire(size_t keep) {
+  while(inflight_ > 0) {
+    Batch& batch = batches_[first_];
+    if(inflight_ <= keep && !engine_.Done(batch.ticket)) break;
+    Status status = batch.status;
+    status *= engine_.Wait(batch.ticket);
+    latency_ = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - batch.start).count();
+    // checkpoint is behind every write of earlier batches
+    if(batch.compact && status.ok() && !failed_.load()) 
+      status *= BinLogger::Compact();
+    if(!status.ok()) Fail(status);
+    Commit(batch.last, batch.stamp);
+    first_ = (first_ + 1) % max_inflight_;
+    inflight_ --;
+  }
 }
 void BinLoggerDaemon::DaemonThread() {
-  OpStruct cur(0);
-  while(!close_.load()) {
-    if(Dequeue(cur)) {
-      size_t v = cur.version;
-      if(cur.key == NULL) {
-        BinLogger::Compact();
-        finished_version_ = v; // bug
-      }
-      else if(cur.value == NULL){
-        BinLogger::AppendDelete(*cur.key);
-        finished_version_ = v;
-      } 
-      else {
-        BinLogger::AppendPut(*cur.key, *cur.value);
-        finished_version_ = v;
-      }
-    } else std::this_thread::yield();
+  auto last_sync = std::chrono::steady_clock::now();
+  bool unsynced = false;
+  size_t idle = 0;
+  while(true) {
+    // ops enqueued before close are still flushed
+    bool closing = close_.load();
+    if(inflight_ == max_inflight_) Retire(max_inflight_ - 1);
+    // group commit: drain contiguous published slots into one frame
+    Batch& batch = batches_[(first_ + inflight_) % max_inflight_];
+    size_t last = Gather(batch);
+    if(last > 0) {
+      unsynced = unsynced || batch.length > header_ || !batch.ranges.empty();
+      Submit(batch);
+      inflight_ ++;
+      idle = 0;
+    }
+    auto now = std::chrono::steady_clock::now();
+    bool due = durability_ == Durability::kInterval && unsynced && 
+      (closing || now - last_sync >= std::chrono::milliseconds(sync_interval_));
+    if(due) { // sync covers every write issued
+      Retire(0);
+      Status status = Sync();
+      if(!status.ok()) Fail(status);
+      last_sync = now;
+      unsynced = false;
+    }
+    if(durability_ == Durability::kCommit) unsynced = false; // linked syncs
+    if(last > 0 && Ready()) Retire(max_inflight_); // keep gathering
+    else if(inflight_ > 0) Retire(inflight_ - 1); // wait for oldest
+    else if(closing) break;
+    else if(++idle < spin_) std::this_thread::yield();
+    else {
+      latency_ = 0; // nothing in flight to slow down
+      Idle(unsynced);
+    }
   }
 }
 
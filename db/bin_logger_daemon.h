@@ -5,106 +5,302 @@
 #include "portal_db/piece.h"
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <thread>
+#include <vector>
 
 namespace portal_db {
 
+// durability of an acknowledged operation
+// + kNone -- never sync, caller does not wait for log
+// + kInterval -- caller waits for log write, sync every `sync_interval_`
+// + kCommit -- caller waits for sync of its batch
+enum class Durability { kNone, kInterval, kCommit };
+
 class BinLoggerDaemon : public BinLogger {
-  // struct for pending operation
-  // unsafe reference
-  struct OpStruct {
-    const Key* key = NULL;
-    const Value* value = NULL;
-    size_t version;
-    std::atomic<OpStruct*> next = NULL;
-    OpStruct(size_t ver, const Key& k, const Value& v)
-        : version(ver),
-          key(&k),
-          value(&v) { }
-    OpStruct(size_t ver, const Key& k)
-        : version(ver),
-          key(&k),
-          value(NULL) { }
-    OpStruct(size_t ver)
-        : version(ver), 
-          key(NULL), 
-          value(NULL) { }
-    OpStruct(OpStruct&& rhs)
-        : key(rhs.key),
-          value(rhs.value),
-          version(rhs.version),
-          next(rhs.next.load()) { }
-    OpStruct(const OpStruct& rhs)
-        : key(rhs.key),
-          value(rhs.value),
-          version(rhs.version),
-          next(rhs.next.load()) { }
-    OpStruct& operator=(const OpStruct& rhs) {
-      key = rhs.key;
-      value = rhs.value;
-      version = rhs.version;
-      next = rhs.next.load();
-      return *this;
-    }
+  // ring slot holding one encoded entry
+  // `seq` == ticket: free for producer of that ticket
+  // `seq` == ticket + 1: published for daemon
+  // in mapped mode the frame is placed at `offset` of `region` instead
+  struct alignas(64) Slot {
+    std::atomic<size_t> seq;
+    uint8_t type; // BinLogger::EntryType or `kCompact`
+    uint32_t length;
+    MappedRegion* region;
+    size_t offset;
+    uint64_t lsn; // of frame
+    uint64_t stamp; // of entry, 0 if not sequenced
+    char entry[max_entry_];
   };
+  static constexpr uint8_t kCompact = 0xff;
  public:
-  BinLoggerDaemon(std::string name)
-      : BinLogger(name),
+  // `sequence` stamps each entry with a global lsn shared across loggers
+  // `mode` of appends, see `BinLogger`, mapped appends are framed
+  // per entry by producers and only flushed by daemon
+  BinLoggerDaemon(std::string name, 
+                  Durability durability = Durability::kInterval,
+                  std::atomic<uint64_t>* sequence = NULL,
+                  LogMode mode = LogMode::kBuffered,
+                  size_t segment_size = default_segment_)
+      : BinLogger(name, segment_size, mode),
+        durability_(durability),
+        sequence_(sequence),
+        ring_(new Slot[ring_size_]),
         close_(false),
-        version_(1),
-        finished_version_(0) {
-    head_ = new OpStruct(0); // dummy
-    tail_ = head_;
+        version_(0),
+        finished_version_(0),
+        durable_(0),
+        placed_(0),
+        waiters_(0),
+        stalled_(0),
+        sleeping_(false),
+        latency_(0),
+        failed_(false),
+        engine_(max_inflight_) {
+    for(size_t i = 0; i < ring_size_; i++) ring_[i].seq = i;
+    // fixed buffers, pinned once for the engine
+    std::vector<IoSlice> buffers;
+    for(size_t i = 0; i < max_inflight_; i++) {
+      batches_[i].data.resize(max_batch_);
+      batches_[i].packed.resize(header_ + MaxPacked(max_batch_ - header_));
+      buffers.push_back({batches_[i].data.data(), batches_[i].data.size()});
+      buffers.push_back({batches_[i].packed.data(), batches_[i].packed.size()});
+    }
+    engine_.Register(buffers.data(), buffers.size());
     daemon_ = std::thread(
-      std::mem_fn(&BinLoggerDaemon::DaemonThread), 
+      std::mem_fn(&BinLoggerDaemon::DaemonThread),
       this
     ); // late init
   }
   Status Close() {
     close_.store(true);
-    daemon_.join();
+    {
+      std::lock_guard<std::mutex> lk(lock_);
+      pending_.notify_one();
+    }
+    if(daemon_.joinable()) daemon_.join();
     return BinLogger::Close();
   }
   // operation enqueue family //
-  size_t AppendDelete(const Key& key) {
-    // bug: use stack variable
-    OpStruct* op = new OpStruct(std::atomic_fetch_add(&version_, 1), key);
-    Enqueue(op);
-    return op->version;
+  // return version to wait for, versions commit in order
+  // `stamp` receives global lsn of entry, 0 if not sequenced
+  size_t AppendDelete(const Key& key, uint64_t* stamp = NULL) {
+    size_t ticket;
+    Slot& slot = Acquire(ticket);
+    slot.type = kDelete;
+    uint64_t lsn;
+    char* dst = Place(slot, ticket, 1 + 8, lsn);
+    slot.length = static_cast<uint32_t>(EncodeDelete(dst, key, lsn));
+    if(stamp) *stamp = lsn;
+    return Publish(slot, ticket);
   }
-  size_t AppendPut(const Key& key, const Value& value) {
-    OpStruct* op = new OpStruct(std::atomic_fetch_add(&version_, 1), key, value);
-    Enqueue(op);
-    return op->version;
+  size_t AppendPut(const Key& key, const Value& value, uint64_t* stamp = NULL) {
+    size_t ticket;
+    Slot& slot = Acquire(ticket);
+    slot.type = kPut;
+    uint64_t lsn;
+    char* dst = Place(slot, ticket, 1 + 8 + 256, lsn);
+    slot.length = static_cast<uint32_t>(EncodePut(dst, key, value, lsn));
+    if(stamp) *stamp = lsn;
+    return Publish(slot, ticket);
   }
   size_t Compact() {
-    OpStruct* op = new OpStruct(std::atomic_fetch_add(&version_, 1));
-    Enqueue(op);
-    return op->version;
-  }
-  // busy wait
-  void Wait(size_t version) {
-    while(true) {
-      size_t v = finished_version_.load();
-      if(v >= version || version-v > 0x7fffffff) return;
-      else std::this_thread::yield();
-    }
+    size_t ticket;
+    Slot& slot = Acquire(ticket);
+    slot.type = kCompact;
+    slot.length = 0;
+    uint64_t lsn;
+    Place(slot, ticket, 0, lsn);
+    return Publish(slot, ticket);
+  }
+  // spin for a short while, then block until daemon commits `version`
+  // error of failed log write or sync if it never will
+  Status Wait(size_t version) {
+    return Await([&]() -> bool { return Finished(version); });
   }
+  // true once daemon committed `version`, never blocks
+  bool Committed(size_t version) const { return Finished(version); }
+  // stamped entries commit in lsn order on each logger, so every
+  // entry of this logger stamped up to `lsn` is committed once
+  // + the newest committed stamp reaches it, or
+  // + every op issued is committed, later ones stamp past the global
+  //    lsn read before
+  // stays true once true, never blocks, false once failed
+  bool Durable(uint64_t lsn) const {
+    if(failed_.load()) return false;
+    if(lsn <= durable_.load()) return true;
+    uint64_t next = sequence_ ? sequence_->load() : 0;
+    if(next > 0 && Finished(version_.load())) Raise(next - 1);
+    return lsn <= durable_.load();
+  }
+  // block until `Durable(lsn)`, error if it never will
+  Status WaitDurable(uint64_t lsn) {
+    return Await([&]() -> bool { return Durable(lsn); });
+  }
+  Durability durability() const { return durability_; }
+  // version of latest op issued
+  size_t issued() const { return version_.load(); }
+  // write and sync time of latest group commit, in microseconds
+  uint64_t latency() const { return latency_.load(); }
  private:
-  OpStruct* head_;
-  std::atomic<OpStruct*> tail_;
+  // sync period of `Durability::kInterval`
+  static constexpr size_t sync_interval_ = 100; // 0.1 sec
+  // polls before a waiter, stalled producer or idle daemon blocks
+  static constexpr size_t spin_ = 64;
+  // pending entries before producers stall, power of 2
+  static constexpr size_t ring_size_ = 1024;
+  const Durability durability_;
+  std::atomic<uint64_t>* const sequence_;
+  std::unique_ptr<Slot[]> ring_;
   std::atomic<bool> close_;
-  std::atomic<size_t> version_; // start from 1
-  std::atomic<size_t> finished_version_; // latest finished op
+  // producer and consumer cursors on separate lines
+  alignas(64) std::atomic<size_t> version_; // next ticket
+  alignas(64) std::atomic<size_t> finished_version_; // latest finished op
+  // every entry stamped up to it is committed
+  mutable std::atomic<uint64_t> durable_;
+  alignas(64) std::atomic<size_t> placed_; // next ticket to place
+  size_t read_ = 0; // next ticket to consume, daemon only
   std::thread daemon_;
-  // concurrent enqueue
-  bool Enqueue(OpStruct* node);
-  // single-thread dequeue
-  bool Dequeue(OpStruct& ret);
+  // blocking wakeups, signaled only when someone sleeps
+  std::mutex lock_;
+  std::condition_variable committed_; // waiters on `finished_version_`
+  std::condition_variable pending_; // idle daemon on queue
+  std::condition_variable freed_; // producers on ring slot or placement
+  std::atomic<size_t> waiters_;
+  std::atomic<size_t> stalled_;
+  std::atomic<bool> sleeping_;
+  std::atomic<uint64_t> latency_;
+  // first write or sync failure, nothing commits after it
+  std::atomic<bool> failed_;
+  Status error_; // guarded by `lock_`
+  // batches at least this large are compressed
+  static constexpr size_t pack_threshold_ = 1024;
+  // group commit frames written while next one is gathered
+  static constexpr size_t max_inflight_ = 4;
+  static constexpr size_t max_batch_ = header_ + ring_size_ * max_entry_;
+  // mapped frames of a batch within one region
+  struct MappedRange {
+    MappedRegion* region;
+    size_t begin;
+    size_t end;
+  };
+  // group commit frame from submission to commit
+  struct Batch {
+    std::vector<char> data; // header and entries
+    std::vector<MappedRange> ranges; // placed in mapping
+    std::vector<char> packed; // header and compressed entries
+    size_t length = 0; // of `data`
+    size_t last = 0; // version committed with it
+    uint64_t stamp = 0; // newest entry lsn in it, 0 if none
+    bool compact = false;
+    uint64_t ticket = 0;
+    Status status; // of inline write or submission
+    std::chrono::steady_clock::time_point start;
+  };
+  IoEngine engine_;
+  Batch batches_[max_inflight_];
+  size_t first_ = 0; // oldest batch in flight
+  size_t inflight_ = 0;
+  // spin for a short while, then block until `done` holds or daemon
+  // fails, `done` only turns true on commit
+  template <typename Predicate>
+  Status Await(Predicate done) {
+    for(size_t i = 0; i < spin_; i++) {
+      if(done()) return Status::OK();
+      if(failed_.load()) break;
+      std::this_thread::yield();
+    }
+    std::unique_lock<std::mutex> lk(lock_);
+    waiters_ ++;
+    committed_.wait(lk, [&]() -> bool { 
+      return done() || failed_.load(); 
+    });
+    waiters_ --;
+    return done() ? Status::OK() : error_;
+  }
+  // claim the slot of next ticket, stall while ring is full
+  Slot& Acquire(size_t& ticket) {
+    ticket = std::atomic_fetch_add(&version_, 1);
+    Slot& slot = ring_[ticket & (ring_size_ - 1)];
+    size_t expected = ticket;
+    Stall([&]() -> bool { 
+      return slot.seq.load(std::memory_order_acquire) == expected; 
+    });
+    return slot;
+  }
+  // spin for a short while, then block until `ready` holds
+  // woken by `Unstall`, callers may hold locks of their own
+  template <typename Predicate>
+  void Stall(Predicate ready) {
+    for(size_t i = 0; i < spin_; i++) {
+      if(ready()) return;
+      std::this_thread::yield();
+    }
+    std::unique_lock<std::mutex> lk(lock_);
+    stalled_ ++;
+    // pairs with fence in `Unstall`, like `Idle` and `Publish`
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    freed_.wait(lk, ready);
+    stalled_ --;
+  }
+  // wake stalled producers once slots are freed or a ticket placed
+  void Unstall() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(stalled_.load() > 0) {
+      std::lock_guard<std::mutex> lk(lock_);
+      freed_.notify_all();
+    }
+  }
+  // lsn taken after slot, so an op issued on any logger before
+  // another op's lsn is covered by `issued` of its logger
+  uint64_t Stamp() {
+    return sequence_ ? std::atomic_fetch_add(sequence_, (uint64_t)1) : 0;
+  }
+  // where to encode entry of `length` bytes before stamp, every
+  // ticket passes here once and in order when stamped or mapped
+  // stamps `lsn` of a sequenced entry, 0 if none
+  // reserves its frame in mapped mode, falls back to slot entry if
+  // mapping fails
+  char* Place(Slot& slot, size_t ticket, size_t length, uint64_t& lsn);
+  // hand filled slot to daemon, return its version
+  // frames a placed entry first
+  size_t Publish(Slot& slot, size_t ticket);
+  bool Ready() const {
+    const Slot& slot = ring_[read_ & (ring_size_ - 1)];
+    return slot.seq.load(std::memory_order_acquire) == read_ + 1;
+  }
+  bool Finished(size_t version) const {
+    size_t v = finished_version_.load();
+    return v >= version || version - v > 0x7fffffff;
+  }
+  // raise `durable_` to `lsn`, by daemon and pollers
+  void Raise(uint64_t lsn) const {
+    uint64_t cur = durable_.load();
+    while(cur < lsn && !durable_.compare_exchange_weak(cur, lsn)) { }
+  }
+  // publish committed version and newest `stamp` with it, if any,
+  // and wake blocked waiters
+  // no-op once failed
+  void Commit(size_t version, uint64_t stamp);
+  // stop committing and fail waiters with `status`
+  void Fail(const Status& status);
+  // drain published slots into `batch`, return its last version
+  size_t Gather(Batch& batch);
+  // encode and queue frame of `batch`
+  void Submit(Batch& batch);
+  // commit finished batches in order, block until at most `keep`
+  // remain in flight
+  void Retire(size_t keep);
+  // block daemon until op published or closed
+  // `timed` wakes up after `sync_interval_` for pending sync
+  void Idle(bool timed);
   // instantiates as daemon thread
   void DaemonThread();
 };
 
 } // namespace portal_db
 
-#endif // PORTAL_DB_BIN_LOGGER_DAEMON_H_
\ No newline at end of file
+#endif // PORTAL_DB_BIN_LOGGER_DAEMON_H_
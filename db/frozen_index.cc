@@ -0,0 +1,64 @@
+#include "frozen_index.h"
+
+#include <cstring>
+
+namespace portal_db {
+
+FrozenIndex::FrozenIndex(const std::vector<Entry>& entries)
+    : size_(entries.size()),
+      records_(new char[entries.size() * record_size_ + 1]),
+      keys_(new uint64_t[entries.size() + 1]),
+      eytzinger_(new uint64_t[entries.size() + 1]),
+      rank_(new uint32_t[entries.size() + 1]),
+      erased_(new std::atomic<bool>[entries.size() + 1]) {
+  for(size_t i = 0; i < size_; i++) {
+    keys_[i] = entries[i].first;
+    memcpy(records_.get() + i * record_size_, entries[i].second, record_size_);
+    erased_[i].store(false);
+  }
+  Layout(0, 1);
+}
+
+size_t FrozenIndex::Layout(size_t pos, size_t slot) {
+  if(slot > size_) return pos;
+  pos = Layout(pos, slot * 2);
+  eytzinger_[slot] = keys_[pos];
+  rank_[slot] = static_cast<uint32_t>(pos);
+  return Layout(pos + 1, slot * 2 + 1);
+}
+
+size_t FrozenIndex::LowerBound(const Key& key) const {
+  if(key.empty()) return size_; // +inf
+  uint64_t target = Encode(key.raw_ptr());
+  size_t slot = 1;
+  while(slot <= size_) {
+    slot = slot * 2 + (eytzinger_[slot] < target);
+  }
+  // strip trailing right turns and the last left turn
+  while(slot & 1) slot >>= 1;
+  slot >>= 1;
+  return slot == 0 ? size_ : rank_[slot];
+}
+
+size_t FrozenIndex::Find(const Key& key) const {
+  size_t pos = LowerBound(key);
+  if(pos < size_ && keys_[pos] == Encode(key.raw_ptr())) return pos;
+  return size_;
+}
+
+Status FrozenIndex::Get(const Key& key, Value& ret) const {
+  size_t pos = Find(key);
+  if(pos == size_ || erased_[pos].load())
+    return Status::NotFound("missing frozen match");
+  ret.copy<0, 256>(record(pos) + 8);
+  return Status::OK();
+}
+
+Status FrozenIndex::Delete(const Key& key) {
+  size_t pos = Find(key);
+  if(pos == size_ || erased_[pos].exchange(true))
+    return Status::NotFound("missing frozen match");
+  return Status::OK();
+}
+
+} // namespace portal_db
@@ -0,0 +1,63 @@
+#ifndef PORTAL_DB_FROZEN_INDEX_H_
+#define PORTAL_DB_FROZEN_INDEX_H_
+
+#include "portal_db/piece.h"
+#include "portal_db/status.h"
+#include "util/util.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace portal_db {
+
+// Immutable, key-sorted image of a HashTrie.
+// + records -- dense array of key-value (8 + 256 byte), sorted by key
+// + search -- keys laid out in eytzinger (bfs) order, so a lower bound
+//    probe touches one cache line per level near the root
+// + erased -- tombstone per record, the only mutable part
+class FrozenIndex : public NoMove {
+ public:
+  using Entry = std::pair<uint64_t, const char*>; // (encoded key, record)
+  static constexpr size_t record_size_ = 8 + 256;
+  // `entries` must be sorted by encoded key without duplicates
+  FrozenIndex(const std::vector<Entry>& entries);
+  ~FrozenIndex() { }
+  Status Get(const Key& key, Value& ret) const;
+  // mark as erased, record stays in place
+  Status Delete(const Key& key);
+  // position of first record not less than `key`
+  // empty key stands for +inf
+  size_t LowerBound(const Key& key) const;
+  size_t size() const { return size_; }
+  bool erased(size_t pos) const { return erased_[pos].load(); }
+  const char* record(size_t pos) const {
+    return records_.get() + pos * record_size_;
+  }
+  uint64_t key(size_t pos) const { return keys_[pos]; }
+  // order-preserving encoding of 8 byte key
+  // flip sign bit to keep the signed char order of `Key`
+  static uint64_t Encode(const char* p) {
+    uint64_t ret = 0;
+    for(int i = 0; i < 8; i++)
+      ret = (ret << 8) | (static_cast<unsigned char>(p[i]) ^ 0x80);
+    return ret;
+  }
+ private:
+  size_t size_;
+  std::unique_ptr<char[]> records_;
+  std::unique_ptr<uint64_t[]> keys_; // sorted order
+  std::unique_ptr<uint64_t[]> eytzinger_; // 1-based bfs order
+  std::unique_ptr<uint32_t[]> rank_; // eytzinger slot -> sorted position
+  std::unique_ptr<std::atomic<bool>[]> erased_;
+  // fill eytzinger layout by in-order traversal
+  size_t Layout(size_t pos, size_t slot);
+  // position of exact match, or size_
+  size_t Find(const Key& key) const;
+};
+
+} // namespace portal_db
+
+#endif // PORTAL_DB_FROZEN_INDEX_H_
@@ -1,4 +1,9 @@
 #include "hash_trie.h"
+#include "util/crc32c.h"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
 
 namespace portal_db {
 
@@ -29,11 +34,13 @@ Status HashTrie::Get(const Key& key, Value& ret) {
         cur = (cur+ 2*offset - 1) % hash_size_;
         offset++;
       } while( offset < probe_depth_ && cur != hash_val);
-      return Status::NotFound("missing key match");
+      break; // missing key match
     }
     level ++;
   }
-  return Status::NotFound("missing level match");
+  // fall back to frozen records
+  if(frozen_) return frozen_->Get(key, ret);
+  return Status::NotFound("missing key match");
 }
 Status HashTrie::Put(const Key& key, const Value& value) {
   HashTrieNode<hash_size_>::UnsafeRef node = nodes_[0];
@@ -69,6 +76,7 @@ Status HashTrie::Put(const Key& key, const Value& value) {
       // only value may be stale
       if(node->forward[key[level]] < 0)
         goto CHECK_LEVEL; // no bad mod to pointer
+      IndexInsert(node, hnode.value); // may revive deleted slot
       return Status::OK();
     }
     cur = (cur+ 2*offset - 1) % hash_size_;
@@ -96,6 +104,7 @@ Status HashTrie::Put(const Key& key, const Value& value) {
         char* p = values_.Get(hnode.value);
         memcpy(p, key.raw_ptr(), 8);
         value.write<0, 256>(p + 8);
+        values_.Touch(hnode.value);
         tmp = hnode.pointer; // assumed old head
         // insert as linked-list head
         while(!std::atomic_compare_exchange_strong(
@@ -111,6 +120,7 @@ Status HashTrie::Put(const Key& key, const Value& value) {
           }
           hnode.pointer = tmp; // point to new head
         }
+        IndexInsert(node, hnode.value);
         return Status::OK();
       }
       // or preempted
@@ -150,15 +160,18 @@ Status HashTrie::Delete(const Key& key) {
       do{
         HashNode& hnode = node->table[cur];
         if(hnode.pointer != 0 && check_delete(hnode.value, key, level)) {
+          IndexErase(node, FrozenIndex::Encode(key.raw_ptr()));
+          if(frozen_) frozen_->Delete(key); // shadowed copy
           return Status::OK();
         }
         cur = (cur+ 2*offset - 1) % hash_size_;
         offset++;
       } while( offset < probe_depth_ && cur != hash_val);
-      return Status::NotFound("missing key match");
+      break; // missing key match
     }
     level ++;
   }
+  if(frozen_) return frozen_->Delete(key);
   return Status::NotFound("missing key match");
 }
 Status HashTrie::Scan(const Key& lower, const Key& upper, HashTrieIterator& ret) {
@@ -166,16 +179,34 @@ Status HashTrie::Scan(const Key& lower, const Key& upper, HashTrieIterator& ret)
   ret.upper = upper;
   ret.lower = lower;
   ret.path_ = lower;
+  ret.lower_code_ = lower.empty() ? 0 : FrozenIndex::Encode(lower.raw_ptr());
+  ret.upper_code_ = upper.empty() ? 0 : FrozenIndex::Encode(upper.raw_ptr());
+  if(frozen_) {
+    ret.frozen_pos_ = lower.empty() ? 0 : frozen_->LowerBound(lower);
+    ret.frozen_end_ = frozen_->LowerBound(upper);
+  } else {
+    ret.frozen_pos_ = ret.frozen_end_ = 0;
+  }
+  for(int i = 0; i < 8; i++) ret.path_[i] = lower[i]; // materialize
   HashTrieNode<hash_size_>::UnsafeRef node = nodes_[0];
   int32_t tmp;
+  bool bounded = true; // still on the path of `lower`
   char c = lower[0];
-  while(c >= 0) {
-    if(( tmp=node->forward[c]) < 0) {
+  while(true) {
+    if(c < 0) { // branches exhausted, ascend
+      if(node->level == 0) break;
+      ret.path_[node->level] = 0;
+      c = node->branch + 1;
+      node = nodes_[node->parent];
+      bounded = false;
+    } else if(( tmp=node->forward[c]) < 0) {
       assert(-tmp < nodes_.size());
+      ret.path_[node->level] = c; // record descend path
       node = nodes_[-tmp];
-      c = lower[node->level];
+      c = bounded ? lower[node->level] : 0;
     } else if(tmp == 0x0fffffff) {
       c ++;
+      bounded = false;
     } else { // hit
       ret.node_id_ = node->id;
       ret.path_[node->level] = c;
@@ -185,8 +216,258 @@ Status HashTrie::Scan(const Key& lower, const Key& upper, HashTrieIterator& ret)
     }
   }
   ret.node_id_ = -1; // no hit at all
+  if(ret.frozen_pos_ < ret.frozen_end_) return Status::OK();
   return Status::NotFound("no key found in this range");
 }
+Status HashTrie::ParallelScan(const Key& lower, 
+                              const Key& upper, 
+                              size_t n, 
+                              ParallelIterator& ret) {
+  ret.Close();
+  HashTrieNode<hash_size_>::UnsafeRef node = nodes_[0];
+  char first = lower.empty() ? 0 : lower[0];
+  char last = upper.empty() ? 127 : upper[0];
+  // frozen records may lie under any branch
+  std::vector<char> branches;
+  for(char c = first; c >= 0 && c <= last; c++) {
+    if(frozen_ || node->forward[c] != 0x0fffffff) branches.push_back(c);
+    if(c == 127) break;
+  }
+  if(branches.empty()) return Status::NotFound("no key found in this range");
+  if(n == 0) n = 1;
+  if(n > branches.size()) n = branches.size();
+  // partition k covers [start(k), start(k+1))
+  Key start = lower;
+  for(size_t k = 0; k < n; k++) {
+    Key end = upper;
+    if(k + 1 < n) 
+      end = Key::from_string(std::string(1, branches[(k + 1) * branches.size() / n]));
+    ret.partitions_.push_back(std::make_unique<ParallelIterator::Partition>(ret.sort));
+    Scan(start, end, ret.partitions_.back()->iterator);
+    start = end;
+  }
+  ret.Start(&scan_pool_);
+  return Status::OK();
+}
+Status HashTrie::Freeze() {
+  std::vector<FrozenIndex::Entry> entries;
+  if(frozen_) {
+    for(size_t i = 0; i < frozen_->size(); i++) {
+      if(!frozen_->erased(i))
+        entries.push_back(FrozenIndex::Entry(frozen_->key(i), frozen_->record(i)));
+    }
+  }
+  // collect live records chained in every node
+  for(size_t i = 0; i < nodes_.size(); i++) {
+    HashTrieNode<hash_size_>::UnsafeRef node = nodes_[i];
+    for(int c = 0; c < 256; c++) {
+      int32_t idx = node->forward[c];
+      while(idx > 0 && idx != 0x0fffffff) {
+        HashNode& hnode = node->table[idx - 1];
+        idx = hnode.pointer;
+        char* p = values_.Get(hnode.value);
+        if(p == NULL) return Status::Corruption("null entry");
+        if(*(reinterpret_cast<uint64_t*>(p)) == 0) continue; // deleted
+        entries.push_back(FrozenIndex::Entry(FrozenIndex::Encode(p), p));
+      }
+    }
+  }
+  // delta records follow frozen ones, keep the last of equal keys
+  std::stable_sort(entries.begin(), entries.end(),
+    [](const FrozenIndex::Entry& a, const FrozenIndex::Entry& b) {
+      return a.first < b.first;
+    });
+  size_t size = 0;
+  for(size_t i = 0; i < entries.size(); i++) {
+    if(size > 0 && entries[size - 1].first == entries[i].first)
+      entries[size - 1] = entries[i];
+    else entries[size++] = entries[i];
+  }
+  entries.resize(size);
+  frozen_ = std::make_unique<FrozenIndex>(entries);
+  // reset delta
+  values_.Clear();
+  nodes_.clear();
+  nodes_.push_back(HashTrieNode<hash_size_>::MakeNode(0, 0, 0, 0));
+  return Status::OK();
+}
+
+Status HashTrie::Rebuild(size_t threads) {
+  if(threads == 0) threads = std::thread::hardware_concurrency();
+  threads = min(max(threads, (size_t)1), (size_t)256);
+  size_t size = values_.size();
+  // bin slot ids by owner of first key byte, range by range
+  std::vector<std::vector<std::vector<uint32_t>>> bins(threads);
+  std::vector<std::thread> workers;
+  for(size_t r = 0; r < threads; r++) {
+    workers.push_back(std::thread([&, r]() {
+      bins[r].resize(threads);
+      for(size_t i = r * size / threads; i < (r + 1) * size / threads; i++) {
+        const char* key = values_.Get(i);
+        if(key == NULL) continue;
+        bins[r][static_cast<unsigned char>(key[0]) % threads].push_back(i);
+      }
+    }));
+  }
+  for(size_t r = 0; r < threads; r++) workers[r].join();
+  workers.clear();
+  // insert in slot order within each owner
+  std::vector<Status> status(threads);
+  for(size_t t = 0; t < threads; t++) {
+    workers.push_back(std::thread([&, t]() {
+      for(size_t r = 0; r < threads && status[t].ok(); r++) {
+        const std::vector<uint32_t>& bin = bins[r][t];
+        for(size_t i = 0; i < bin.size() && status[t].ok(); i++) {
+          status[t] *= PutRecover(bin[i]);
+        }
+      }
+    }));
+  }
+  Status ret;
+  for(size_t t = 0; t < threads; t++) {
+    workers[t].join();
+    ret *= status[t];
+  }
+  return ret;
+}
+
+static const char kIndexMagic[8] = {'P', 'T', 'I', 'D', 'X', '0', '0', '1'};
+
+Status HashTrie::SaveIndex() {
+  std::vector<char> image;
+  EncodeIndex(image);
+  return WriteIndex(image);
+}
+
+void HashTrie::EncodeIndex(std::vector<char>& image) {
+  uint64_t count = nodes_.size();
+  uint64_t slices = values_.size();
+  uint32_t generation = static_cast<uint32_t>(values_.generation());
+  image.resize(index_header_ + count * node_record_);
+  char* p = image.data();
+  memset(p, 0, index_header_);
+  memcpy(p, kIndexMagic, 8);
+  memcpy(p + 8, &count, 8);
+  memcpy(p + 16, &slices, 8);
+  memcpy(p + 28, &generation, 4);
+  p += index_header_;
+  for(size_t i = 0; i < count; i++) {
+    HashTrieNode<hash_size_>::UnsafeRef node = nodes_[i];
+    memcpy(p, &node->parent, 4);
+    memcpy(p + 4, &node->id, 4);
+    p[8] = static_cast<char>(node->level);
+    p[9] = node->branch;
+    p[10] = p[11] = 0;
+    p += 12;
+    for(size_t j = 0; j < 256; j++, p += 4) {
+      int32_t forward = node->forward[j].load();
+      memcpy(p, &forward, 4);
+    }
+    for(size_t j = 0; j < hash_size_; j++, p += 8) {
+      int32_t pointer = node->table[j].pointer.load();
+      memcpy(p, &pointer, 4);
+      memcpy(p + 4, &node->table[j].value, 4);
+    }
+  }
+}
+
+Status HashTrie::WriteIndex(std::vector<char>& image, 
+                            const PagedPool<8+256>::Pace& pace) {
+  uint32_t crc = crc32c::Value(image.data() + index_header_, 
+                               image.size() - index_header_);
+  memcpy(image.data() + 24, &crc, 4);
+  Status ret = index_.Open();
+  if(!ret.ok()) return ret;
+  ret *= index_.SetEnd(image.size());
+  // invalidate old header first, a torn image never loads
+  char header[index_header_] = {0};
+  if(ret.ok()) ret *= index_.Write(0, index_header_, header);
+  size_t chunk = index_chunk_ * node_record_;
+  for(size_t offset = index_header_; offset < image.size() && ret.ok(); 
+      offset += chunk) {
+    size_t n = min(chunk, image.size() - offset);
+    if(pace) pace(n);
+    ret *= index_.Write(offset, n, image.data() + offset);
+  }
+  if(ret.ok()) ret *= index_.Write(0, index_header_, image.data());
+  if(ret.ok()) ret *= index_.Sync();
+  ret *= index_.Close();
+  return ret;
+}
+
+Status HashTrie::LoadIndex() {
+  Status ret = index_.Open();
+  if(!ret.ok()) return ret;
+  char header[index_header_];
+  uint64_t count = 0, slices = 0;
+  uint32_t crc = 0, generation = 0;
+  if(index_.size() < index_header_) ret *= Status::NotFound("no index");
+  else ret *= index_.Read(0, index_header_, header);
+  if(ret.ok()) {
+    memcpy(&count, header + 8, 8);
+    memcpy(&slices, header + 16, 8);
+    memcpy(&crc, header + 24, 4);
+    memcpy(&generation, header + 28, 4);
+    if(memcmp(header, kIndexMagic, 8) != 0 || count == 0 ||
+       index_.size() != index_header_ + count * node_record_)
+      ret *= Status::Corruption("bad index header");
+    else if(slices != values_.size() || 
+            generation != static_cast<uint32_t>(values_.generation()))
+      ret *= Status::Corruption("index not of this snapshot");
+  }
+  nodes_.clear();
+  std::vector<char> buffer(index_chunk_ * node_record_);
+  uint32_t actual = 0;
+  for(size_t begin = 0; begin < count && ret.ok(); begin += index_chunk_) {
+    size_t n = min(index_chunk_, static_cast<size_t>(count - begin));
+    ret *= index_.Read(index_header_ + begin * node_record_, 
+                       n * node_record_, buffer.data());
+    if(!ret.ok()) break;
+    actual = crc32c::Extend(actual, buffer.data(), n * node_record_);
+    for(size_t i = 0; i < n; i++) {
+      const char* p = buffer.data() + i * node_record_;
+      int32_t parent, id;
+      memcpy(&parent, p, 4);
+      memcpy(&id, p + 4, 4);
+      auto node = HashTrieNode<hash_size_>::MakeNode(id, parent, 
+        static_cast<unsigned char>(p[8]), p[9]);
+      p += 12;
+      for(size_t j = 0; j < 256; j++, p += 4) {
+        int32_t forward;
+        memcpy(&forward, p, 4);
+        // a link past the image means it was torn by a writer
+        if(forward < 0 && 
+           static_cast<uint64_t>(-static_cast<int64_t>(forward)) >= count)
+          ret *= Status::Corruption("index link exceeds node count");
+        node->forward[j].store(forward);
+      }
+      for(size_t j = 0; j < hash_size_; j++, p += 8) {
+        int32_t pointer;
+        memcpy(&pointer, p, 4);
+        node->table[j].pointer.store(pointer);
+        memcpy(&node->table[j].value, p + 4, 4);
+      }
+      nodes_.push_back(std::move(node));
+    }
+  }
+  if(ret.ok() && actual != crc) ret *= Status::Corruption("index checksum mismatch");
+  index_.Close();
+  if(!ret.ok()) {
+    nodes_.clear();
+    nodes_.push_back(HashTrieNode<hash_size_>::MakeNode(0, 0, 0, 0));
+    return ret;
+  }
+  // sorted lists are not imaged, rebuild from live slots
+  for(size_t i = 0; ordered_ && i < nodes_.size(); i++) {
+    HashTrieNode<hash_size_>::UnsafeRef node = nodes_[i];
+    for(size_t j = 0; j < hash_size_; j++) {
+      if(node->table[j].pointer.load() != 0 && 
+         node->table[j].value < values_.size())
+        IndexInsert(node, node->table[j].value);
+    }
+  }
+  return ret;
+}
 
 Status HashTrie::PutRecover(size_t value_idx) {
   HashTrieNode<hash_size_>::UnsafeRef node = nodes_[0];
@@ -240,6 +521,7 @@ Status HashTrie::PutRecover(size_t value_idx) {
           }
           hnode.pointer = tmp; // point to new head
         }
+        IndexInsert(node, hnode.value);
         return Status::OK();
       }
       // or preempted
@@ -296,6 +578,7 @@ Status HashTrie::PutRecover(size_t value_idx) {
     }
     old_idx = new_idx;
   }
+  IndexEraseBranch(node, key[level]);
   // physically delete old item
   cur_idx = new_idx;
   while(cur_idx != 0x0fffffff) {
@@ -343,6 +626,7 @@ Status HashTrie::PutWithMutationLock(const Key& key,
   char* p = values_.Get(new_record);
   memcpy(p, key.raw_ptr(), 8);
   value.write<0, 256>(p + 8);
+  values_.Touch(new_record);
   status *= PutToIsolatedNode(new_record, new_node_idx);
   if(!status.ok())
     return status;
@@ -363,6 +647,7 @@ Status HashTrie::PutWithMutationLock(const Key& key,
     }
     old_idx = new_idx;
   }
+  IndexEraseBranch(node, key[level]);
   // physically delete old item
   cur_idx = new_idx;
   while(cur_idx != 0x0fffffff) {
@@ -399,6 +684,7 @@ Status HashTrie::PutToIsolatedNode(uint32_t value_idx, int32_t node_idx) {
       hnode.pointer = node->forward[p[level]].load();
       hnode.value = value_idx;
       node->forward[p[level]] = cur + 1;
+      IndexInsert(node, value_idx);
       return Status::OK();
     }
     cur = (cur+ 2*offset - 1) % hash_size_;
@@ -418,6 +704,7 @@ Status HashTrie::PutToIsolatedNode(uint32_t value_idx, int32_t node_idx) {
   int32_t cur_idx = node->forward[p[level]];
   assert(cur_idx > 0);
   node->forward[p[level]] = -new_node_idx; // mutate forward path
+  IndexEraseBranch(node, p[level]);
   Status status;
   // move old record
   while(cur_idx != 0x0fffffff) {
@@ -433,4 +720,40 @@ Status HashTrie::PutToIsolatedNode(uint32_t value_idx, int32_t node_idx) {
   return PutToIsolatedNode(value_idx, new_node_idx);
 }
 
+void HashTrie::IndexInsert(HashTrieNode<hash_size_>::UnsafeRef node, 
+                           uint32_t value_idx) {
+  if(!ordered_) return ;
+  const char* p = values_.Get(value_idx);
+  if(p == NULL || *(reinterpret_cast<const uint64_t*>(p)) == 0) return ;
+  OrderEntry entry{FrozenIndex::Encode(p), value_idx};
+  AtomicLock lock(node->order_lock);
+  // branch already descended, child holds the record
+  if(node->forward[p[node->level]] < 0) return ;
+  auto it = std::lower_bound(node->order.begin(), node->order.end(), entry,
+    [](const OrderEntry& a, const OrderEntry& b) { return a.code < b.code; });
+  if(it != node->order.end() && it->code == entry.code) it->value = value_idx;
+  else node->order.insert(it, entry);
+}
+void HashTrie::IndexErase(HashTrieNode<hash_size_>::UnsafeRef node, 
+                          uint64_t code) {
+  if(!ordered_) return ;
+  AtomicLock lock(node->order_lock);
+  auto it = std::lower_bound(node->order.begin(), node->order.end(), code,
+    [](const OrderEntry& a, uint64_t b) { return a.code < b; });
+  if(it != node->order.end() && it->code == code) node->order.erase(it);
+}
+void HashTrie::IndexEraseBranch(HashTrieNode<hash_size_>::UnsafeRef node, 
+                                char branch) {
+  if(!ordered_) return ;
+  // entries of one branch are contiguous
+  int shift = 8 * (7 - node->level);
+  auto in_branch = [&](const OrderEntry& e) {
+    return static_cast<char>(((e.code >> shift) & 0xff) ^ 0x80) == branch;
+  };
+  AtomicLock lock(node->order_lock);
+  auto first = std::find_if(node->order.begin(), node->order.end(), in_branch);
+  auto last = std::find_if_not(first, node->order.end(), in_branch);
+  node->order.erase(first, last);
+}
+
 } // namespace portal_db
\ No newline at end of file
@@ -7,11 +7,15 @@
 #include "util/readwrite_lock.h"
 #include "util/debug.h"
 #include "hash_trie_iterator.h"
+#include "frozen_index.h"
+#include "parallel_iterator.h"
 #include "util/concurrent_vector.h"
 #include "util/atomic_lock.h"
+#include "util/thread_pool.h"
 
 #include <atomic>
 #include <iostream>
+#include <vector>
 
 namespace portal_db {
 
@@ -33,6 +37,14 @@ struct HashNode {
 };
 
 
+// sorted index entry of ordered mode
+// + code ------- encoded key when indexed
+// + value ------ record index, stale if key changed since
+struct OrderEntry {
+  uint64_t code;
+  uint32_t value;
+};
+
 // + forward
 // |  + +x ------ hash index + 1
 // |  + -x ------ node index
@@ -52,6 +64,7 @@ struct HashTrieNode: public NoMove {
   HashTrieNode() {
     for(int i = 0; i < 256; i++) forward[i].store(0x0fffffff);
     for(int i = 0; i < segment_size; i++) segment[i].store(0);
+    order_lock.store(false);
   }
   static constexpr size_t segment_size = 16;
   int32_t parent; // parent node inedx
@@ -61,13 +74,23 @@ struct HashTrieNode: public NoMove {
   std::atomic<int32_t> forward[256];
   HashNode table[hashSize];
   std::atomic<bool> segment[segment_size]; // mutation locks
+  // local records sorted by key, only kept in ordered mode
+  std::vector<OrderEntry> order;
+  std::atomic<bool> order_lock;
 };
 
 class HashTrie {
   friend HashTrieIterator;
+  friend ParallelIterator;
  public:
-  HashTrie(const std::string& filename)
-    : values_(filename + ".snapshot") { 
+  // `ordered` keeps a sorted index in each node for sorted scan
+  // `mapped` keeps records in a mapping of the snapshot file
+  HashTrie(const std::string& filename, 
+           bool ordered = false, 
+           bool mapped = false)
+    : values_(filename + ".snapshot", mapped),
+      index_(filename + ".index"),
+      ordered_(ordered) { 
       nodes_.push_back(HashTrieNode<hash_size_>::MakeNode(0, 0, 0, 0)); 
     }
   virtual ~HashTrie() { }
@@ -81,6 +104,19 @@ class HashTrie {
   Status Delete(const Key& key);
   // scan in range [lower, upper)
   Status Scan(const Key& lower, const Key& upper, HashTrieIterator& ret);
+  // scan in range [lower, upper) in `n` partitions along top-level
+  // branches, run as tasks on a worker pool shared by every scan
+  Status ParallelScan(const Key& lower, 
+                      const Key& upper, 
+                      size_t n, 
+                      ParallelIterator& ret);
+  // compile current records into a read-optimized `FrozenIndex`
+  // later writes go to the emptied trie as a delta
+  // used in single thread
+  // virtual as stores that persist records must refuse it
+  virtual Status Freeze();
+  // generation of last snapshot taken or recovered, 0 if none
+  uint64_t snapshot_generation() const { return values_.generation(); }
   // for debug
  #ifdef PORTAL_DEBUG
   void Dump() const {
@@ -116,6 +152,15 @@ class HashTrie {
   // stores key-value pair in compact manner
   // convenient to snapshot
   PagedPool<8+256> values_;
+  // image of `nodes_` taken along with snapshot of `values_`
+  SequentialFile index_;
+  // read-only image of frozen records, NULL if never frozen
+  std::unique_ptr<FrozenIndex> frozen_;
+  // maintain sorted index of node
+  const bool ordered_;
+  // workers of parallel scans, bounded by hardware concurrency
+  // last member, so queued scans finish before the trie goes
+  ThreadPool scan_pool_;
 
   // hash functions //
   // guarantee no hash collision on only one element
@@ -157,8 +202,10 @@ class HashTrie {
     if(index == 0x0fffffff) return false;
     char* p = values_.Get(index);
     if(p && key == p) {
+      values_.Preserve(index);
       *(reinterpret_cast<uint64_t*>(p)) = 0;
       *(p+8) = key[level];
+      values_.Touch(index);
       return true;
     }
     return false;
@@ -169,20 +216,44 @@ class HashTrie {
     char* p = values_.Get(index);
     if(p) {
       if(key == p) {
+        values_.Preserve(index);
         value.write<0, 256>(p + 8);
+        values_.Touch(index);
         return true;
       } else if( *(reinterpret_cast<uint64_t*>(p)) == 0
         && *(p+8) == key[level]) {
+        values_.Preserve(index);
         memcpy(p, key.raw_ptr(), 8);
         value.write<0,256>(p+8);
+        values_.Touch(index);
         return true;
       }
     }
     return false;
   }
   // put record slice into tree
-  // used in single thread
+  // used in single thread, or by owner of its top-level branch
   Status PutRecover(size_t value_idx);
+  // index every record of `values_` with `threads` workers
+  // each worker owns a disjoint set of top-level branches
+  Status Rebuild(size_t threads);
+  // index image routine family //
+  // layout: magic (8) - nodes (8) - slices (8) - crc (4) - generation (4)
+  //    then per node: parent (4) - id (4) - level (1) - branch (1) - 
+  //    pad (2) - forward (256 x 4) - table (pointer (4) - value (4))
+  // node links are indices, so image is position independent
+  // must not race with writers
+  Status SaveIndex();
+  // two phase save, encode with writers excluded then write freely
+  void EncodeIndex(std::vector<char>& image);
+  Status WriteIndex(std::vector<char>& image, 
+                    const PagedPool<8+256>::Pace& pace = PagedPool<8+256>::Pace());
+  // load image matching snapshot of `values_` in place of rebuild
+  // leaves an empty trie on failure
+  Status LoadIndex();
+  static constexpr size_t index_header_ = 32;
+  static constexpr size_t node_record_ = 12 + 256 * 4 + hash_size_ * 8;
+  static constexpr size_t index_chunk_ = 64; // nodes per io
   // put key value into node with mutation lock
   Status PutWithMutationLock(const Key& key, 
                              const Value& value, 
@@ -191,6 +262,14 @@ class HashTrie {
   // put record slice into node with exclusive access
   // bug: use uint32 as node_idx
   Status PutToIsolatedNode(uint32_t value_idx, int32_t node_idx);
+  // sorted index routine family //
+  // no-op unless `ordered_`, guarded by `order_lock`
+  // index record after it is linked into node
+  void IndexInsert(HashTrieNode<hash_size_>::UnsafeRef node, uint32_t value_idx);
+  // drop record by encoded key
+  void IndexErase(HashTrieNode<hash_size_>::UnsafeRef node, uint64_t code);
+  // drop all records under branch after it descends to child
+  void IndexEraseBranch(HashTrieNode<hash_size_>::UnsafeRef node, char branch);
 };
 
 
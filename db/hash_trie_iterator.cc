@@ -1,5 +1,6 @@
 #include "hash_trie_iterator.h"
 #include "hash_trie.h"
+#include "util/util.h"
 
 #include <algorithm>
 
@@ -8,23 +9,64 @@ namespace portal_db {
 Status HashTrieIterator::Update() {
   buffer_.clear();
   current_ = -1;
+  batch_begin_ = 0;
   if(ref_ == NULL) 
     return Status::NotFound("index is invalidated");
-  if(node_id_ < 0) 
-    return Status::NotFound("node is invalidated");
+  bool frozen = ref_->frozen_ != NULL;
+  if(node_id_ < 0) {
+    if(!frozen || frozen_pos_ >= frozen_end_)
+      return Status::NotFound("node is invalidated");
+    // trie is drained, stream the remaining frozen records
+    MergeFrozen(UINT64_MAX, frozen_batch_);
+    return Status::OK();
+  }
   // read data
   auto node = ref_->nodes_[node_id_];
-  int32_t idx = node->forward[path_[node->level]];
-  while(idx != 0x0fffffff) {
-    HashNode& hnode = node->table[idx-1];
-    idx = hnode.pointer;
-    char* p = ref_->values_.Get(hnode.value);
-    if(p && (lower <= p || lower.empty()) && (!(upper <= p) || upper.empty()) ) {
-      buffer_.push_back(KeyValue(p, p + 8));
+  // key range of current prefix
+  int shift = 8 * (7 - node->level);
+  uint64_t prefix = FrozenIndex::Encode(path_.raw_ptr()) >> shift;
+  uint64_t first = shift == 0 ? prefix : prefix << shift;
+  uint64_t last = shift == 0 ? prefix : (((prefix + 1) << shift) - 1);
+  if((sort || frozen) && ref_->ordered_) {
+    // stream from sorted index, start from lower bound
+    if(!lower.empty() && first < lower_code_) first = lower_code_;
+    AtomicLock lock(node->order_lock);
+    auto it = std::lower_bound(node->order.begin(), node->order.end(), first,
+      [](const OrderEntry& a, uint64_t b) { return a.code < b; });
+    for(; it != node->order.end() && it->code <= last; it++) {
+      if(!upper.empty() && it->code >= upper_code_) break;
+      char* p = ref_->values_.Get(it->value);
+      // skip stale entry
+      if(!p || FrozenIndex::Encode(p) != it->code) continue;
+      buffer_.push_back(RecordRef{it->code, p});
+    }
+  } else {
+    // first pass: collect records of chain and prefetch them
+    int32_t idx = node->forward[path_[node->level]];
+    while(idx != 0x0fffffff) {
+      HashNode& hnode = node->table[idx-1];
+      idx = hnode.pointer;
+      char* p = ref_->values_.Get(hnode.value);
+      if(!p) continue;
+      PORTAL_PREFETCH(p);
+      buffer_.push_back(RecordRef{0, p});
+    }
+    // second pass: encode and filter in place
+    size_t size = 0;
+    for(size_t i = 0; i < buffer_.size(); i++) {
+      const char* p = buffer_[i].record;
+      if(*(reinterpret_cast<const uint64_t*>(p)) == 0) continue; // deleted
+      uint64_t code = FrozenIndex::Encode(p);
+      if((lower.empty() || lower_code_ <= code) && 
+        (upper.empty() || code < upper_code_)) {
+        buffer_[size++] = RecordRef{code, p};
+      }
     }
+    buffer_.resize(size);
+    if(sort || frozen) RadixSort();
   }
-  if(sort) 
-    std::sort(buffer_.begin(), buffer_.end());
+  // frozen records up to the end of current prefix
+  if(frozen) MergeFrozen(last, SIZE_MAX);
   // find next
   int32_t tmp;
   int32_t level = node->level;
@@ -50,9 +92,11 @@ Status HashTrieIterator::Update() {
         node = ref_->nodes_[-tmp];
         assert(level + 1 == node->level);
         level ++;
-        path_[level] = 0;
+        path_[level] = -1; // loop increments to 0
       } else if(tmp != 0x0fffffff) { // hit
         node_id_ = node->id;
+        // warm up chain head of next batch
+        PORTAL_PREFETCH(&node->table[tmp - 1]);
         return Status::OK();
       }
     }
@@ -61,4 +105,55 @@ Status HashTrieIterator::Update() {
   return Status::OK();
 }
 
+void HashTrieIterator::RadixSort() {
+  size_t size = buffer_.size();
+  if(size < 64) {
+    std::sort(buffer_.begin(), buffer_.end(), 
+      [](const RecordRef& a, const RecordRef& b) { return a.code < b.code; });
+    return ;
+  }
+  // histogram of all 8 bytes in one pass
+  uint32_t count[8][256] = {};
+  for(size_t i = 0; i < size; i++) {
+    uint64_t code = buffer_[i].code;
+    for(int b = 0; b < 8; b++) count[b][(code >> (8 * b)) & 0xff] ++;
+  }
+  scratch_.resize(size);
+  for(int b = 0; b < 8; b++) {
+    // byte shared by all records, nothing to reorder
+    if(count[b][(buffer_[0].code >> (8 * b)) & 0xff] == size) continue;
+    uint32_t offset[256];
+    uint32_t sum = 0;
+    for(int c = 0; c < 256; c++) {
+      offset[c] = sum;
+      sum += count[b][c];
+    }
+    for(size_t i = 0; i < size; i++) {
+      scratch_[offset[(buffer_[i].code >> (8 * b)) & 0xff] ++] = buffer_[i];
+    }
+    buffer_.swap(scratch_);
+  }
+}
+
+void HashTrieIterator::MergeFrozen(uint64_t bound, size_t limit) {
+  const FrozenIndex* frozen = ref_->frozen_.get();
+  scratch_.clear();
+  size_t i = 0;
+  while(frozen_pos_ < frozen_end_ && limit > 0) {
+    uint64_t code = frozen->key(frozen_pos_);
+    if(code > bound) break;
+    while(i < buffer_.size() && buffer_[i].code < code) {
+      scratch_.push_back(buffer_[i++]);
+    }
+    bool shadowed = i < buffer_.size() && buffer_[i].code == code;
+    if(!shadowed && !frozen->erased(frozen_pos_)) {
+      scratch_.push_back(RecordRef{code, frozen->record(frozen_pos_)});
+      limit --;
+    }
+    frozen_pos_ ++;
+  }
+  while(i < buffer_.size()) scratch_.push_back(buffer_[i++]);
+  buffer_.swap(scratch_);
+}
+
 } // namespace portal_db
\ No newline at end of file
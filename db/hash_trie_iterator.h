@@ -12,6 +12,14 @@ namespace portal_db {
 
 class HashTrie;
 
+// unsafe view of a record inside `PagedPool` or `FrozenIndex`
+// + code -- order-preserving encoding of key
+// + record -- 8 byte key followed by 256 byte value
+struct RecordRef {
+  uint64_t code;
+  const char* record;
+};
+
 class HashTrieIterator : public ReadIterator<KeyValue>{
   friend HashTrie;
  public:
@@ -23,8 +31,14 @@ class HashTrieIterator : public ReadIterator<KeyValue>{
         lower(rhs.lower),
         node_id_(rhs.node_id_),
         path_(rhs.path_),
+        frozen_pos_(rhs.frozen_pos_),
+        frozen_end_(rhs.frozen_end_),
+        lower_code_(rhs.lower_code_),
+        upper_code_(rhs.upper_code_),
         current_(rhs.current_),
-        buffer_(rhs.buffer_) { }
+        batch_begin_(rhs.batch_begin_),
+        buffer_(rhs.buffer_),
+        peeked_(rhs.peeked_) { }
   HashTrieIterator(HashTrieIterator&& rhs)
       : ref_(rhs.ref_), 
         sort(rhs.sort),
@@ -32,22 +46,56 @@ class HashTrieIterator : public ReadIterator<KeyValue>{
         lower(rhs.lower),
         node_id_(rhs.node_id_),
         path_(rhs.path_),
+        frozen_pos_(rhs.frozen_pos_),
+        frozen_end_(rhs.frozen_end_),
+        lower_code_(rhs.lower_code_),
+        upper_code_(rhs.upper_code_),
         current_(rhs.current_),
-        buffer_(std::move(rhs.buffer_)) { 
+        batch_begin_(rhs.batch_begin_),
+        buffer_(std::move(rhs.buffer_)),
+        peeked_(std::move(rhs.peeked_)) { 
     rhs.ref_ = NULL; rhs.node_id_ = -1;
   }
   bool Next() { // read from cache or Update
-    if(current_ + 1 >= buffer_.size()) {
+    // skip batches emptied by range filter
+    while(current_ + 1 >= buffer_.size()) {
       if(!Update().inspect()) return false;
     }
+    if(peeked_.size() < buffer_.size()) peeked_.resize(buffer_.size());
     if(current_ + 1 < buffer_.size()) {
       current_ ++;
       return true;
     } else return false;
   }
   // called after `Next` returns true
+  // copy into holder of its slot, valid until next batch is fetched,
+  // prefer `key` and `value` 
   const KeyValue& Peek() const {
-    return buffer_[current_];
+    const char* p = buffer_[current_].record;
+    KeyValue& ret = peeked_[current_];
+    for(int i = 0; i < 8; i++) ret[i] = p[i];
+    ret.copy<0, 256>(p + 8);
+    return ret;
+  }
+  // zero-copy access to current record
+  // valid until next batch is fetched
+  const char* key() const { return buffer_[current_].record; }
+  const char* value() const { return buffer_[current_].record + 8; }
+  // consume the rest of current batch as a whole,
+  // fetch a new batch if drained
+  bool NextBatch() {
+    while(current_ + 1 >= buffer_.size()) {
+      if(!Update().inspect()) return false;
+    }
+    if(peeked_.size() < buffer_.size()) peeked_.resize(buffer_.size());
+    batch_begin_ = current_ + 1;
+    current_ = buffer_.size() - 1;
+    return true;
+  }
+  // records of the batch returned by `NextBatch`
+  size_t batch_size() const { return buffer_.size() - batch_begin_; }
+  const RecordRef& batch(size_t idx) const { 
+    return buffer_[batch_begin_ + idx]; 
   }
   size_t size() const {
     return buffer_.size();
@@ -61,11 +109,29 @@ class HashTrieIterator : public ReadIterator<KeyValue>{
   // cursor
   int32_t node_id_ = -1; // node is hit for current prefix
   Key path_;
+  // cursor into frozen records, [pos, end)
+  size_t frozen_pos_ = 0;
+  size_t frozen_end_ = 0;
+  // records per batch once trie is drained
+  static constexpr size_t frozen_batch_ = 256;
+  // encoded range, valid when bound is not empty
+  uint64_t lower_code_ = 0;
+  uint64_t upper_code_ = 0;
   // epoch
   int32_t current_ = -1;
-  std::vector<KeyValue> buffer_;
+  int32_t batch_begin_ = 0;
+  // reused across batches
+  std::vector<RecordRef> buffer_;
+  std::vector<RecordRef> scratch_;
+  // holders of peeked records, one per slot of batch
+  mutable std::vector<KeyValue> peeked_;
   // read data from cursor, then update cursor
   Status Update();
+  // lsd radix sort on encoded key, skip bytes shared by all
+  void RadixSort();
+  // merge frozen records with key no greater than `bound` into
+  // sorted buffer, trie records shadow frozen ones
+  void MergeFrozen(uint64_t bound, size_t limit);
 };
 
 } // namespace portal_db
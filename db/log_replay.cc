@@ -0,0 +1,159 @@
+#include "log_replay.h"
+#include "hash_trie.h"
+
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace portal_db {
+
+namespace {
+
+// bounded batch queue from reader to one dedup worker
+class Feed {
+ public:
+  // hand over `batch`, leaving it empty
+  void Push(std::vector<char>& batch) {
+    std::unique_lock<std::mutex> lk(lock_);
+    cv_.wait(lk, [&]() -> bool { return batches_.size() < max_batches_; });
+    batches_.emplace_back();
+    batches_.back().swap(batch);
+    cv_.notify_all();
+  }
+  // false once closed and drained
+  bool Pop(std::vector<char>& batch) {
+    std::unique_lock<std::mutex> lk(lock_);
+    cv_.wait(lk, [&]() -> bool { return !batches_.empty() || closed_; });
+    if(batches_.empty()) return false;
+    batch.swap(batches_.front());
+    batches_.pop_front();
+    cv_.notify_all();
+    return true;
+  }
+  void Close() {
+    std::lock_guard<std::mutex> lk(lock_);
+    closed_ = true;
+    cv_.notify_all();
+  }
+ private:
+  static constexpr size_t max_batches_ = 4;
+  std::mutex lock_;
+  std::condition_variable cv_;
+  std::deque<std::vector<char>> batches_;
+  bool closed_ = false;
+};
+
+} // anonymous namespace
+
+LogReplay::LogReplay(size_t threads) {
+  if(threads == 0) threads = std::thread::hardware_concurrency();
+  partitions_.resize(min(max(threads, (size_t)1), (size_t)256));
+}
+
+size_t LogReplay::size() const {
+  size_t ret = 0;
+  for(size_t i = 0; i < partitions_.size(); i++) 
+    ret += partitions_[i].put.size();
+  return ret;
+}
+
+void LogReplay::Dedup(Partition& part, const char* entry) {
+  bool put = entry[0] != 0;
+  uint64_t code;
+  memcpy(&code, entry + 1, 8);
+  auto it = part.index.find(code);
+  size_t slot;
+  if(it == part.index.end()) { // new key
+    slot = part.put.size();
+    part.index[code] = slot;
+    part.put.push_back(put);
+    part.records.resize(part.records.size() + record_size_);
+    memcpy(part.records.data() + slot * record_size_, entry + 1, 8);
+  } else { // overwrite in place
+    slot = it->second;
+    part.put[slot] = put;
+  }
+  if(put) memcpy(part.records.data() + slot * record_size_ + 8, entry + 9, 256);
+}
+
+Status LogReplay::Load(ShardedBinLogger& logger) {
+  const size_t n = partitions_.size();
+  const size_t batch_bytes = batch_entries_ * entry_size_;
+  std::unique_ptr<Feed[]> feeds(new Feed[n]);
+  std::vector<std::thread> workers;
+  for(size_t i = 0; i < n && n > 1; i++) {
+    workers.push_back(std::thread([&, i]() {
+      std::vector<char> batch;
+      while(feeds[i].Pop(batch)) {
+        for(size_t off = 0; off < batch.size(); off += entry_size_)
+          Dedup(partitions_[i], batch.data() + off);
+      }
+    }));
+  }
+  // reader fills one batch per partition
+  std::vector<std::vector<char>> batches(n);
+  Key key;
+  char alloc[256];
+  bool put;
+  Status status;
+  while(true) {
+    status = logger.Read(key, alloc, put);
+    if(!status.ok()) break;
+    loaded_ ++;
+    // partition by key prefix, interleaved as prefixes cluster
+    unsigned char prefix = static_cast<unsigned char>(key[0]);
+    size_t i = prefix % n;
+    std::vector<char>& batch = batches[i];
+    size_t off = batch.size();
+    batch.resize(off + entry_size_);
+    batch[off] = put ? 1 : 0;
+    memcpy(batch.data() + off + 1, key.raw_ptr(), 8);
+    if(put) memcpy(batch.data() + off + 9, alloc, 256);
+    if(n == 1) { // no worker to hand off to
+      Dedup(partitions_[0], batch.data());
+      batch.clear();
+    } else if(batch.size() >= batch_bytes) {
+      feeds[i].Push(batch);
+    }
+  }
+  for(size_t i = 0; i < workers.size(); i++) {
+    if(!batches[i].empty()) feeds[i].Push(batches[i]);
+    feeds[i].Close();
+  }
+  for(size_t i = 0; i < workers.size(); i++) workers[i].join();
+  // replay stops at end of log or its torn tail, nothing else
+  if(status.IsNotFound()) return Status::OK();
+  return status;
+}
+
+Status LogReplay::ApplyPartition(HashTrie& trie, const Partition& part) {
+  Status ret;
+  for(size_t i = 0; i < part.put.size() && ret.ok(); i++) {
+    const char* p = part.records.data() + i * record_size_;
+    Key key(p);
+    if(part.put[i]) ret *= trie.Put(key, Value(p + 8));
+    else trie.Delete(key); // may be absent
+  }
+  return ret;
+}
+
+Status LogReplay::Apply(HashTrie& trie) {
+  std::vector<Status> status(partitions_.size());
+  std::vector<std::thread> workers;
+  for(size_t i = 0; i < partitions_.size(); i++) {
+    workers.push_back(std::thread([&, i]() {
+      status[i] = ApplyPartition(trie, partitions_[i]);
+    }));
+  }
+  Status ret;
+  for(size_t i = 0; i < workers.size(); i++) {
+    workers[i].join();
+    ret *= status[i];
+  }
+  return ret;
+}
+
+} // namespace portal_db
@@ -0,0 +1,55 @@
+#ifndef PORTAL_DB_LOG_REPLAY_H_
+#define PORTAL_DB_LOG_REPLAY_H_
+
+#include "sharded_bin_logger.h"
+#include "portal_db/piece.h"
+#include "portal_db/status.h"
+#include "util/util.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace portal_db {
+
+class HashTrie;
+
+// Binlog replay on recovery:
+// + entries are streamed from logger and hashed into partitions by
+//    first key byte, batches of a partition are handed to its own
+//    worker, which keeps only the last op per key
+// + survivors are applied by one thread per partition, partitions
+//    cover disjoint root branches of trie but share its root table
+//    and node vector, so they go through concurrent `HashTrie::Put`
+class LogReplay : public NoMove {
+ public:
+  // `threads` 0 picks hardware concurrency
+  LogReplay(size_t threads = 0);
+  // read logger till end or torn tail
+  // error if a read fails or log is damaged before that
+  Status Load(ShardedBinLogger& logger);
+  Status Apply(HashTrie& trie);
+  // ops read from log
+  size_t loaded() const { return loaded_; }
+  // ops left after dedup
+  size_t size() const;
+ private:
+  static constexpr size_t record_size_ = 8 + 256;
+  // batch entry: put (1) - key (8) - value (256)
+  static constexpr size_t entry_size_ = 1 + record_size_;
+  static constexpr size_t batch_entries_ = 256;
+  struct Partition {
+    std::unordered_map<uint64_t, size_t> index; // key -> slot
+    std::vector<char> records; // key - value per slot
+    std::vector<bool> put;
+  };
+  std::vector<Partition> partitions_;
+  size_t loaded_ = 0;
+  // keep op of batch entry if it is latest of its key
+  static void Dedup(Partition& part, const char* entry);
+  Status ApplyPartition(HashTrie& trie, const Partition& part);
+};
+
+} // namespace portal_db
+
+#endif // PORTAL_DB_LOG_REPLAY_H_
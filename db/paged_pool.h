@@ -1,31 +1,79 @@
 #ifndef PORTAL_DB_PAGED_POOL_H_
 #define PORTAL_DB_PAGED_POOL_H_
 
+#include "util/compress.h"
 #include "util/file.h"
+#include "util/io_engine.h"
 
+#include <algorithm>
 #include <atomic>
+#include <functional>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 namespace portal_db {
 
 // test::MaximumSize = 2 ^ 29 = 512 MB (tested to hold million)
 // MaximumSize = 2 ^ 33 = 8 GB
 // PageSize = 2 ^ 22 = 4 KB
+// Mapped mode places buckets in shared views of the snapshot file, 
+// `region_buckets_` per view. Snapshot writes back pages of touched
+// buckets and recovery maps the file, buckets lie raw after header.
+// Mapped records reach disk at any time, so a snapshot is not 
+// point-in-time and must be paired with log replay.
+// Heap mode double-buffers snapshots in `filename` and `filename.1`,
+// each write goes to the older one and completes by stamping a newer
+// generation in its header, recovery loads the newest.
+// Heap mode compresses each group of `group_buckets_` buckets into a
+// frame, frames lie back to back and a table after them locates each
+// group. A snapshot appends frames of changed groups after those of 
+// its buffer, or repacks the buffer once stale frames outweigh live
+// ones, and the file ends with the table:
+// + frame: raw length (4) - stored length (4) - stored bytes
+//    stored length equal to raw length marks an uncompressed group
+// + table: frame offset (8) - frame size (8) per group
+// Heap mode also loads raw files, mapped mode only maps raw files.
+// header: magic (4) - version (2) - layout (1) - pad (1) - 
+//    slices (8) - generation (8), group layout adds table offset (8)
+//    a header left zero is not yet stamped, files of earlier releases
+//    hold slices (4) then raw buckets and are loaded in heap mode
 template <
   size_t SliceSize, 
   size_t MaximumPower = 29, // = 33,
   size_t PagePower = 12>
 class PagedPool: public SequentialFile {
  public:
-  PagedPool(std::string filename): SequentialFile(filename) {
+  // called with bytes before each snapshot write, may block
+  using Pace = std::function<void(size_t)>;
+  PagedPool(std::string filename, bool mapped = false)
+      : SequentialFile(filename),
+        mapped_(mapped),
+        map_alignment_(mapped ? MapAlignment() : 1),
+        alternate_(filename + ".1"),
+        map_failed_(false) {
     for(int i = 0; i < bucket_num_; i++)
       bucket_[i].store(NULL);
+    for(int i = 0; i < region_num_; i++)
+      view_[i] = NULL;
+    for(int i = 0; i < dirty_words_; i++)
+      dirty_[i].store(0);
+    for(int i = 0; i < bucket_num_; i++) {
+      cow_[i].store(kClean);
+      shadow_[i].store(NULL);
+    }
     size_.store(0);
     bucket_size_.store(0);
   }
   ~PagedPool() {
-    for(int i = 0; i < bucket_num_; i++){
-      delete [] bucket_[i].load();
+    if(alternate_.opened()) alternate_.Close();
+    if(mapped_) UnmapRegions();
+    else {
+      for(int i = 0; i < bucket_num_; i++){
+        delete [] bucket_[i].load();
+        delete [] shadow_[i].load();
+      }
     }
   }
   // unsafe, must be initialized
@@ -55,62 +103,304 @@ class PagedPool: public SequentialFile {
     if(bucket >= bucket_num_) {
       return 0x0fffffff;
     }
-    size_t subslot = slot - bucket * per_bucket_num_;
-    AllocBucket(bucket);
+    if(!AllocBucket(bucket)) return 0x0fffffff;
+    Touch(slot);
     return slot;
   }
-  Status MakeSnapshot () {
-    if(!opened()) {
-      Status ret = Open();
-      if(!ret.ok()) return ret;
+  // mark bucket of slot for next snapshot
+  // called after each rewrite of slot, `New` marks its bucket
+  void Touch(size_t offset) {
+    size_t bucket = offset / per_bucket_num_;
+    if(bucket >= bucket_num_) return;
+    dirty_[bucket / 64].fetch_or((uint64_t)1 << (bucket % 64), 
+                                 std::memory_order_release);
+  }
+  // keep frozen content of bucket of slot, called before each rewrite
+  // of slot while a snapshot is in flight
+  void Preserve(size_t offset) {
+    size_t bucket = offset / per_bucket_num_;
+    if(mapped_ || bucket >= bucket_num_) return;
+    uint8_t state = cow_[bucket].load(std::memory_order_acquire);
+    if(state == kClean) return;
+    if(state == kPending && 
+       cow_[bucket].compare_exchange_strong(state, kBusy)) {
+      char* shadow = new char[per_bucket_bytes_];
+      memcpy(shadow, bucket_[bucket].load(), per_bucket_bytes_);
+      shadow_[bucket].store(shadow);
+      cow_[bucket].store(kSaved, std::memory_order_release);
+      return;
+    }
+    // copied by snapshot or another writer
+    while(cow_[bucket].load(std::memory_order_acquire) == kBusy) 
+      std::this_thread::yield();
+  }
+  // snapshot routine family //
+  // at most one snapshot in flight
+  // freeze slice count and dirty buckets, called with writers excluded
+  // slots taken after it lie past `snapshot_slices_` and are not loaded
+  void BeginSnapshot() {
+    generation_ ++;
+    snapshot_slices_ = size_.load();
+    snapshot_buckets_ = bucket_size_.load();
+    frozen_.clear();
+    fresh_.clear();
+    for(size_t w = 0; w * 64 < snapshot_buckets_; w++) {
+      size_t rest = snapshot_buckets_ - w * 64;
+      uint64_t mask = rest >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << rest) - 1;
+      // a rewrite after freeze marks it for next snapshot
+      uint64_t bits = dirty_[w].fetch_and(~mask, std::memory_order_acquire) & mask;
+      for(size_t b = 0; bits != 0; b++, bits >>= 1) {
+        if(bits & 1) fresh_.push_back(w * 64 + b);
+      }
+    }
+    if(mapped_) return; // written back in place
+    // target buffer also lags behind by what went to the other one
+    std::vector<size_t> lagging;
+    std::set_union(fresh_.begin(), fresh_.end(), carry_.begin(), carry_.end(),
+                   std::back_inserter(lagging));
+    if(rewrite_ > 0) { // target may hold raw layout
+      lagging.clear();
+      for(size_t i = 0; i < snapshot_buckets_; i++) lagging.push_back(i);
+    }
+    // whole groups are written
+    for(size_t i = 0; i < lagging.size(); i++) {
+      size_t first = lagging[i] / group_buckets_ * group_buckets_;
+      if(!frozen_.empty() && frozen_.back() >= first) continue;
+      size_t last = min(first + group_buckets_, snapshot_buckets_);
+      for(size_t b = first; b < last; b++) frozen_.push_back(b);
+    }
+    // target keeps frames of groups it does not lag on, unless stale
+    // frames outweigh live ones or its table is unknown
+    size_t groups = (snapshot_buckets_ + group_buckets_ - 1) / group_buckets_;
+    const std::vector<GroupFrame>& frames = frames_[target_];
+    uint64_t live = 0;
+    for(size_t g = 0; g < frames.size(); g++) live += frames[g].size;
+    repack_ = rewrite_ > 0 || tail_[target_] < packed_header_ || 
+              tail_[target_] - packed_header_ > 2 * live;
+    for(size_t g = frames.size(); g < groups && !repack_; g++) {
+      repack_ = !std::binary_search(frozen_.begin(), frozen_.end(), 
+                                    g * group_buckets_);
     }
-    uint32_t sliceSize = size_.load();
-    uint32_t bucketSize = bucket_size_.load();
-    if(SequentialFile::size() < per_bucket_bytes_ * bucketSize + snapshot_header_) {
-      SetEnd(per_bucket_bytes_ * bucketSize + snapshot_header_);
+    if(repack_) {
+      frozen_.clear();
+      for(size_t i = 0; i < snapshot_buckets_; i++) frozen_.push_back(i);
     }
-    Status ret = Write(0, sizeof(uint32_t), reinterpret_cast<char*>(&sliceSize));
-    size_t offset = snapshot_header_;
-    for(int i = 0; i < bucketSize && ret.ok(); i++) {
-      ret *= Write(offset, per_bucket_bytes_, bucket_[i]);
-      offset += per_bucket_bytes_;
+    for(size_t i = 0; i < frozen_.size(); i++) 
+      cow_[frozen_[i]].store(kPending, std::memory_order_release);
+  }
+  // write frozen state, writers may run concurrently
+  Status WriteSnapshot(const Pace& pace = Pace()) {
+    Status ret;
+    if(!opened()) ret *= Open();
+    if(ret.ok() && mapped_ && snapshot_buckets_ > 0) 
+      return FlushRegions();
+    SequentialFile& file = target_ == 0 ? *this : alternate_;
+    if(ret.ok() && !file.opened()) ret *= file.Open();
+    char header[packed_header_];
+    size_t headerSize = snapshot_header_;
+    std::vector<GroupFrame> frames;
+    uint64_t table = 0;
+    if(mapped_) {
+      size_t end = per_bucket_bytes_ * snapshot_buckets_ + snapshot_header_;
+      if(ret.ok() && file.size() < end) ret *= file.SetEnd(end);
+      ret = WriteFrozen(file, ret, pace);
+      EncodeHeader(header, kRawLayout);
+    } else { // sized as frames go out
+      ret = WriteGroups(file, ret, pace, frames, table);
+      EncodeHeader(header, kGroupLayout);
+      memcpy(header + snapshot_header_, &table, sizeof(uint64_t));
+      headerSize = packed_header_;
+    }
+    // header last, swaps buffers
+    if(ret.ok()) ret *= file.Sync();
+    if(ret.ok()) ret *= file.Write(0, headerSize, header);
+    if(ret.ok()) ret *= file.Sync();
+    if(ret.ok()) {
+      frames_[target_].swap(frames);
+      tail_[target_] = table;
+      carry_.swap(fresh_);
+      target_ ^= 1;
+      if(rewrite_ > 0) rewrite_ --;
+    } else { // retry with next snapshot, repacking target
+      frames_[target_].clear();
+      tail_[target_] = 0;
+      for(size_t i = 0; i < frozen_.size(); i++) 
+        Touch(frozen_[i] * per_bucket_num_);
     }
+    frozen_.clear();
     return ret;
   }
+  Status MakeSnapshot () {
+    BeginSnapshot();
+    return WriteSnapshot();
+  }
   Status DeleteSnapshot() {
     Status ret = Status::OK();
     if(opened()) ret *= Close();
+    if(alternate_.opened()) ret *= alternate_.Close();
     if(!ret.ok()) return ret;
+    for(size_t i = 0; i < 2; i++) {
+      frames_[i].clear();
+      tail_[i] = 0;
+    }
     ret *= Delete();
+    alternate_.Delete(); // may be absent
     return ret;
   }
-  Status ReadSnapshot() {
+  // `threads` readers each load a contiguous run of buckets
+  // in reads of `read_chunk_` buckets
+  Status ReadSnapshot(size_t threads = 1) {
     if(!opened()) {
       Status ret = Open();
       if(!ret.ok()) return ret;
     }
-    size_t fileSize = SequentialFile::size();
-    uint32_t sliceSize;
-    Status ret = Read(0, sizeof(uint32_t), reinterpret_cast<char*>(&sliceSize));
-    size_t offset = snapshot_header_;
-    for(size_t bucket = 0; 
-      bucket < bucket_num_ && 
-      offset + per_bucket_bytes_ <= fileSize &&
-      ret.ok();
-      bucket++) {
-      AllocBucket(bucket);
-      ret *= Read(offset, per_bucket_bytes_, bucket_[bucket]);
-      offset += per_bucket_bytes_;
+    if(!mapped_ && !alternate_.opened()) {
+      Status ret = alternate_.Open();
+      if(!ret.ok()) return ret;
+    }
+    // newest complete buffer
+    uint64_t slices[2] = {0, 0};
+    uint8_t layout[2] = {kRawLayout, kRawLayout};
+    uint64_t generation[2] = {0, 0};
+    uint64_t table[2] = {0, 0};
+    bool legacy = false;
+    for(size_t i = 0; i < (mapped_ ? 1 : 2); i++) {
+      SequentialFile& file = i == 0 ? *this : alternate_;
+      char header[packed_header_];
+      memset(header, 0, packed_header_);
+      if(file.size() < legacy_header_) continue;
+      Status ret = file.Read(0, min(file.size(), packed_header_), header);
+      if(!ret.ok()) return ret;
+      uint32_t magic;
+      memcpy(&magic, header, sizeof(uint32_t));
+      if(magic == 0) continue; // not yet stamped
+      if(magic != kSnapshotMagic && i == 0 && 
+         (file.size() - legacy_header_) % per_bucket_bytes_ == 0) {
+        legacy = true; // read as oldest
+        slices[i] = magic;
+        continue;
+      }
+      if(magic != kSnapshotMagic) 
+        return Status::Corruption("unknown snapshot header");
+      uint16_t version;
+      memcpy(&version, header + 4, sizeof(uint16_t));
+      if(version > kSnapshotVersion) 
+        return Status::NotSupported("snapshot of newer version");
+      layout[i] = static_cast<uint8_t>(header[6]);
+      memcpy(&slices[i], header + 8, sizeof(uint64_t));
+      memcpy(&generation[i], header + 16, sizeof(uint64_t));
+      if(layout[i] == kGroupLayout) 
+        memcpy(&table[i], header + snapshot_header_, sizeof(uint64_t));
+    }
+    size_t chosen = generation[1] > generation[0] ? 1 : 0;
+    legacy = legacy && generation[chosen] == 0;
+    if(generation[chosen] == 0 && !legacy) 
+      return Status::NotFound("empty snapshot");
+    if(legacy && mapped_) 
+      return Status::NotSupported("map snapshot of earlier release");
+    SequentialFile& file = chosen == 0 ? *this : alternate_;
+    size_t base = legacy ? legacy_header_ : snapshot_header_;
+    size_t sliceSize = slices[chosen];
+    bool grouped = layout[chosen] == kGroupLayout;
+    if(layout[chosen] > kGroupLayout) 
+      return Status::Corruption("unknown snapshot layout");
+    if(grouped && mapped_) 
+      return Status::NotSupported("map compressed snapshot");
+    Status ret;
+    size_t fileSize = file.size();
+    size_t buckets = grouped ? 
+      (sliceSize + per_bucket_num_ - 1) / per_bucket_num_ :
+      min((fileSize - base) / per_bucket_bytes_, bucket_num_);
+    size_t units = grouped ? 
+      (buckets + group_buckets_ - 1) / group_buckets_ : buckets;
+    if(buckets > bucket_num_ || (grouped && (table[chosen] < packed_header_ ||
+       fileSize < table[chosen] + units * table_entry_)))
+      return Status::Corruption("truncated snapshot");
+    for(size_t i = 0; i < 2; i++) {
+      frames_[i].clear();
+      tail_[i] = 0;
+    }
+    if(grouped) { // kept for appending to this buffer
+      ret = ReadTable(file, table[chosen], units, frames_[chosen]);
+      if(!ret.ok()) return ret;
+      tail_[chosen] = table[chosen];
+    }
+    generation_ = generation[chosen];
+    // both buffers rewritten in group layout
+    rewrite_ = grouped ? 0 : 2;
+    target_ = mapped_ ? 0 : chosen ^ 1;
+    // other buffer lags behind by unknown buckets
+    carry_.clear();
+    for(size_t i = 0; i < buckets; i++) carry_.push_back(i);
+    if(buckets > 0 && !AllocBucket(buckets - 1)) 
+      return Status::IOError("map snapshot failed");
+    if(mapped_) { // records are read on demand
+      size_.store(sliceSize);
+      return ret;
+    }
+    size_t chunk = grouped ? read_chunk_ / group_buckets_ : read_chunk_;
+    threads = max(min(threads, (units + chunk - 1) / chunk), (size_t)1);
+    std::vector<Status> status(threads);
+    std::vector<std::thread> workers;
+    for(size_t t = 0; t < threads; t++) {
+      workers.push_back(std::thread([&, t]() {
+        size_t begin = t * units / threads, end = (t + 1) * units / threads;
+        status[t] = grouped ? 
+          ReadGroups(file, frames_[chosen], begin, end, buckets) :
+          ReadBuckets(file, base, begin, end);
+      }));
+    }
+    for(size_t t = 0; t < threads; t++) {
+      workers[t].join();
+      ret *= status[t];
     }
     if(ret.ok()) size_.store(sliceSize); // take effetch
     return ret;
   }
+  // unsafe, drop all slices
+  void Clear() {
+    size_t bucketSize = bucket_size_.load();
+    for(int i = 0; i < bucketSize; i++) {
+      if(!mapped_) delete [] bucket_[i].load();
+      bucket_[i].store(NULL);
+    }
+    for(int i = 0; i < dirty_words_; i++) dirty_[i].store(0);
+    for(int i = 0; i < bucket_num_; i++) {
+      cow_[i].store(kClean);
+      delete [] shadow_[i].exchange(NULL);
+    }
+    frozen_.clear();
+    carry_.clear();
+    rewrite_ = 0;
+    for(size_t i = 0; i < 2; i++) {
+      frames_[i].clear();
+      tail_[i] = 0;
+    }
+    if(mapped_) UnmapRegions();
+    size_.store(0);
+    bucket_size_.store(0);
+  }
   size_t size() const {
     return size_.load();
   }
   size_t capacity() const {
     return bucket_num_ * per_bucket_num_;
   }
+  bool mapped() const { return mapped_; }
+  // bytes next snapshot writes at most, call from snapshot thread
+  size_t DirtyBytes() const {
+    size_t buckets = bucket_size_.load();
+    size_t count = 0;
+    for(size_t w = 0; w * 64 < buckets; w++) {
+      for(uint64_t bits = dirty_[w].load(); bits != 0; bits &= bits - 1) count++;
+    }
+    if(mapped_) return count * per_bucket_bytes_;
+    count += carry_.size();
+    // whole groups are written
+    return min(count * group_buckets_, buckets) * per_bucket_bytes_;
+  }
+  // generation of last frozen or loaded snapshot
+  uint64_t generation() const { return generation_; }
   // for Debug
   void inspect() const {
     size_t size = size_.load();
@@ -129,17 +419,356 @@ class PagedPool: public SequentialFile {
   static constexpr size_t per_bucket_num_ = (1 << PagePower) / SliceSize; // slice
   static constexpr size_t per_bucket_bytes_ = per_bucket_num_ * SliceSize; // byte
   static constexpr size_t bucket_num_ = (1 << (MaximumPower - PagePower));
-  static constexpr size_t snapshot_header_ = sizeof(uint32_t); // store `size_` field
+  static constexpr size_t snapshot_header_ = 24;
+  static constexpr size_t legacy_header_ = 4; // slices only
+  static constexpr uint32_t kSnapshotMagic = 0x53424450; // "PDBS"
+  static constexpr uint16_t kSnapshotVersion = 1;
+  static constexpr size_t read_chunk_ = 256; // buckets per snapshot read
+  static constexpr uint8_t kRawLayout = 0;
+  static constexpr uint8_t kGroupLayout = 1;
+  static constexpr size_t group_buckets_ = 16; // buckets per frame
+  static constexpr size_t group_bytes_ = group_buckets_ * per_bucket_bytes_;
+  static constexpr size_t frame_header_ = 8;
+  static constexpr size_t max_frame_ = frame_header_ + group_bytes_;
+  static constexpr size_t table_entry_ = 16; // per group
+  static constexpr size_t packed_header_ = snapshot_header_ + 8; // table offset
+  static constexpr size_t grow_bytes_ = read_chunk_ * per_bucket_bytes_;
+  static constexpr size_t write_depth_ = 4; // group writes in flight
+  static constexpr size_t region_buckets_ = 1024; // buckets per view
+  static constexpr size_t region_num_ = 
+    (bucket_num_ + region_buckets_ - 1) / region_buckets_;
+  static constexpr size_t dirty_words_ = (bucket_num_ + 63) / 64;
+  // copy-on-write state of bucket frozen by snapshot
+  // + kClean ---- not frozen, or already written
+  // + kPending -- frozen, live content is the frozen one
+  // + kBusy ----- being copied by snapshot or a writer
+  // + kSaved ---- frozen content kept in `shadow_`
+  static constexpr uint8_t kClean = 0;
+  static constexpr uint8_t kPending = 1;
+  static constexpr uint8_t kBusy = 2;
+  static constexpr uint8_t kSaved = 3;
+  const bool mapped_;
+  const size_t map_alignment_;
   std::atomic<size_t> size_; // size of slices
   std::atomic<size_t> bucket_size_; // size of buckets
   std::atomic<char*> bucket_[bucket_num_];
-  void AllocBucket(size_t idx) {
+  // bucket changed since last snapshot
+  std::atomic<uint64_t> dirty_[dirty_words_];
+  std::atomic<uint8_t> cow_[bucket_num_];
+  std::atomic<char*> shadow_[bucket_num_];
+  // state frozen by `BeginSnapshot`
+  size_t snapshot_slices_ = 0;
+  size_t snapshot_buckets_ = 0;
+  std::vector<size_t> frozen_; // ascending bucket index
+  // double buffer of heap mode
+  SequentialFile alternate_;
+  uint64_t generation_ = 0;
+  size_t target_ = 0; // buffer holding older snapshot
+  std::vector<size_t> fresh_; // dirty buckets taken by this snapshot
+  std::vector<size_t> carry_; // buckets target lags behind other buffer
+  size_t rewrite_ = 0; // snapshots left to write all buckets
+  // group frames of each buffer, empty if unknown
+  struct GroupFrame {
+    uint64_t offset;
+    uint64_t size;
+  };
+  std::vector<GroupFrame> frames_[2];
+  uint64_t tail_[2] = {0, 0}; // table offset of each buffer
+  bool repack_ = false; // this snapshot rewrites target from its start
+  void EncodeHeader(char* header, uint8_t layout) const {
+    uint64_t sliceSize = snapshot_slices_;
+    memset(header, 0, snapshot_header_);
+    memcpy(header, &kSnapshotMagic, sizeof(uint32_t));
+    memcpy(header + 4, &kSnapshotVersion, sizeof(uint16_t));
+    header[6] = static_cast<char>(layout);
+    memcpy(header + 8, &sliceSize, sizeof(uint64_t));
+    memcpy(header + 16, &generation_, sizeof(uint64_t));
+  }
+  // mapped mode only
+  std::mutex map_lock_;
+  char* view_[region_num_]; // guarded by `map_lock_`
+  std::atomic<bool> map_failed_;
+  // file range of view `r`, starting from aligned offset below its
+  // first bucket, so view 0 also covers snapshot header
+  void RegionView(size_t r, size_t& begin, size_t& length) const {
+    size_t first = snapshot_header_ + r * region_buckets_ * per_bucket_bytes_;
+    begin = first - first % map_alignment_;
+    length = first + region_buckets_ * per_bucket_bytes_ - begin;
+  }
+  // map view holding bucket `idx` if absent, NULL on failure
+  char* MapBucket(size_t idx) {
+    size_t r = idx / region_buckets_;
+    size_t begin, length;
+    RegionView(r, begin, length);
+    std::lock_guard<std::mutex> lk(map_lock_);
+    if(view_[r] == NULL) {
+      Status ret;
+      if(!opened()) ret *= Open();
+      if(ret.ok() && SequentialFile::size() < begin + length) 
+        ret *= SetEnd(begin + length);
+      if(ret.ok()) ret *= Map(begin, length, view_[r]);
+      if(!ret.ok()) {
+        ret.inspect();
+        view_[r] = NULL;
+        map_failed_ = true;
+        return NULL;
+      }
+    }
+    size_t first = snapshot_header_ + r * region_buckets_ * per_bucket_bytes_;
+    return view_[r] + (first - begin) + (idx % region_buckets_) * per_bucket_bytes_;
+  }
+  // ordered write back: records of dirty buckets, then header
+  Status FlushRegions() {
+    std::lock_guard<std::mutex> lk(map_lock_);
+    if(view_[0] == NULL) return Status::Corruption("header view not mapped");
+    Status ret;
+    size_t i = 0;
+    while(i < fresh_.size() && ret.ok()) {
+      // run of adjacent buckets within one view
+      size_t r = fresh_[i] / region_buckets_;
+      size_t n = 1;
+      while(i + n < fresh_.size() && fresh_[i + n] == fresh_[i] + n && 
+            fresh_[i + n] / region_buckets_ == r) n++;
+      size_t begin, length;
+      RegionView(r, begin, length);
+      size_t first = snapshot_header_ + fresh_[i] * per_bucket_bytes_ - begin;
+      size_t from = first - first % map_alignment_;
+      ret *= Flush(view_[r] + from, first + n * per_bucket_bytes_ - from);
+      i += n;
+    }
+    if(ret.ok()) ret *= Sync();
+    if(ret.ok()) {
+      EncodeHeader(view_[0], kRawLayout);
+      ret *= Flush(view_[0], snapshot_header_);
+    }
+    if(ret.ok()) ret *= Sync();
+    if(!ret.ok()) { // retry with next snapshot
+      for(size_t j = 0; j < fresh_.size(); j++) Touch(fresh_[j] * per_bucket_num_);
+    }
+    return ret;
+  }
+  void UnmapRegions() {
+    std::lock_guard<std::mutex> lk(map_lock_);
+    for(size_t r = 0; r < region_num_; r++) {
+      if(view_[r] == NULL) continue;
+      size_t begin, length;
+      RegionView(r, begin, length);
+      Unmap(view_[r], length);
+      view_[r] = NULL;
+    }
+  }
+  // copy frozen content of bucket to `dst` if not NULL,
+  // then hand bucket back to writers
+  void ReleaseFrozen(size_t bucket, char* dst) {
+    uint8_t state = kPending;
+    if(cow_[bucket].compare_exchange_strong(state, kBusy)) {
+      if(dst) memcpy(dst, bucket_[bucket].load(), per_bucket_bytes_);
+    } else { // saved by a writer, wait for its copy to land
+      while(cow_[bucket].load(std::memory_order_acquire) != kSaved) 
+        std::this_thread::yield();
+      char* shadow = shadow_[bucket].exchange(NULL);
+      if(dst) memcpy(dst, shadow, per_bucket_bytes_);
+      delete [] shadow;
+    }
+    cow_[bucket].store(kClean, std::memory_order_release);
+  }
+  // write frozen groups, one frame each, compressed if smaller, after
+  // frames of target or from its start when repacking, then the table
+  // of all groups at `table`, which ends the file
+  // up to `write_depth_` frames in flight while next is compressed
+  Status WriteGroups(SequentialFile& file, Status ret, const Pace& pace,
+                     std::vector<GroupFrame>& frames, uint64_t& table) {
+    size_t groups = (snapshot_buckets_ + group_buckets_ - 1) / group_buckets_;
+    frames.clear();
+    if(!repack_) frames = frames_[target_];
+    frames.resize(groups, GroupFrame{0, 0});
+    uint64_t cursor = repack_ ? packed_header_ : tail_[target_];
+    IoEngine engine(write_depth_);
+    std::vector<char> buffer[write_depth_];
+    std::vector<char> frame[write_depth_];
+    uint64_t ticket[write_depth_] = {0};
+    std::vector<IoSlice> pinned;
+    for(size_t k = 0; k < write_depth_; k++) {
+      buffer[k].resize(group_bytes_);
+      frame[k].resize(frame_header_ + lz::MaxCompressedLength(group_bytes_));
+      pinned.push_back({buffer[k].data(), buffer[k].size()});
+      pinned.push_back({frame[k].data(), frame[k].size()});
+    }
+    engine.Register(pinned.data(), pinned.size());
+    size_t i = 0, k = 0;
+    while(i < frozen_.size()) {
+      size_t group = frozen_[i] / group_buckets_;
+      size_t n = 1;
+      while(i + n < frozen_.size() && frozen_[i + n] / group_buckets_ == group) n++;
+      // reuse buffers once their write is done
+      if(ret.ok()) ret *= engine.Wait(ticket[k]);
+      for(size_t j = 0; j < n; j++) {
+        ReleaseFrozen(frozen_[i + j], 
+          ret.ok() ? buffer[k].data() + j * per_bucket_bytes_ : NULL);
+      }
+      if(ret.ok()) {
+        uint32_t raw = static_cast<uint32_t>(n * per_bucket_bytes_);
+        uint32_t stored = static_cast<uint32_t>(
+          lz::Compress(buffer[k].data(), raw, frame[k].data() + frame_header_));
+        // incompressible group goes out from `buffer` as is
+        IoSlice parts[2] = {
+          {frame[k].data(), frame_header_ + stored}, 
+          {buffer[k].data(), raw}
+        };
+        if(stored >= raw) {
+          stored = raw;
+          parts[0].size = frame_header_;
+        }
+        memcpy(frame[k].data(), &raw, sizeof(uint32_t));
+        memcpy(frame[k].data() + 4, &stored, sizeof(uint32_t));
+        size_t size = frame_header_ + stored;
+        // grown ahead of frames, trimmed to table
+        if(file.size() < cursor + size) 
+          ret *= file.SetEnd(max(cursor + size, file.size() + grow_bytes_));
+        if(pace) pace(size);
+        if(ret.ok()) {
+          ret *= engine.Write(file, cursor, parts, 
+                              stored < raw ? 1 : 2, false, ticket[k]);
+        }
+        frames[group].offset = cursor;
+        frames[group].size = size;
+        cursor += size;
+      }
+      k = (k + 1) % write_depth_;
+      i += n;
+    }
+    ret *= engine.Drain();
+    std::vector<char> entries(groups * table_entry_);
+    for(size_t g = 0; g < groups; g++) {
+      memcpy(entries.data() + g * table_entry_, &frames[g].offset, sizeof(uint64_t));
+      memcpy(entries.data() + g * table_entry_ + 8, &frames[g].size, sizeof(uint64_t));
+    }
+    table = cursor;
+    if(ret.ok()) ret *= file.SetEnd(cursor + entries.size());
+    if(ret.ok() && !entries.empty()) 
+      ret *= file.Write(cursor, entries.size(), entries.data());
+    return ret;
+  }
+  // write frozen buckets, each run of adjacent buckets coalesced 
+  // into writes of up to `read_chunk_` buckets
+  Status WriteFrozen(SequentialFile& file, Status ret, const Pace& pace) {
+    std::vector<char> buffer(min(frozen_.size(), read_chunk_) * per_bucket_bytes_);
+    size_t i = 0;
+    while(i < frozen_.size()) {
+      size_t n = 1;
+      while(i + n < frozen_.size() && n < read_chunk_ && 
+            frozen_[i + n] == frozen_[i] + n) n++;
+      for(size_t j = 0; j < n; j++) {
+        ReleaseFrozen(frozen_[i + j], 
+          ret.ok() ? buffer.data() + j * per_bucket_bytes_ : NULL);
+      }
+      if(ret.ok()) {
+        if(pace) pace(n * per_bucket_bytes_);
+        ret *= file.Write(snapshot_header_ + frozen_[i] * per_bucket_bytes_, 
+                          n * per_bucket_bytes_, 
+                          buffer.data());
+      }
+      i += n;
+    }
+    return ret;
+  }
+  // read buckets [begin, end) from raw snapshot, first at `base`
+  Status ReadBuckets(SequentialFile& file, size_t base, size_t begin, size_t end) {
+    std::vector<char> buffer(read_chunk_ * per_bucket_bytes_);
+    Status ret;
+    for(size_t bucket = begin; bucket < end && ret.ok(); bucket += read_chunk_) {
+      size_t n = min(read_chunk_, end - bucket);
+      ret *= file.Read(base + bucket * per_bucket_bytes_, 
+                  n * per_bucket_bytes_, 
+                  buffer.data());
+      for(size_t i = 0; i < n && ret.ok(); i++) {
+        memcpy(bucket_[bucket + i].load(), 
+               buffer.data() + i * per_bucket_bytes_, 
+               per_bucket_bytes_);
+      }
+    }
+    return ret;
+  }
+  // read table of `groups` frames at `offset`, each checked to lie
+  // between header and table
+  Status ReadTable(SequentialFile& file, uint64_t offset, size_t groups,
+                   std::vector<GroupFrame>& frames) {
+    std::vector<char> entries(groups * table_entry_);
+    frames.resize(groups);
+    Status ret;
+    if(groups > 0) ret *= file.Read(offset, entries.size(), entries.data());
+    for(size_t g = 0; g < groups && ret.ok(); g++) {
+      GroupFrame& f = frames[g];
+      memcpy(&f.offset, entries.data() + g * table_entry_, sizeof(uint64_t));
+      memcpy(&f.size, entries.data() + g * table_entry_ + 8, sizeof(uint64_t));
+      if(f.offset < packed_header_ || f.size < frame_header_ || 
+         f.size > max_frame_ || f.offset + f.size > offset) 
+        ret *= Status::Corruption("malformed snapshot table");
+    }
+    if(!ret.ok()) frames.clear();
+    return ret;
+  }
+  // read groups [begin, end) holding first `buckets` buckets, frames
+  // adjacent in file are read together, up to `read_chunk_` buckets
+  Status ReadGroups(SequentialFile& file, const std::vector<GroupFrame>& frames,
+                    size_t begin, size_t end, size_t buckets) {
+    size_t chunk = read_chunk_ / group_buckets_;
+    std::vector<char> buffer(chunk * max_frame_);
+    std::vector<char> group(group_bytes_);
+    Status ret;
+    size_t g = begin;
+    while(g < end && ret.ok()) {
+      size_t n = 1, bytes = frames[g].size;
+      while(g + n < end && n < chunk && 
+            frames[g + n].offset == frames[g].offset + bytes) {
+        bytes += frames[g + n].size;
+        n++;
+      }
+      ret *= file.Read(frames[g].offset, bytes, buffer.data());
+      const char* frame = buffer.data();
+      for(size_t i = 0; i < n && ret.ok(); i++) {
+        uint32_t raw, stored;
+        memcpy(&raw, frame, sizeof(uint32_t));
+        memcpy(&stored, frame + 4, sizeof(uint32_t));
+        size_t first = (g + i) * group_buckets_;
+        size_t count = min(group_buckets_, buckets - first);
+        if(raw > group_bytes_ || raw < count * per_bucket_bytes_ || 
+           stored > raw || frame_header_ + stored != frames[g + i].size) {
+          ret *= Status::Corruption("malformed snapshot group");
+          break;
+        }
+        const char* src = frame + frame_header_;
+        if(stored < raw) {
+          if(!lz::Decompress(src, stored, group.data(), raw)) {
+            ret *= Status::Corruption("malformed snapshot group");
+            break;
+          }
+          src = group.data();
+        }
+        for(size_t b = 0; b < count; b++) {
+          memcpy(bucket_[first + b].load(), 
+                 src + b * per_bucket_bytes_, 
+                 per_bucket_bytes_);
+        }
+        frame += frames[g + i].size;
+      }
+      g += n;
+    }
+    return ret;
+  }
+  bool AllocBucket(size_t idx) {
     size_t tmp;
     while((tmp = bucket_size_.load()) <= idx) {
       if(std::atomic_compare_exchange_strong(&bucket_size_, &tmp, tmp + 1)) {
-        bucket_[tmp] = new char[per_bucket_bytes_];
+        bucket_[tmp] = mapped_ ? MapBucket(tmp) : new char[per_bucket_bytes_];
       }
     }
+    // bucket claimed by another thread may not be published yet
+    while(bucket_[idx].load() == NULL) {
+      if(map_failed_.load()) return false;
+      std::this_thread::yield();
+    }
+    return true;
   }
 };
 
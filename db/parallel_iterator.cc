@@ -0,0 +1,95 @@
+#include "parallel_iterator.h"
+
+#include <functional>
+
+namespace portal_db {
+
+void ParallelIterator::Start(ThreadPool* pool) {
+  pool_ = pool;
+  std::lock_guard<std::mutex> lk(lock_);
+  for(size_t i = 0; i < partitions_.size(); i++) Submit(partitions_[i].get());
+}
+
+void ParallelIterator::Submit(Partition* part) {
+  scheduled_ ++;
+  pool_->Submit(std::bind(&ParallelIterator::Worker, this, part));
+}
+
+void ParallelIterator::Worker(Partition* part) {
+  HashTrieIterator& iterator = part->iterator;
+  std::unique_lock<std::mutex> lk(lock_);
+  // task may start after close
+  while(!closed_ && part->ready.size() < depth_) {
+    lk.unlock();
+    bool more = iterator.NextBatch();
+    std::vector<RecordRef> batch(more ? iterator.batch_size() : 0);
+    for(size_t i = 0; i < batch.size(); i++) batch[i] = iterator.batch(i);
+    lk.lock();
+    if(!more) {
+      part->done = true;
+      break;
+    }
+    part->ready.push_back(std::move(batch));
+    produced_.notify_all();
+  }
+  // full buffer parks partition rather than holding a pool worker
+  if(!part->done) part->parked = true;
+  produced_.notify_all();
+  if(--scheduled_ == 0) finished_.notify_all();
+}
+
+bool ParallelIterator::Fetch() {
+  std::unique_lock<std::mutex> lk(lock_);
+  while(true) {
+    Partition* hit = NULL;
+    if(sort) {
+      // drain partitions in key order
+      while(next_partition_ < partitions_.size()) {
+        Partition* part = partitions_[next_partition_].get();
+        if(!part->ready.empty()) {
+          hit = part;
+          break;
+        } else if(part->done) next_partition_ ++;
+        else break;
+      }
+      if(hit == NULL && next_partition_ >= partitions_.size()) return false;
+    } else {
+      bool drained = true;
+      for(size_t i = 0; i < partitions_.size() && hit == NULL; i++) {
+        Partition* part = partitions_[i].get();
+        if(!part->ready.empty()) hit = part;
+        else if(!part->done) drained = false;
+      }
+      if(hit == NULL && drained) return false;
+    }
+    if(hit != NULL) {
+      batch_.swap(hit->ready.front());
+      hit->ready.pop_front();
+      current_ = -1;
+      batch_begin_ = 0;
+      if(hit->parked) { // room again, resume producer
+        hit->parked = false;
+        Submit(hit);
+      }
+      return true;
+    }
+    produced_.wait(lk);
+  }
+}
+
+void ParallelIterator::Close() {
+  {
+    // queued tasks still run, and return at once
+    std::unique_lock<std::mutex> lk(lock_);
+    closed_ = true;
+    finished_.wait(lk, [&]() -> bool { return scheduled_ == 0; });
+  }
+  partitions_.clear();
+  closed_ = false;
+  next_partition_ = 0;
+  current_ = -1;
+  batch_begin_ = 0;
+  batch_.clear();
+}
+
+} // namespace portal_db
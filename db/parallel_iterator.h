@@ -0,0 +1,115 @@
+#ifndef PORTAL_DB_PARALLEL_ITERATOR_H_
+#define PORTAL_DB_PARALLEL_ITERATOR_H_
+
+#include "portal_db/slice.h"
+#include "portal_db/piece.h"
+#include "portal_db/status.h"
+#include "hash_trie_iterator.h"
+#include "util/thread_pool.h"
+#include "util/util.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace portal_db {
+
+class HashTrie;
+
+// Scan disjoint key partitions as tasks on the worker pool of the trie.
+// + sort -- partitions are drained in key order, since each covers a
+//    contiguous range the ordered merge is a concatenation
+// + unsort -- batches are returned as soon as any worker yields one,
+//    suitable for aggregation
+// With a single partition and `depth` 1 it is a double-buffered
+// pipeline: worker fills next batch while consumer handles current one.
+class ParallelIterator : public ReadIterator<KeyValue>, public NoMove {
+  friend HashTrie;
+ public:
+  // `depth` bounds batches buffered per partition
+  ParallelIterator(bool sort = false, size_t depth = 4)
+      : sort(sort), 
+        depth_(depth == 0 ? 1 : depth) { }
+  ~ParallelIterator() { Close(); }
+  bool Next() {
+    while(current_ + 1 >= batch_.size()) {
+      if(!Fetch()) return false;
+    }
+    if(peeked_.size() < batch_.size()) peeked_.resize(batch_.size());
+    current_ ++;
+    return true;
+  }
+  // called after `Next` returns true
+  // copy into holder of its slot, valid until next batch is fetched
+  const KeyValue& Peek() const {
+    const char* p = batch_[current_].record;
+    KeyValue& ret = peeked_[current_];
+    for(int i = 0; i < 8; i++) ret[i] = p[i];
+    ret.copy<0, 256>(p + 8);
+    return ret;
+  }
+  // zero-copy access to current record
+  const char* key() const { return batch_[current_].record; }
+  const char* value() const { return batch_[current_].record + 8; }
+  // consume the rest of current batch as a whole
+  bool NextBatch() {
+    while(current_ + 1 >= batch_.size()) {
+      if(!Fetch()) return false;
+    }
+    if(peeked_.size() < batch_.size()) peeked_.resize(batch_.size());
+    batch_begin_ = current_ + 1;
+    current_ = batch_.size() - 1;
+    return true;
+  }
+  size_t batch_size() const { return batch_.size() - batch_begin_; }
+  const RecordRef& batch(size_t idx) const { 
+    return batch_[batch_begin_ + idx]; 
+  }
+  size_t size() const {
+    return batch_.size();
+  }
+  // stop workers and drop pending batches
+  void Close();
+ private:
+  struct Partition {
+    Partition(bool sort): iterator(sort) { }
+    HashTrieIterator iterator;
+    std::deque<std::vector<RecordRef>> ready;
+    bool done = false;
+    bool parked = false; // buffer full, no task scheduled
+  };
+  const bool sort;
+  // batches buffered per partition before its task parks
+  const size_t depth_;
+  std::mutex lock_;
+  std::condition_variable produced_;
+  std::vector<std::unique_ptr<Partition>> partitions_;
+  ThreadPool* pool_ = NULL; // of the trie scanned
+  size_t scheduled_ = 0; // tasks submitted and not finished
+  std::condition_variable finished_;
+  bool closed_ = false;
+  size_t next_partition_ = 0; // for sorted drain
+  // current batch
+  int32_t current_ = -1;
+  int32_t batch_begin_ = 0;
+  std::vector<RecordRef> batch_;
+  // holders of peeked records, one per slot of batch
+  mutable std::vector<KeyValue> peeked_;
+  // submit one task per partition to `pool`
+  void Start(ThreadPool* pool);
+  // schedule task producing batches of `part`, with `lock_` held
+  void Submit(Partition* part);
+  // fill buffer of `part` up to `depth_`, then return
+  void Worker(Partition* part);
+  // wait for next batch, false if all drained
+  bool Fetch();
+};
+
+} // namespace portal_db
+
+#endif // PORTAL_DB_PARALLEL_ITERATOR_H_
@@ -1,38 +1,42 @@
 #include "persist_hash_trie.h"
-#include "portal_db/port.h"
 
 namespace portal_db {
-  
-#ifdef WIN_PLATFORM
 
-void __stdcall snapshot_callback(
-  PVOID dwUser,
-  BOOLEAN timerOrWaitFired){
-  // use dwUser to point to trigger data
-  PersistHashTrie* p = reinterpret_cast<PersistHashTrie*>(dwUser);
-  p->__persist__();
-} 
-
-void PersistHashTrie::StartDaemon() {
-  assert(CreateTimerQueueTimer(
-    &sys_timer_, 
-    NULL, 
-    snapshot_callback, 
-    (PVOID)(this), 
-    snapshot_interval,
-    snapshot_interval, 
-    WT_EXECUTEDEFAULT));
-}
-
-void PersistHashTrie::CloseDaemon() {
-  if(sys_timer_ != NULL) {
-    assert(DeleteTimerQueueTimer(NULL, sys_timer_, INVALID_HANDLE_VALUE));
-    sys_timer_ = NULL;
+void PersistHashTrie::SnapshotThread() {
+  last_snapshot_ = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lk(snapshot_lock_);
+  while(true) {
+    snapshot_cv_.wait_for(lk, std::chrono::milliseconds(poll_interval), 
+      [&]() -> bool { return snapshot_requested_ || snapshot_close_; });
+    bool requested = snapshot_requested_;
+    if(!requested && snapshot_close_) break;
+    snapshot_requested_ = false;
+    lk.unlock();
+    if(requested || SnapshotDue()) {
+      Status status = Snapshot();
+      if(!status.ok()) status.inspect();
+      last_snapshot_ = std::chrono::steady_clock::now();
+    }
+    lk.lock();
   }
 }
 
-#else
-#error    "no implementation for atimer on this platform"
-#endif
+bool PersistHashTrie::SnapshotDue() {
+  uint64_t backlog = binlogger_.backlog();
+  if(backlog == 0) return false;
+  // recovery bound holds regardless of load
+  uint64_t replay = backlog * 1000 / max(replay_rate_.load(), (uint64_t)1);
+  if(replay * 2 >= recovery_target_.load()) return true;
+  if(backlog < min_backlog) return false;
+  if(std::chrono::steady_clock::now() - last_snapshot_ < 
+     std::chrono::milliseconds(min_interval)) return false;
+  if(binlogger_.latency() > commit_latency_limit) return false;
+  // snapshot pays off once it writes less than recovery replays
+  wrlock_.ReadLock();
+  uint64_t cost = values_.DirtyBytes();
+  if(!values_.mapped()) cost += index_header_ + nodes_.size() * node_record_;
+  wrlock_.ReadUnlock();
+  return backlog >= cost;
+}
 
 } // namespace portal_db
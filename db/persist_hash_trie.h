@@ -2,23 +2,53 @@
 #define PORTAL_DB_PERSIST_HASH_TRIE_H_
 
 #include "hash_trie.h"
-#include "bin_logger_daemon.h"
+#include "sharded_bin_logger.h"
+#include "log_replay.h"
 #include "util/readwrite_lock.h"
-#include "portal_db/port.h"
+#include "util/rate_limiter.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 namespace portal_db {
 
+// Snapshot thread wakes every `poll_interval` and snapshots when
+// + requested by `RequestSnapshot`
+// + replay of log since checkpoint is projected to take half of
+//    recovery target, other half covers log written meanwhile
+// + log since checkpoint outweighs what snapshot writes, at most once
+//    per `min_interval` and only while log commits are fast
 class PersistHashTrie: public HashTrie {
  public:
-  PersistHashTrie(std::string filename) 
-      : HashTrie(filename),
-        binlogger_(filename + ".bin") {
-    StartDaemon();
+  // `log_shards` > 1 spreads binlog over per-thread files
+  // `mapped` snapshots by writing back dirty pages of record file
+  // `log_mode` of binlog appends, see `BinLogger`
+  PersistHashTrie(std::string filename, 
+                  bool ordered = false,
+                  Durability durability = Durability::kInterval,
+                  size_t log_shards = 1,
+                  bool mapped = false,
+                  LogMode log_mode = LogMode::kBuffered) 
+      : HashTrie(filename, ordered, mapped),
+        binlogger_(filename + ".bin", durability, log_shards, log_mode) {
+    snapshot_thread_ = std::thread(
+      std::mem_fn(&PersistHashTrie::SnapshotThread),
+      this
+    );
   }
   ~PersistHashTrie() {
+    // finish requested snapshot before log goes away
+    {
+      std::lock_guard<std::mutex> lk(snapshot_lock_);
+      snapshot_close_ = true;
+      snapshot_cv_.notify_one();
+    }
+    if(snapshot_thread_.joinable()) snapshot_thread_.join();
     binlogger_.Close();
-    CloseDaemon();
-    values_.Close();
+    if(values_.opened()) values_.Close();
   }
   Status Get(const Key& key, Value& ret) {
     wrlock_.ReadLock();
@@ -30,11 +60,40 @@ class PersistHashTrie: public HashTrie {
     wrlock_.WriteLock();
     size_t v = binlogger_.AppendPut(key, value);
     Status ret = HashTrie::Put(key, value);
-    mod_ ++;
     wrlock_.WriteUnlock();
-    binlogger_.Wait(v);
+    if(binlogger_.durability() != Durability::kNone) ret *= binlogger_.Wait(v);
+    return ret;
+  }
+  // async write family //
+  // apply and log without waiting, `token` resolves once the log
+  // entry is committed, whatever the durability
+  Status PutAsync(const Key& key, const Value& value, LogToken& token) {
+    wrlock_.WriteLock();
+    uint64_t lsn;
+    size_t v = binlogger_.AppendPut(key, value, &lsn);
+    Status ret = HashTrie::Put(key, value);
+    wrlock_.WriteUnlock();
+    token = binlogger_.Token(v, lsn);
+    return ret;
+  }
+  Status DeleteAsync(const Key& key, LogToken& token) {
+    wrlock_.WriteLock();
+    uint64_t lsn;
+    size_t v = binlogger_.AppendDelete(key, &lsn);
+    Status ret = HashTrie::Delete(key);
+    wrlock_.WriteUnlock();
+    token = binlogger_.Token(v, lsn);
     return ret;
   }
+  // poll a token, resolved once recovery would replay its op, tokens
+  // resolve in lsn order
+  bool Committed(const LogToken& token) const {
+    return binlogger_.Committed(token);
+  }
+  // block until a token resolves, error if its log write failed
+  Status Wait(const LogToken& token) {
+    return binlogger_.Wait(token);
+  }
   Status Scan(const Key& lower, 
               const Key& upper, 
               HashTrieIterator& ret) {
@@ -43,68 +102,128 @@ class PersistHashTrie: public HashTrie {
     wrlock_.ReadUnlock();
     return status;
   }
+  Status ParallelScan(const Key& lower, 
+                      const Key& upper, 
+                      size_t n, 
+                      ParallelIterator& ret) {
+    wrlock_.ReadLock();
+    Status status = HashTrie::ParallelScan(lower, upper, n, ret);
+    wrlock_.ReadUnlock();
+    return status;
+  }
   Status Delete(const Key& key) {
     wrlock_.WriteLock();
     size_t v = binlogger_.AppendDelete(key);
     Status ret = HashTrie::Delete(key);
-    mod_ ++;
     wrlock_.WriteUnlock();
-    binlogger_.Wait(v);
+    if(binlogger_.durability() != Durability::kNone) ret *= binlogger_.Wait(v);
     return ret;
   }
-  Status RecoverBinLog() {
+  // frozen records are neither logged nor snapshotted
+  Status Freeze() override {
+    return Status::NotSupported("freeze on persistent store");
+  }
+  // replay last op per key on `threads` workers, 0 for all cores
+  Status RecoverBinLog(size_t threads = 0) {
     wrlock_.WriteLock();
-    Status status;
-    Status op_status;
-    Key key;
-    Value value;
-    char alloc[256];
-    bool is_put;
-    while(op_status.ok()) {
-      status *= binlogger_.Read(key, alloc, is_put);
-      if(status.ok()) {
-        if(is_put) {
-          value.copy<0,256>(alloc);
-          op_status *= HashTrie::Put(key, value);
-        } else HashTrie::Delete(key);
-      } else break;
-    }
+    auto start = std::chrono::steady_clock::now();
+    uint64_t backlog = binlogger_.backlog();
+    LogReplay replay(threads);
+    Status status = replay.Load(binlogger_);
+    if(status.ok()) status *= replay.Apply(*this);
+    // calibrate projected replay time
+    double elapsed = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+    backlog = binlogger_.backlog() - backlog;
+    if(status.ok() && backlog >= min_backlog && elapsed > 0) 
+      replay_rate_ = static_cast<uint64_t>(backlog / elapsed);
     wrlock_.WriteUnlock();
-    return op_status;
+    // entries past durable point stay in log until a checkpoint
+    // passes them, appends after them would be dropped with them
+    if(status.ok() && binlogger_.dropped() > 0) status *= Snapshot();
+    return status;
   }
-  Status RecoverSnapshot() {
+  // load snapshot and its index image, rebuild trie on `threads`
+  // workers when image is missing or stale, 0 for all cores
+  Status RecoverSnapshot(size_t threads = 0) {
+    if(threads == 0) threads = std::thread::hardware_concurrency();
     wrlock_.WriteLock();
-    Key key;
-    Value value;
     Status op_status;
-    op_status *= values_.ReadSnapshot();
-    if(!op_status.ok()) return op_status;
-    std::cout << "snapshot size: " << values_.size() << std::endl;
-    for(int i = 0; i < values_.size() && op_status.ok(); i++) {
-      op_status *= PutRecover(i);
+    op_status *= values_.ReadSnapshot(threads);
+    if(!op_status.ok()) {
+      wrlock_.WriteUnlock();
+      return op_status;
     }
+    std::cout << "snapshot size: " << values_.size() << std::endl;
+    // mapped records may be newer than any index image
+    if(values_.mapped() || !LoadIndex().ok()) op_status *= Rebuild(threads);
     wrlock_.WriteUnlock();
     return op_status;
   }
-  // internal use
-  void __persist__() {
-    if(mod_ >= snapshot_mod) {
-      mod_ = 0;
-      binlogger_.Checkpoint();
-      binlogger_.Compact();
-      assert(values_.MakeSnapshot().inspect());
-    }
+  // hand snapshot to snapshot thread regardless of policy
+  void RequestSnapshot() {
+    std::lock_guard<std::mutex> lk(snapshot_lock_);
+    snapshot_requested_ = true;
+    snapshot_cv_.notify_one();
+  }
+  // bound on projected log replay time of a recovery
+  void SetRecoveryTarget(std::chrono::milliseconds target) {
+    recovery_target_ = static_cast<uint64_t>(target.count());
   }
  private:
   ReadWriteLock wrlock_;
-  static constexpr size_t snapshot_interval = 500; // 0.5 sec
-  static constexpr size_t snapshot_mod = 100; // every 100 mod
-  std::atomic<size_t> mod_ = 0;
-  BinLoggerDaemon binlogger_;
-  // std::thread daemon_;
-  HANDLE sys_timer_;
-  void StartDaemon();
-  void CloseDaemon();
+  // snapshot scheduling
+  static constexpr size_t poll_interval = 100; // 0.1 sec
+  static constexpr size_t min_interval = 1000; // 1 sec
+  static constexpr uint64_t min_backlog = (1 << 20); // 1 MB
+  static constexpr uint64_t default_recovery_target = 10000; // 10 sec
+  static constexpr uint64_t default_replay_rate = (32 << 20); // 32 MB/s
+  // snapshot write pacing
+  static constexpr size_t snapshot_bandwidth = (64 << 20); // 64 MB/s
+  static constexpr size_t snapshot_burst = (4 << 20); // 4 MB
+  static constexpr uint64_t commit_latency_limit = 20000; // 20 ms
+  static constexpr size_t max_pause = 100; // ms per write
+  std::atomic<uint64_t> recovery_target_ = default_recovery_target; // ms
+  std::atomic<uint64_t> replay_rate_ = default_replay_rate; // bytes per sec
+  std::chrono::steady_clock::time_point last_snapshot_;
+  ShardedBinLogger binlogger_;
+  std::thread snapshot_thread_;
+  std::mutex snapshot_lock_;
+  std::mutex snapshot_run_lock_; // one snapshot at a time
+  std::condition_variable snapshot_cv_;
+  bool snapshot_requested_ = false;
+  bool snapshot_close_ = false;
+  // serve requests and policy until closed, pending request is 
+  // served first
+  void SnapshotThread();
+  // evaluate policy against log backlog and snapshot cost
+  bool SnapshotDue();
+  Status Snapshot() {
+    std::lock_guard<std::mutex> run(snapshot_run_lock_);
+    std::vector<char> index;
+    // brief cut with writers excluded, checkpoint, frozen buckets 
+    // and index image describe the same state
+    wrlock_.ReadLock();
+    binlogger_.Checkpoint();
+    values_.BeginSnapshot();
+    if(!values_.mapped()) EncodeIndex(index);
+    wrlock_.ReadUnlock();
+    // throttled, and yields disk while log commits are slow
+    RateLimiter limiter(snapshot_bandwidth, snapshot_burst);
+    auto pace = [&](size_t bytes) {
+      limiter.Request(bytes);
+      for(size_t i = 0; i < max_pause && 
+          binlogger_.latency() > commit_latency_limit; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    };
+    // writers copy a frozen bucket before rewriting it
+    Status status = values_.WriteSnapshot(pace);
+    if(status.ok() && !index.empty()) status *= WriteIndex(index, pace);
+    // log before checkpoint is dropped only once snapshot is durable
+    if(status.ok()) status *= binlogger_.Compact();
+    return status;
+  }
 };
 
 } // namespace portal_db
@@ -0,0 +1,142 @@
+#include "sharded_bin_logger.h"
+
+#include <cstring>
+
+namespace portal_db {
+
+ShardedBinLogger::ShardedBinLogger(std::string name, 
+                                   Durability durability,
+                                   size_t shards,
+                                   LogMode mode)
+    : lsn_(1) {
+  if(shards <= 1) {
+    shards_.emplace_back(new BinLoggerDaemon(name, durability, NULL, mode));
+    return ;
+  }
+  for(size_t i = 0; i < shards; i++) {
+    std::string file = (i == 0) ? name : name + "." + std::to_string(i);
+    shards_.emplace_back(new BinLoggerDaemon(file, durability, &lsn_, mode));
+  }
+}
+
+Status ShardedBinLogger::Close() {
+  Status ret;
+  for(size_t i = 0; i < shards_.size(); i++) ret *= shards_[i]->Close();
+  return ret;
+}
+
+size_t ShardedBinLogger::LocalShard() const {
+  static std::atomic<size_t> threads(0);
+  thread_local size_t id = std::atomic_fetch_add(&threads, (size_t)1);
+  return id % shards_.size();
+}
+
+Status ShardedBinLogger::Wait(size_t version) {
+  if(shards_.size() == 1) return shards_[0]->Wait(version);
+  // every op with smaller lsn took its slot before our lsn was stamped
+  Status ret;
+  for(size_t i = 0; i < shards_.size(); i++) {
+    BinLoggerDaemon& shard = *shards_[i];
+    if(&shard == &Local()) ret *= shard.Wait(version);
+    else ret *= shard.Wait(shard.issued());
+  }
+  return ret;
+}
+
+bool ShardedBinLogger::Committed(const LogToken& token) const {
+  if(shards_.size() == 1) return shards_[0]->Committed(token.version);
+  // minimum committed lsn across shards, durable point of `Read`
+  for(size_t i = 0; i < shards_.size(); i++) {
+    if(!shards_[i]->Durable(token.lsn)) return false;
+  }
+  return true;
+}
+
+Status ShardedBinLogger::Wait(const LogToken& token) {
+  if(shards_.size() == 1) return shards_[0]->Wait(token.version);
+  Status ret;
+  for(size_t i = 0; i < shards_.size(); i++) ret *= shards_[i]->WaitDurable(token.lsn);
+  return ret;
+}
+
+Status ShardedBinLogger::Rewind() {
+  merging_ = false;
+  heads_.clear();
+  dropped_ = 0;
+  error_ = Status::OK();
+  Status ret;
+  for(size_t i = 0; i < shards_.size(); i++) ret *= shards_[i]->Rewind();
+  return ret;
+}
+
+void ShardedBinLogger::Advance(size_t i) {
+  Head& head = heads_[i];
+  // stop at end or torn tail of shard
+  Status status = shards_[i]->Read(head.key, head.value, head.put, head.lsn);
+  head.valid = status.ok();
+  if(!status.ok() && !shards_[i]->ended()) error_ *= status;
+  if(head.valid && head.lsn >= lsn_.load()) lsn_ = head.lsn + 1;
+}
+
+Status ShardedBinLogger::Read(Key& ret, char* alloc_ptr, bool& put) {
+  if(shards_.size() == 1) {
+    Status status = shards_[0]->Read(ret, alloc_ptr, put);
+    if(!status.ok() && shards_[0]->ended()) return Status::NotFound("EOF");
+    return status;
+  }
+  if(!merging_) {
+    heads_.assign(shards_.size(), Head());
+    expected_ = 1;
+    dropped_ = 0;
+    for(size_t i = 0; i < shards_.size(); i++) {
+      Advance(i); // opens shard and its manifest
+      expected_ = max(expected_, shards_[i]->first_lsn());
+    }
+    // stamps resume past checkpoint even if log holds nothing after it
+    if(lsn_.load() < expected_) lsn_ = expected_;
+    merging_ = true;
+  }
+  if(!error_.ok()) return error_;
+  // k-way merge on smallest head
+  size_t next = shards_.size();
+  for(size_t i = 0; i < shards_.size(); i++) {
+    if(heads_[i].valid && (next == shards_.size() || heads_[i].lsn < heads_[next].lsn))
+      next = i;
+  }
+  // stamps before checkpoint are covered by snapshot, later ones
+  // replay only while none is missing
+  if(next < shards_.size() && heads_[next].lsn <= expected_) {
+    Head& head = heads_[next];
+    if(head.lsn == expected_) expected_ ++;
+    ret = head.key;
+    put = head.put;
+    if(put) memcpy(alloc_ptr, head.value, 256);
+    Advance(next);
+    return Status::OK();
+  }
+  // rest is past durable point, read on only to move lsn past it
+  for(size_t i = 0; i < shards_.size(); i++) {
+    while(heads_[i].valid) {
+      dropped_ ++;
+      Advance(i);
+    }
+  }
+  if(!error_.ok()) return error_;
+  return Status::NotFound("EOF");
+}
+
+void ShardedBinLogger::Checkpoint() {
+  // ops stamped before are in state being snapshotted
+  uint64_t lsn = lsn_.load();
+  for(size_t i = 0; i < shards_.size(); i++) shards_[i]->Checkpoint(lsn);
+}
+
+Status ShardedBinLogger::Compact() {
+  std::vector<size_t> versions(shards_.size());
+  for(size_t i = 0; i < shards_.size(); i++) versions[i] = shards_[i]->Compact();
+  Status ret;
+  for(size_t i = 0; i < shards_.size(); i++) ret *= shards_[i]->Wait(versions[i]);
+  return ret;
+}
+
+} // namespace portal_db
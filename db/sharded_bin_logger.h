@@ -0,0 +1,116 @@
+#ifndef PORTAL_DB_SHARDED_BIN_LOGGER_H_
+#define PORTAL_DB_SHARDED_BIN_LOGGER_H_
+
+#include "bin_logger_daemon.h"
+#include "portal_db/piece.h"
+#include "portal_db/status.h"
+#include "util/util.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace portal_db {
+
+// Spread logging over shards picked per writer thread, each a daemon
+// with its own file (`name`, `name.1`, ...) and queue.
+// + entries are stamped with a global lsn
+// + durable point: `Wait` returns once every op issued before it is
+//    committed on all shards, i.e. the minimum committed point, and
+//    a `LogToken` resolves once every lsn up to its own is
+// + recovery replays entries of all shards merged by lsn, up to the
+//    first lsn missing past the checkpoint: a later entry may follow
+//    a lost one, so replay stays a prefix
+// With one shard it is a plain daemon without lsn stamps.
+// commit point of one op: version on its shard, and its global lsn
+// when sharded, default one is committed
+struct LogToken {
+  size_t shard = 0;
+  size_t version = 0;
+  uint64_t lsn = 0;
+};
+
+class ShardedBinLogger : public NoMove {
+ public:
+  ShardedBinLogger(std::string name, 
+                   Durability durability = Durability::kInterval,
+                   size_t shards = 1,
+                   LogMode mode = LogMode::kBuffered);
+  Status Close();
+  // operation enqueue family //
+  // `lsn` receives global lsn of entry, for `Token`
+  size_t AppendPut(const Key& key, const Value& value, uint64_t* lsn = NULL) {
+    return Local().AppendPut(key, value, lsn);
+  }
+  size_t AppendDelete(const Key& key, uint64_t* lsn = NULL) {
+    return Local().AppendDelete(key, lsn);
+  }
+  // wait for version returned by append of calling thread
+  // error if a shard failed to log an op it covers
+  Status Wait(size_t version);
+  // pin version and lsn returned by append of calling thread
+  // a token covers every token of smaller lsn
+  LogToken Token(size_t version, uint64_t lsn) {
+    return LogToken{LocalShard(), version, lsn};
+  }
+  // true once every op up to lsn of `token` is committed on all
+  // shards, so replay reaches it, never blocks
+  bool Committed(const LogToken& token) const;
+  // block until `Committed(token)`, error if a shard fails first
+  Status Wait(const LogToken& token);
+  Durability durability() const { return shards_[0]->durability(); }
+  size_t shards() const { return shards_.size(); }
+  // slowest latest group commit among shards, in microseconds
+  uint64_t latency() const {
+    uint64_t ret = 0;
+    for(size_t i = 0; i < shards_.size(); i++) 
+      ret = max(ret, shards_[i]->latency());
+    return ret;
+  }
+  // log bytes a recovery replays on all shards
+  uint64_t backlog() const {
+    uint64_t ret = 0;
+    for(size_t i = 0; i < shards_.size(); i++) 
+      ret += shards_[i]->backlog();
+    return ret;
+  }
+  // recovery routine //
+  Status Rewind();
+  // read one entry at a time in lsn order
+  // NotFound at end of log or its torn tail, past which replay stops,
+  // other errors are failed reads or damage before it
+  Status Read(Key& ret, char* alloc_ptr, bool& put);
+  // entries past durable point left out by last replay
+  size_t dropped() const { return dropped_; }
+  // checkpoint logging //
+  void Checkpoint();
+  // compact every shard, returns once manifests are saved
+  Status Compact();
+ private:
+  std::atomic<uint64_t> lsn_; // start from 1
+  std::vector<std::unique_ptr<BinLoggerDaemon>> shards_;
+  // next unmerged entry of a shard, entries ascend by lsn in shard
+  struct Head {
+    bool valid = false;
+    uint64_t lsn = 0;
+    bool put = false;
+    Key key;
+    char value[256];
+  };
+  bool merging_ = false;
+  std::vector<Head> heads_;
+  uint64_t expected_ = 1; // next lsn replay needs
+  size_t dropped_ = 0;
+  Status error_; // of a shard read short of its end
+  // shard of calling thread
+  size_t LocalShard() const;
+  BinLoggerDaemon& Local() { return *shards_[LocalShard()]; }
+  // read next entry of shard `i`
+  void Advance(size_t i);
+};
+
+} // namespace portal_db
+
+#endif // PORTAL_DB_SHARDED_BIN_LOGGER_H_
@@ -23,6 +23,8 @@ class Value {
     value_ = (rhs.value_ == NULL) ? NULL : CopyData(rhs.value_, 256); }
   Value(Value&& rhs): value_(rhs.value_) { rhs.value_ = NULL; }
   Value& operator=(Value&& rhs) {
+    if(this == &rhs) return *this;
+    delete[] value_;
     value_ = rhs.value_;
     rhs.value_ = NULL;
     return *this;
@@ -106,6 +108,8 @@ class Key : public CharwiseAccess {
     rhs.key_ = NULL;
   }
   Key& operator=(Key&& rhs) {
+    if(this == &rhs) return *this;
+    delete[] key_;
     key_ = rhs.key_;
     rhs.key_ = NULL;
     return *this;
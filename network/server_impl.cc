@@ -82,7 +82,8 @@ void ServerImpl::Spawn(SOCKET socket) {
   int recvbuflen = buffer_len_;
   int cur = 0;
   std::string tmp;
-  HashTrieIterator tmp_iterator = HashTrieIterator(true);
+  // single partition pipeline, next batch is fetched while sending
+  ParallelIterator tmp_iterator(true, 1);
   Key tmp_key;
   Value tmp_value = Value::from_string("");
   bool in_session = false;
@@ -159,7 +160,7 @@ void ServerImpl::Spawn(SOCKET socket) {
   {
     for(int i = 0; i < 8; i++) tmp_key[i]=recvbuf[3+i];
     Key upper(recvbuf + 3 + 8);
-    if(!Send(socket, pstore.get()->Scan(tmp_key, upper, tmp_iterator).ToString()))
+    if(!Send(socket, pstore.get()->ParallelScan(tmp_key, upper, 1, tmp_iterator).ToString()))
       std::cout << "Send Failed" << std::endl;
   }
   for(int i = 0; i + 19 < cur; i++) recvbuf[i] = recvbuf[i+19];
@@ -170,16 +171,16 @@ void ServerImpl::Spawn(SOCKET socket) {
   std::cout << "MOR" << std::endl;
   {
     uint32_t size = 0;
-    if(!tmp_iterator.Next()) {
+    if(!tmp_iterator.NextBatch()) {
       size = 0;
-    } else size = tmp_iterator.size();
+    } else size = tmp_iterator.batch_size();
     if(send(socket, (char*)&size, 4, 0) == SOCKET_ERROR) // bug
       std::cout << "Send Failed" << std::endl;
     for(int i = 0; i < size; i++) {
-      if(i > 0 && !tmp_iterator.Next()) 
-        std::cout << "Early Exaustion" << std::endl;
-      const KeyValue& kv = tmp_iterator.Peek();
-      if(!Send(socket, kv)) std::cout << "Send Failed" << std::endl;
+      // send straight from record memory
+      const char* record = tmp_iterator.batch(i).record;
+      if(!Send(socket, record, record + 8)) 
+        std::cout << "Send Failed" << std::endl;
     }
   }
   for(int i = 0; i + 3 < cur; i++) recvbuf[i] = recvbuf[i+3];
@@ -211,6 +212,13 @@ bool ServerImpl::Send(SOCKET target, const KeyValue& data) {
   if(iSendResult == SOCKET_ERROR) return false;
   return true;
 }
+bool ServerImpl::Send(SOCKET target, const char* key, const char* value) {
+  int iSendResult = send(target, key, 8, 0);
+  if(iSendResult == SOCKET_ERROR) return false;
+  iSendResult = send(target, value, 256, 0);
+  if(iSendResult == SOCKET_ERROR) return false;
+  return true;
+}
 bool ServerImpl::Send(SOCKET target, const Key& key, const Value& value) {
   int iSendResult = send(target, key.raw_ptr(), 8, 0);
   if(iSendResult == SOCKET_ERROR) return false;
@@ -8,6 +8,7 @@
 #include "util/util.h"
 #include "db/persist_hash_trie.h"
 #include "db/hash_trie_iterator.h"
+#include "db/parallel_iterator.h"
 
 #include <memory>
 #include <thread>
@@ -45,6 +46,8 @@ class ServerImpl : public Server, public NoMove {
   // send key-value
   bool Send(SOCKET target, const KeyValue& data);
   bool Send(SOCKET target, const Key& key, const Value& value);
+  // send raw record slices
+  bool Send(SOCKET target, const char* key, const char* value);
 };
 
 } // namespace portal_db
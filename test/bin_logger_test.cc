@@ -1,12 +1,19 @@
 #include <gtest/gtest.h>
 
 #include "db/bin_logger.h"
+#include "db/bin_logger_daemon.h"
+#include "db/sharded_bin_logger.h"
+#include "util/compress.h"
+#include "util/crc32c.h"
 #include "util.h"
 #include "portal_db/status.h"
 #include "portal_db/piece.h"
 
+#include <chrono>
 #include <cstring>
 #include <string>
+#include <thread>
+#include <vector>
 
 using namespace portal_db;
 
@@ -25,4 +32,534 @@ TEST(BinLoggerTest, Write) {
   EXPECT_TRUE(logger.Compact().inspect());
   EXPECT_TRUE(logger.Close().inspect());
   EXPECT_TRUE(logger.Delete().inspect());
-}
\ No newline at end of file
+}
+TEST(BinLoggerTest, GroupCommit) {
+  BinLoggerDaemon* daemon = new BinLoggerDaemon("unique.bin", Durability::kCommit);
+  size_t size = 1000;
+  size_t thread_num = 4;
+  char buffer[256];
+  memset(buffer, 'x', sizeof(char) * 256);
+  Value value(buffer);
+  std::vector<std::thread> threads;
+  for(int t = 0; t < thread_num; t++) {
+    threads.push_back(std::thread([&]() {
+      for(int i = 0; i < size; i++) {
+        Key key(rnd.NumericString(8).c_str());
+        daemon->Wait(daemon->AppendPut(key, value));
+      }
+    }));
+  }
+  for(int t = 0; t < thread_num; t++) threads[t].join();
+  EXPECT_TRUE(daemon->Close().inspect());
+  delete daemon;
+  BinLogger logger("unique.bin");
+  Key key;
+  char alloc[256];
+  bool put;
+  size_t count = 0;
+  while(logger.Read(key, alloc, put).ok() && put) count ++;
+  EXPECT_EQ(count, size * thread_num);
+  EXPECT_TRUE(logger.Close().inspect());
+  EXPECT_TRUE(logger.Delete().inspect());
+}
+TEST(BinLoggerTest, FullRing) {
+  BinLoggerDaemon* daemon = new BinLoggerDaemon("unique.bin", Durability::kCommit);
+  size_t size = 5000;
+  size_t thread_num = 4;
+  char buffer[256];
+  memset(buffer, 'x', sizeof(char) * 256);
+  Value value(buffer);
+  // producers outrun daemon and block on freed slots
+  std::vector<std::thread> threads;
+  for(int t = 0; t < thread_num; t++) {
+    threads.push_back(std::thread([&]() {
+      size_t version = 0;
+      for(int i = 0; i < size; i++) 
+        version = daemon->AppendPut(Key(rnd.NumericString(8).c_str()), value);
+      EXPECT_TRUE(daemon->Wait(version).inspect());
+    }));
+  }
+  for(int t = 0; t < thread_num; t++) threads[t].join();
+  EXPECT_TRUE(daemon->Close().inspect());
+  delete daemon;
+  BinLogger logger("unique.bin");
+  Key key;
+  char alloc[256];
+  bool put;
+  size_t count = 0;
+  while(logger.Read(key, alloc, put).ok() && put) count ++;
+  EXPECT_EQ(count, size * thread_num);
+  EXPECT_TRUE(logger.Delete().inspect());
+}
+TEST(BinLoggerTest, FailedWrite) {
+  // segments cannot be created, nothing ever commits
+  BinLoggerDaemon* daemon = new BinLoggerDaemon("missing_dir/unique.bin", Durability::kCommit);
+  char buffer[256];
+  memset(buffer, 'x', sizeof(char) * 256);
+  Value value(buffer);
+  for(int i = 0; i < 10; i++) {
+    Key key(rnd.NumericString(8).c_str());
+    size_t version = daemon->AppendPut(key, value);
+    EXPECT_FALSE(daemon->Wait(version).ok());
+    EXPECT_FALSE(daemon->Committed(version));
+  }
+  daemon->Close();
+  delete daemon;
+}
+TEST(BinLoggerTest, IdleWakeup) {
+  BinLoggerDaemon* daemon = new BinLoggerDaemon("unique.bin", Durability::kCommit);
+  char buffer[256];
+  memset(buffer, 'x', sizeof(char) * 256);
+  Value value(buffer);
+  for(int i = 0; i < 10; i++) {
+    // let daemon fall asleep between ops
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    Key key(rnd.NumericString(8).c_str());
+    EXPECT_TRUE(daemon->Wait(daemon->AppendPut(key, value)).inspect());
+  }
+  EXPECT_TRUE(daemon->Close().inspect());
+  delete daemon;
+  BinLogger logger("unique.bin");
+  Key key;
+  char alloc[256];
+  bool put;
+  size_t count = 0;
+  while(logger.Read(key, alloc, put).ok() && put) count ++;
+  EXPECT_EQ(count, 10);
+  EXPECT_TRUE(logger.Delete().inspect());
+}
+TEST(BinLoggerTest, ShardedReplay) {
+  size_t shards = 4;
+  size_t size = 500;
+  ShardedBinLogger* logger = new ShardedBinLogger("unique.bin", Durability::kCommit, shards);
+  std::vector<std::thread> threads;
+  for(int t = 0; t < shards; t++) {
+    threads.push_back(std::thread([&, t]() {
+      char buffer[256];
+      Key key(("thread_" + std::to_string(t)).c_str());
+      for(int i = 0; i < size; i++) {
+        *(reinterpret_cast<int*>(buffer)) = i;
+        logger->Wait(logger->AppendPut(key, Value(buffer)));
+      }
+    }));
+  }
+  for(int t = 0; t < shards; t++) threads[t].join();
+  EXPECT_TRUE(logger->Close().inspect());
+  delete logger;
+  logger = new ShardedBinLogger("unique.bin", Durability::kCommit, shards);
+  Key key;
+  char alloc[256];
+  bool put;
+  size_t count = 0;
+  std::vector<int> last(shards, -1);
+  // merged by lsn, each key sees its values in issue order
+  while(logger->Read(key, alloc, put).ok()) {
+    int t = key[7] - '0';
+    int v = *(reinterpret_cast<int*>(alloc));
+    EXPECT_EQ(v, last[t] + 1);
+    last[t] = v;
+    count ++;
+  }
+  EXPECT_EQ(count, size * shards);
+  EXPECT_TRUE(logger->Close().inspect());
+  delete logger;
+  for(int i = 0; i < shards; i++) {
+    BinLogger file(i == 0 ? "unique.bin" : "unique.bin." + std::to_string(i));
+    EXPECT_TRUE(file.Delete().inspect());
+  }
+}
+TEST(BinLoggerTest, ShardedDurablePoint) {
+  size_t shards = 2;
+  size_t size = 100;
+  ShardedBinLogger* logger = new ShardedBinLogger("unique.bin", Durability::kCommit, shards);
+  // one thread per shard, taking turns: a, b, then a again
+  auto writer = [&](const char* name) {
+    char buffer[256];
+    memset(buffer, 'x', sizeof(char) * 256);
+    for(int i = 0; i < size; i++) {
+      logger->Wait(logger->AppendPut(Key(name), Value(buffer)));
+    }
+  };
+  std::thread a([&]() {
+    writer("writer_a");
+    std::thread b([&]() { writer("writer_b"); });
+    b.join();
+    writer("writer_a");
+  });
+  a.join();
+  EXPECT_TRUE(logger->Close().inspect());
+  delete logger;
+  // tear last frame of shard of b, later entries of a are no prefix
+  std::string names[2] = {"unique.bin", "unique.bin.1"};
+  for(int i = 0; i < shards; i++) {
+    BinLogger file(names[i]);
+    Key key;
+    char alloc[256];
+    bool put;
+    size_t count = 0;
+    while(file.Read(key, alloc, put).ok()) count ++;
+    EXPECT_TRUE(file.Close().inspect());
+    if(count != size) continue;
+    size_t end = size * (BinLogger::header_ + 1 + 8 + 8 + 256);
+    SequentialFile segment(file.SegmentName(1));
+    EXPECT_TRUE(segment.Open().inspect());
+    EXPECT_TRUE(segment.Write(end - 10, 3, "abc").inspect());
+    EXPECT_TRUE(segment.Close().inspect());
+  }
+  logger = new ShardedBinLogger("unique.bin", Durability::kCommit, shards);
+  Key key;
+  char alloc[256];
+  bool put;
+  size_t count_a = 0, count_b = 0;
+  while(logger->Read(key, alloc, put).ok()) {
+    if(key[7] == 'a') count_a ++;
+    else count_b ++;
+  }
+  EXPECT_EQ(count_a, size);
+  EXPECT_EQ(count_b, size - 1);
+  EXPECT_EQ(logger->dropped(), size);
+  // checkpoint past dropped entries, later appends replay again
+  logger->Checkpoint();
+  EXPECT_TRUE(logger->Compact().inspect());
+  std::thread c([&]() { writer("writer_c"); });
+  c.join();
+  EXPECT_TRUE(logger->Close().inspect());
+  delete logger;
+  logger = new ShardedBinLogger("unique.bin", Durability::kCommit, shards);
+  size_t count_c = 0;
+  while(logger->Read(key, alloc, put).ok()) {
+    if(key[7] == 'c') count_c ++;
+  }
+  EXPECT_EQ(count_c, size);
+  EXPECT_EQ(logger->dropped(), 0);
+  EXPECT_TRUE(logger->Close().inspect());
+  delete logger;
+  for(int i = 0; i < shards; i++) {
+    BinLogger file(names[i]);
+    EXPECT_TRUE(file.Delete().inspect());
+  }
+}
+TEST(BinLoggerTest, SegmentCompact) {
+  size_t segment_size = 4 * 4096;
+  BinLogger logger("unique.bin", segment_size);
+  size_t size = 1000;
+  char buffer[256];
+  memset(buffer, 'x', sizeof(char) * 256);
+  Value value(buffer);
+  for(int i = 0; i < size; i++) {
+    Key key(rnd.NumericString(8).c_str());
+    if(i == size / 2) logger.Checkpoint();
+    EXPECT_TRUE(logger.AppendPut(key, value).inspect());
+  }
+  std::string first = logger.SegmentName(1);
+  EXPECT_TRUE(logger.Compact().inspect());
+  EXPECT_TRUE(logger.Close().inspect());
+  // obsolete segment is unlinked
+  SequentialFile segment(first);
+  EXPECT_TRUE(segment.Open().inspect());
+  EXPECT_EQ(segment.size(), 0);
+  EXPECT_TRUE(segment.Close().inspect());
+  EXPECT_TRUE(segment.Delete().inspect());
+  // replay starts from checkpoint
+  BinLogger reader("unique.bin", segment_size);
+  Key key;
+  char alloc[256];
+  bool put;
+  size_t count = 0;
+  while(reader.Read(key, alloc, put).ok()) count ++;
+  EXPECT_EQ(count, size - size / 2);
+  EXPECT_TRUE(reader.Delete().inspect());
+}
+TEST(BinLoggerTest, UnsealedSegment) {
+  size_t segment_size = 4 * 4096;
+  size_t frame = BinLogger::header_ + 1 + 8 + 256;
+  size_t per_segment = (segment_size - BinLogger::header_) / frame;
+  BinLogger logger("unique.bin", segment_size);
+  size_t size = per_segment * 3;
+  char buffer[256];
+  memset(buffer, 'x', sizeof(char) * 256);
+  Value value(buffer);
+  for(int i = 0; i < size; i++) {
+    EXPECT_TRUE(logger.AppendPut(Key(rnd.NumericString(8).c_str()), value).inspect());
+  }
+  EXPECT_TRUE(logger.Close().inspect());
+  // first segment loses its seal, as if never synced
+  char zero[BinLogger::header_] = {0};
+  SequentialFile segment(logger.SegmentName(1));
+  EXPECT_TRUE(segment.Open().inspect());
+  EXPECT_TRUE(segment.Write(per_segment * frame, BinLogger::header_, zero).inspect());
+  EXPECT_TRUE(segment.Close().inspect());
+  // replay stops there instead of skipping to next segment
+  BinLogger reader("unique.bin", segment_size);
+  Key key;
+  char alloc[256];
+  bool put;
+  size_t count = 0;
+  while(true) {
+    Status status = reader.Read(key, alloc, put);
+    if(!status.ok()) {
+      EXPECT_TRUE(status.IsCorruption());
+      break;
+    }
+    count ++;
+  }
+  EXPECT_EQ(count, per_segment);
+  EXPECT_TRUE(reader.Delete().inspect());
+}
+TEST(BinLoggerTest, DirectAppend) {
+  size_t segment_size = 4 * 4096;
+  size_t size = 300;
+  char buffer[256];
+  memset(buffer, 'x', sizeof(char) * 256);
+  Value value(buffer);
+  {
+    BinLogger logger("unique.bin", segment_size, LogMode::kDirect);
+    for(int i = 0; i < size; i++) {
+      Key key(rnd.NumericString(8).c_str());
+      if(i % 3 == 0) EXPECT_TRUE(logger.AppendDelete(key).inspect());
+      else EXPECT_TRUE(logger.AppendPut(key, value).inspect());
+    }
+    EXPECT_TRUE(logger.Close().inspect());
+  }
+  // recovered log continues in place, mid block
+  BinLogger logger("unique.bin", segment_size, LogMode::kDirect);
+  Key key;
+  char alloc[256];
+  bool put;
+  size_t count = 0;
+  while(logger.Read(key, alloc, put).ok()) count ++;
+  EXPECT_EQ(count, size);
+  for(int i = 0; i < size; i++) {
+    EXPECT_TRUE(logger.AppendPut(Key(rnd.NumericString(8).c_str()), value).inspect());
+  }
+  EXPECT_TRUE(logger.Close().inspect());
+  BinLogger reader("unique.bin", segment_size);
+  count = 0;
+  while(reader.Read(key, alloc, put).ok()) {
+    if(put) EXPECT_EQ(memcmp(alloc, buffer, 256), 0);
+    count ++;
+  }
+  EXPECT_EQ(count, size * 2);
+  EXPECT_TRUE(reader.Delete().inspect());
+}
+TEST(BinLoggerTest, MappedAppend) {
+  size_t segment_size = 4 * 4096;
+  size_t size = 500;
+  size_t thread_num = 4;
+  char buffer[256];
+  memset(buffer, 'x', sizeof(char) * 256);
+  Value value(buffer);
+  // writers race on reservations and segment rolls
+  BinLoggerDaemon* daemon = new BinLoggerDaemon("unique.bin", 
+    Durability::kCommit, NULL, LogMode::kMapped, segment_size);
+  std::vector<std::thread> threads;
+  for(int t = 0; t < thread_num; t++) {
+    threads.push_back(std::thread([&]() {
+      for(int i = 0; i < size; i++) {
+        Key key(rnd.NumericString(8).c_str());
+        if(i % 5 == 0) daemon->Wait(daemon->AppendDelete(key));
+        else daemon->Wait(daemon->AppendPut(key, value));
+      }
+    }));
+  }
+  for(int t = 0; t < thread_num; t++) threads[t].join();
+  EXPECT_TRUE(daemon->Close().inspect());
+  delete daemon;
+  // recovered log continues in place
+  BinLogger logger("unique.bin", segment_size, LogMode::kMapped);
+  Key key;
+  char alloc[256];
+  bool put;
+  size_t count = 0;
+  uint64_t lsn, last = 0;
+  // frames are placed in ticket order
+  while(logger.Read(key, alloc, put, lsn).ok()) {
+    EXPECT_GT(lsn, last);
+    last = lsn;
+    count ++;
+  }
+  EXPECT_EQ(count, size * thread_num);
+  for(int i = 0; i < size; i++) {
+    EXPECT_TRUE(logger.AppendPut(Key(rnd.NumericString(8).c_str()), value).inspect());
+  }
+  EXPECT_TRUE(logger.Sync().inspect());
+  EXPECT_TRUE(logger.Close().inspect());
+  BinLogger reader("unique.bin", segment_size);
+  count = 0;
+  size_t puts = 0;
+  while(reader.Read(key, alloc, put).ok()) {
+    if(put) {
+      EXPECT_EQ(memcmp(alloc, buffer, 256), 0);
+      puts ++;
+    }
+    count ++;
+  }
+  EXPECT_EQ(count, size * thread_num + size);
+  EXPECT_EQ(puts, size * thread_num * 4 / 5 + size);
+  EXPECT_TRUE(reader.Delete().inspect());
+}
+TEST(BinLoggerTest, MappedRetire) {
+  size_t segment_size = 4 * 4096;
+  size_t frame = BinLogger::header_ + 1 + 8 + 256;
+  size_t per_segment = (segment_size - BinLogger::header_) / frame;
+  char buffer[256];
+  memset(buffer, 'x', sizeof(char) * 256);
+  Value value(buffer);
+  BinLogger logger("unique.bin", segment_size, LogMode::kMapped);
+  for(int i = 0; i < per_segment * 3; i++) {
+    EXPECT_TRUE(logger.AppendPut(Key(rnd.NumericString(8).c_str()), value).inspect());
+  }
+  // last one is full but still active
+  EXPECT_EQ(logger.mapped_segments(), 3);
+  // sealed segments are released once synced
+  EXPECT_TRUE(logger.Sync().inspect());
+  EXPECT_EQ(logger.mapped_segments(), 1);
+  // or once compacted away, unsynced
+  for(int i = 0; i < per_segment * 2; i++) {
+    EXPECT_TRUE(logger.AppendPut(Key(rnd.NumericString(8).c_str()), value).inspect());
+  }
+  EXPECT_EQ(logger.mapped_segments(), 3);
+  logger.Checkpoint();
+  EXPECT_TRUE(logger.Compact().inspect());
+  EXPECT_EQ(logger.mapped_segments(), 1);
+  for(int i = 0; i < 10; i++) {
+    EXPECT_TRUE(logger.AppendPut(Key(rnd.NumericString(8).c_str()), value).inspect());
+  }
+  EXPECT_TRUE(logger.Sync().inspect());
+  EXPECT_TRUE(logger.Close().inspect());
+  BinLogger reader("unique.bin", segment_size);
+  Key key;
+  char alloc[256];
+  bool put;
+  size_t count = 0;
+  while(reader.Read(key, alloc, put).ok()) count ++;
+  EXPECT_EQ(count, 10);
+  EXPECT_TRUE(reader.Delete().inspect());
+}
+TEST(BinLoggerTest, Checksum) {
+  EXPECT_EQ(crc32c::Value("123456789", 9), 0xe3069283);
+  char buffer[1000];
+  for(int i = 0; i < 1000; i++) buffer[i] = static_cast<char>(i * 7);
+  EXPECT_EQ(crc32c::Extend(crc32c::Value(buffer, 333), buffer + 333, 667),
+            crc32c::Value(buffer, 1000));
+}
+TEST(BinLoggerTest, Compression) {
+  std::vector<char> raw(100000), packed(lz::MaxCompressedLength(raw.size()));
+  std::vector<char> back(raw.size());
+  for(size_t i = 0; i < raw.size(); i++) raw[i] = "portal"[i % 6];
+  size_t n = lz::Compress(raw.data(), raw.size(), packed.data());
+  EXPECT_LT(n, raw.size() / 10);
+  EXPECT_TRUE(lz::Decompress(packed.data(), n, back.data(), back.size()));
+  EXPECT_TRUE(raw == back);
+  EXPECT_FALSE(lz::Decompress(packed.data(), n, back.data(), back.size() - 1));
+  for(size_t i = 0; i < raw.size(); i++) raw[i] = static_cast<char>(rnd.UInt(256));
+  n = lz::Compress(raw.data(), raw.size(), packed.data());
+  EXPECT_LE(n, lz::MaxCompressedLength(raw.size()));
+  EXPECT_TRUE(lz::Decompress(packed.data(), n, back.data(), back.size()));
+  EXPECT_TRUE(raw == back);
+  // packed frame replays like a raw one
+  size_t size = 100;
+  char buffer[256];
+  memset(buffer, 'x', sizeof(char) * 256);
+  Value value(buffer);
+  std::vector<char> batch;
+  for(int i = 0; i < size; i++) {
+    char entry[BinLogger::max_entry_];
+    Key key(rnd.NumericString(8).c_str());
+    batch.insert(batch.end(), entry, entry + BinLogger::EncodePut(entry, key, value));
+  }
+  std::vector<char> frame(BinLogger::header_ + BinLogger::MaxPacked(batch.size()));
+  n = BinLogger::Pack(frame.data() + BinLogger::header_, batch.data(), batch.size());
+  EXPECT_GT(n, 0);
+  BinLogger::EncodeHeader(frame.data(), 1, n, true);
+  BinLogger logger("unique.bin");
+  EXPECT_TRUE(logger.AppendRaw(frame.data(), BinLogger::header_ + n).inspect());
+  EXPECT_TRUE(logger.Close().inspect());
+  Key key;
+  char alloc[256];
+  bool put;
+  size_t count = 0;
+  while(logger.Read(key, alloc, put).ok() && put) {
+    EXPECT_EQ(memcmp(alloc, buffer, 256), 0);
+    count ++;
+  }
+  EXPECT_EQ(count, size);
+  EXPECT_TRUE(logger.Close().inspect());
+  EXPECT_TRUE(logger.Delete().inspect());
+}
+TEST(BinLoggerTest, TornTail) {
+  BinLogger logger("unique.bin");
+  size_t size = 100;
+  char buffer[256];
+  memset(buffer, 'x', sizeof(char) * 256);
+  Value value(buffer);
+  for(int i = 0; i < size; i++) {
+    Key key(rnd.NumericString(8).c_str());
+    EXPECT_TRUE(logger.AppendPut(key, value).inspect());
+  }
+  // tear the last frame
+  size_t end = size * (BinLogger::header_ + 1 + 8 + 256);
+  EXPECT_TRUE(logger.Close().inspect());
+  SequentialFile segment(logger.SegmentName(1));
+  EXPECT_TRUE(segment.Open().inspect());
+  EXPECT_TRUE(segment.Write(end - 10, 3, "abc").inspect());
+  EXPECT_TRUE(segment.Close().inspect());
+  Key key;
+  char alloc[256];
+  bool put;
+  size_t count = 0;
+  while(true) {
+    Status status = logger.Read(key, alloc, put);
+    if(!status.ok()) {
+      EXPECT_TRUE(status.IsCorruption());
+      break;
+    }
+    count ++;
+  }
+  EXPECT_EQ(count, size - 1);
+  EXPECT_TRUE(logger.Close().inspect());
+  EXPECT_TRUE(logger.Delete().inspect());
+}
+TEST(BinLoggerTest, AppendAfterTornFrame) {
+  LogMode modes[3] = {LogMode::kBuffered, LogMode::kDirect, LogMode::kMapped};
+  size_t size = 100;
+  size_t frame = BinLogger::header_ + 1 + 8 + 256;
+  char buffer[256];
+  memset(buffer, 'x', sizeof(char) * 256);
+  for(LogMode mode : modes) {
+    BinLogger logger("unique.bin", BinLogger::default_segment_, mode);
+    for(int i = 0; i < size; i++) {
+      EXPECT_TRUE(logger.AppendPut(Key(rnd.NumericString(8).c_str()), Value(buffer)).inspect());
+    }
+    EXPECT_TRUE(logger.Sync().inspect());
+    EXPECT_TRUE(logger.Close().inspect());
+    // tear a frame in the middle, frames after it stay intact
+    SequentialFile segment(logger.SegmentName(1));
+    EXPECT_TRUE(segment.Open().inspect());
+    EXPECT_TRUE(segment.Write(size / 2 * frame + 100, 3, "abc").inspect());
+    EXPECT_TRUE(segment.Close().inspect());
+    BinLogger writer("unique.bin", BinLogger::default_segment_, mode);
+    Key key;
+    char alloc[256];
+    bool put;
+    size_t count = 0;
+    while(writer.Read(key, alloc, put).ok()) count ++;
+    EXPECT_EQ(count, size / 2);
+    // same size as torn frame, lands right before the stale ones
+    char other[256];
+    memset(other, 'y', sizeof(char) * 256);
+    EXPECT_TRUE(writer.AppendPut(Key("appended"), Value(other)).inspect());
+    EXPECT_TRUE(writer.Sync().inspect());
+    EXPECT_TRUE(writer.Close().inspect());
+    BinLogger reader("unique.bin");
+    count = 0;
+    bool last = false;
+    while(reader.Read(key, alloc, put).ok()) {
+      last = key.to_string() == "appended" && memcmp(alloc, other, 256) == 0;
+      count ++;
+    }
+    EXPECT_EQ(count, size / 2 + 1);
+    EXPECT_TRUE(last);
+    EXPECT_TRUE(reader.Delete().inspect());
+  }
+}
@@ -2,7 +2,10 @@
 
 #include "util/concurrent_vector.h"
 
+#include <atomic>
 #include <memory>
+#include <thread>
+#include <vector>
 
 using namespace portal_db;
 
@@ -21,4 +24,38 @@ TEST(ConcurrentVectorTest, SingleThreadTest) {
 		EXPECT_EQ(*p.get(), i);
 		EXPECT_EQ(NULL, vec[i]);
 	}
-}
\ No newline at end of file
+}
+
+TEST(ConcurrentVectorTest, MultiThreadTest) {
+	ConcurrentVector<int> vec;
+	size_t threads = 4, size = 20000;
+	vec.push_back(std::make_unique<int>(-1));
+	// last index each writer published, readers follow it
+	std::unique_ptr<std::atomic<size_t>[]> last(new std::atomic<size_t>[threads]);
+	for(size_t t = 0; t < threads; t++) last[t].store(0);
+	std::atomic<size_t> done(0);
+	std::vector<std::thread> workers;
+	for(size_t t = 0; t < threads; t++) {
+		workers.push_back(std::thread([&, t]() {
+			for(int i = 0; i < size; i++) {
+				size_t idx = vec.push_back(std::make_unique<int>(t * size + i));
+				last[t].store(idx);
+			}
+			done ++;
+		}));
+	}
+	std::thread reader([&]() {
+		while(done.load() < threads) {
+			for(size_t t = 0; t < threads; t++) {
+				size_t idx = last[t].load();
+				if(idx > 0) EXPECT_EQ(*vec[idx] / size, t);
+			}
+		}
+	});
+	for(size_t t = 0; t < threads; t++) workers[t].join();
+	reader.join();
+	EXPECT_EQ(vec.size(), threads * size + 1);
+	std::vector<bool> seen(threads * size, false);
+	for(size_t i = 1; i < vec.size(); i++) seen[*vec[i]] = true;
+	for(size_t i = 0; i < seen.size(); i++) EXPECT_TRUE(seen[i]);
+}
@@ -1,6 +1,10 @@
 #include <gtest/gtest.h>
 
 #include "util/file.h"
+#include "util/io_engine.h"
+
+#include <thread>
+#include <vector>
 
 using namespace portal_db;
 
@@ -22,4 +26,80 @@ TEST(FileTest, Test) {
   ASSERT_TRUE(file.Close().inspect());
   ASSERT_TRUE(file.Delete().inspect());
   delete [] test_data;
-}
\ No newline at end of file
+}
+TEST(FileTest, Gather) {
+  SequentialFile file("unique_tmp");
+  ASSERT_TRUE(file.Open().inspect());
+  ASSERT_TRUE(file.SetEnd(10).inspect());
+  IoSlice parts[3] = {{"abc", 3}, {"", 0}, {"defghijk", 8}};
+  ASSERT_TRUE(file.WriteV(0, parts, 3).inspect());
+  char buffer[11] = {0};
+  ASSERT_TRUE(file.Read(0, 10, buffer).inspect());
+  // clipped to end of file
+  EXPECT_STREQ(buffer, "abcdefghij");
+  ASSERT_TRUE(file.Close().inspect());
+  ASSERT_TRUE(file.Delete().inspect());
+}
+
+TEST(FileTest, Concurrent) {
+  size_t block = 4096, threads = 8, rounds = 100;
+  SequentialFile file("unique_tmp");
+  ASSERT_TRUE(file.Open().inspect());
+  ASSERT_TRUE(file.SetEnd(block * threads).inspect());
+  // each thread rewrites and reads back its own block
+  std::vector<std::thread> workers;
+  std::vector<size_t> mismatch(threads, 0);
+  for(size_t t = 0; t < threads; t++) {
+    workers.push_back(std::thread([&, t]() {
+      std::vector<char> data(block), back(block);
+      for(size_t r = 0; r < rounds; r++) {
+        memset(data.data(), static_cast<char>('a' + (t + r) % 26), block);
+        file.Write(t * block, block, data.data());
+        file.Read(t * block, block, back.data());
+        if(data != back) mismatch[t] ++;
+      }
+    }));
+  }
+  for(size_t t = 0; t < threads; t++) {
+    workers[t].join();
+    EXPECT_EQ(mismatch[t], 0);
+  }
+  ASSERT_TRUE(file.Close().inspect());
+  ASSERT_TRUE(file.Delete().inspect());
+}
+
+TEST(FileTest, IoEngine) {
+  size_t block = 4096, blocks = 64;
+  for(int async = 0; async < 2; async++) {
+    IoEngine engine(8, async != 0);
+    SequentialFile file("unique_tmp");
+    ASSERT_TRUE(file.Open().inspect());
+    ASSERT_TRUE(file.SetEnd(block * blocks).inspect());
+    std::vector<char> data(block * blocks);
+    for(size_t i = 0; i < data.size(); i++) data[i] = static_cast<char>(i * 7);
+    IoSlice whole = {data.data(), data.size()};
+    EXPECT_TRUE(engine.Register(&whole, 1).inspect());
+    // more writes than depth, last one synced
+    uint64_t ticket = 0;
+    for(size_t b = 0; b < blocks; b++) {
+      IoSlice parts[2] = {
+        {data.data() + b * block, block / 2}, 
+        {data.data() + b * block + block / 2, block / 2}
+      };
+      if(b % 2 == 0) {
+        EXPECT_TRUE(engine.Write(file, b * block, parts, 2, false, ticket).inspect());
+      } else {
+        EXPECT_TRUE(engine.Write(file, b * block, data.data() + b * block, 
+                                 block, b + 1 == blocks, ticket).inspect());
+      }
+    }
+    EXPECT_EQ(ticket, blocks);
+    EXPECT_TRUE(engine.Wait(ticket).inspect());
+    EXPECT_TRUE(engine.Done(ticket));
+    std::vector<char> back(data.size());
+    ASSERT_TRUE(file.Read(0, back.size(), back.data()).inspect());
+    EXPECT_TRUE(data == back);
+    ASSERT_TRUE(file.Close().inspect());
+    ASSERT_TRUE(file.Delete().inspect());
+  }
+}
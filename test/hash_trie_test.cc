@@ -6,7 +6,11 @@
 #include "db/hash_trie_iterator.h"
 #include "util.h"
 
+#include <memory>
 #include <string>
+#include <set>
+#include <thread>
+#include <vector>
 
 using namespace portal_db;
 
@@ -130,4 +134,232 @@ TEST(HashTrieBenchmark, PutGetScan) {
   while(iterator2.Next()) { }
   std::cout << timer.end() << std::endl;
 
-}
\ No newline at end of file
+}
+TEST(HashTrieTest, FreezeTest) {
+  HashTrie store("test_hash_trie");
+  size_t size = 10000;
+  char buf[256];
+  for(int i = 0; i < size; i++) {
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    *(reinterpret_cast<int*>(buf)) = i;
+    Key key(tmp.c_str());
+    Value value(buf);
+    EXPECT_TRUE(store.Put(key, value).inspect());
+  }
+  EXPECT_TRUE(store.Freeze().inspect());
+  // overwrite, delete and insert on delta
+  for(int i = 0; i < size; i += 2) {
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    *(reinterpret_cast<int*>(buf)) = i + 1;
+    Key key(tmp.c_str());
+    Value value(buf);
+    if(i % 4 == 0) EXPECT_TRUE(store.Put(key, value).inspect());
+    else EXPECT_TRUE(store.Delete(key).inspect());
+  }
+  for(int i = size; i < size * 2; i += 100) {
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    *(reinterpret_cast<int*>(buf)) = i;
+    Key key(tmp.c_str());
+    Value value(buf);
+    EXPECT_TRUE(store.Put(key, value).inspect());
+  }
+  for(int i = 0; i < size; i++) {
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    Key key(tmp.c_str());
+    Value value(buf);
+    if(i % 4 == 2) {
+      EXPECT_TRUE(store.Get(key, value).IsNotFound());
+      continue;
+    }
+    EXPECT_TRUE(store.Get(key, value).inspect());
+    EXPECT_EQ(*(reinterpret_cast<const int*>(value.pointer_to_slice<0,4>())), 
+      i % 4 == 0 ? i + 1 : i);
+  }
+  Key empty;
+  HashTrieIterator iterator = HashTrieIterator(true);
+  EXPECT_TRUE(store.Scan(empty, empty, iterator).inspect());
+  int count = 0;
+  std::string last = "";
+  while(iterator.Next()) {
+    std::string tmp = iterator.Peek().to_string();
+    EXPECT_TRUE(last < tmp);
+    last = tmp;
+    count ++;
+  }
+  EXPECT_EQ(count, size - size / 4 + size / 100);
+  // refreeze merges delta into frozen records
+  EXPECT_TRUE(store.Freeze().inspect());
+  HashTrieIterator bounded = HashTrieIterator(true);
+  EXPECT_TRUE(store.Scan(Key("1000    "), Key("2000    "), bounded).inspect());
+  int expected = 0;
+  for(int i = 0; i < size * 2; i++) {
+    if(i < size ? i % 4 == 2 : i % 100 != 0) continue;
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    if(tmp >= "1000    " && tmp < "2000    ") expected ++;
+  }
+  count = 0;
+  while(bounded.Next()) count ++;
+  EXPECT_EQ(count, expected);
+}
+
+TEST(HashTrieTest, BatchScanTest) {
+  HashTrie store("test_hash_trie");
+  size_t size = 10000;
+  char buf[256];
+  for(int i = 0; i < size; i++) {
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    *(reinterpret_cast<int*>(buf)) = i;
+    Key key(tmp.c_str());
+    Value value(buf);
+    EXPECT_TRUE(store.Put(key, value).inspect());
+  }
+  Key empty;
+  HashTrieIterator iterator = HashTrieIterator(true);
+  EXPECT_TRUE(store.Scan(empty, empty, iterator).inspect());
+  int count = 0;
+  std::string last = "";
+  while(iterator.NextBatch()) {
+    for(int i = 0; i < iterator.batch_size(); i++) {
+      const char* p = iterator.batch(i).record;
+      std::string tmp(p, 8);
+      EXPECT_TRUE(last < tmp);
+      EXPECT_EQ(*(reinterpret_cast<const int*>(p + 8)), std::stoi(tmp));
+      last = tmp;
+      count ++;
+    }
+  }
+  EXPECT_EQ(count, size);
+}
+
+TEST(HashTrieTest, OrderedScanTest) {
+  HashTrie store("test_hash_trie", true);
+  size_t size = 20000;
+  char buf[256];
+  std::set<std::string> live;
+  for(int i = 0; i < size; i++) {
+    std::string tmp = rnd.NumericString(8);
+    *(reinterpret_cast<int*>(buf)) = i;
+    Key key(tmp.c_str());
+    Value value(buf);
+    EXPECT_TRUE(store.Put(key, value).inspect());
+    live.insert(tmp);
+    if(rnd.UInt(10) > 7) {
+      EXPECT_TRUE(store.Delete(key).inspect());
+      live.erase(tmp);
+    }
+  }
+  std::string lower = rnd.NumericString(8);
+  std::string upper = rnd.NumericString(8);
+  if(upper < lower) std::swap(lower, upper);
+  HashTrieIterator iterator = HashTrieIterator(true);
+  store.Scan(Key(lower.c_str()), Key(upper.c_str()), iterator);
+  auto it = live.lower_bound(lower);
+  std::vector<KeyValue> peeked;
+  while(iterator.Next()) {
+    ASSERT_TRUE(it != live.end());
+    peeked.push_back(iterator.Peek());
+    it ++;
+  }
+  EXPECT_TRUE(it == live.end() || *it >= upper);
+  // records peeked earlier are not overwritten
+  it = live.lower_bound(lower);
+  for(size_t i = 0; i < peeked.size(); i++, it++) 
+    EXPECT_EQ(peeked[i].to_string(), *it);
+}
+
+TEST(HashTrieTest, ParallelScanTest) {
+  HashTrie store("test_hash_trie");
+  size_t size = 20000;
+  char buf[256];
+  std::set<std::string> live;
+  for(int i = 0; i < size; i++) {
+    std::string tmp = rnd.NumericString(8);
+    Key key(tmp.c_str());
+    Value value(buf);
+    EXPECT_TRUE(store.Put(key, value).inspect());
+    live.insert(tmp);
+  }
+  Key empty;
+  ParallelIterator sorted(true);
+  EXPECT_TRUE(store.ParallelScan(empty, empty, 4, sorted).inspect());
+  auto it = live.begin();
+  while(sorted.Next()) {
+    ASSERT_TRUE(it != live.end());
+    EXPECT_EQ(std::string(sorted.key(), 8), *it);
+    it ++;
+  }
+  EXPECT_TRUE(it == live.end());
+  ParallelIterator unsorted(false);
+  Key lower("3       ");
+  Key upper("7       ");
+  EXPECT_TRUE(store.ParallelScan(lower, upper, 3, unsorted).inspect());
+  std::set<std::string> seen;
+  while(unsorted.Next()) {
+    std::string tmp(unsorted.key(), 8);
+    EXPECT_TRUE(tmp >= "3       " && tmp < "7       ");
+    seen.insert(tmp);
+  }
+  EXPECT_EQ(seen.size(), 
+    std::distance(live.lower_bound("3       "), live.lower_bound("7       ")));
+}
+
+TEST(HashTrieTest, StalledScanTest) {
+  HashTrie store("test_hash_trie");
+  size_t size = 20000;
+  char buf[256];
+  std::set<std::string> live;
+  for(int i = 0; i < size; i++) {
+    std::string tmp = rnd.NumericString(8);
+    EXPECT_TRUE(store.Put(Key(tmp.c_str()), Value(buf)).inspect());
+    live.insert(tmp);
+  }
+  // scans left unread must not hold every worker of the pool
+  Key empty;
+  std::vector<std::unique_ptr<ParallelIterator>> stalled;
+  for(size_t i = 0; i < 2 * std::thread::hardware_concurrency(); i++) {
+    stalled.push_back(std::make_unique<ParallelIterator>(true, 1));
+    EXPECT_TRUE(store.ParallelScan(empty, empty, 10, *stalled.back()).inspect());
+  }
+  ParallelIterator iterator(true, 1);
+  EXPECT_TRUE(store.ParallelScan(empty, empty, 10, iterator).inspect());
+  size_t count = 0;
+  while(iterator.Next()) count ++;
+  EXPECT_EQ(count, live.size());
+  stalled.clear();
+}
+
+TEST(HashTrieTest, PipelineScanTest) {
+  HashTrie store("test_hash_trie");
+  size_t size = 10000;
+  char buf[256];
+  for(int i = 0; i < size; i++) {
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    *(reinterpret_cast<int*>(buf)) = i;
+    Key key(tmp.c_str());
+    Value value(buf);
+    EXPECT_TRUE(store.Put(key, value).inspect());
+  }
+  Key empty;
+  ParallelIterator iterator(true, 1);
+  EXPECT_TRUE(store.ParallelScan(empty, empty, 1, iterator).inspect());
+  int count = 0;
+  std::string last = "";
+  while(iterator.NextBatch()) {
+    for(int i = 0; i < iterator.batch_size(); i++) {
+      const char* p = iterator.batch(i).record;
+      std::string tmp(p, 8);
+      EXPECT_TRUE(last < tmp);
+      EXPECT_EQ(*(reinterpret_cast<const int*>(p + 8)), std::stoi(tmp));
+      last = tmp;
+      count ++;
+    }
+  }
+  EXPECT_EQ(count, size);
+}
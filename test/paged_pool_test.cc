@@ -2,8 +2,11 @@
 
 #include "db/paged_pool.h"
 
+#include <atomic>
 #include <cstring>
 #include <iostream>
+#include <thread>
+#include <vector>
 
 using namespace portal_db;
 
@@ -51,4 +54,245 @@ TEST(PagedPoolTest, Snapshot) {
     EXPECT_EQ(retrieve, i);
   }
   EXPECT_TRUE(shadow.DeleteSnapshot().inspect());
-}
\ No newline at end of file
+}
+TEST(PagedPoolTest, MappedSnapshot) {
+  size_t size = 0;
+  {
+    PagedPool<32> pool("unique_mapped", true);
+    size = pool.capacity() / 16;
+    for(uint32_t i = 0; i < size; i++) {
+      size_t token = pool.New();
+      char* tmp = pool.Get(token);
+      EXPECT_TRUE(tmp != NULL);
+      memcpy(tmp, reinterpret_cast<char*>(&i), sizeof(uint32_t));
+    }
+    EXPECT_TRUE(pool.MakeSnapshot().inspect());
+    pool.Close();
+  }
+  // same layout in either mode
+  PagedPool<32> mapped("unique_mapped", true);
+  PagedPool<32> shadow("unique_mapped");
+  EXPECT_TRUE(mapped.ReadSnapshot().inspect());
+  EXPECT_TRUE(shadow.ReadSnapshot().inspect());
+  EXPECT_EQ(mapped.size(), size);
+  EXPECT_EQ(shadow.size(), size);
+  for(uint32_t i = 0; i < size; i++) {
+    EXPECT_EQ(*reinterpret_cast<uint32_t*>(mapped.Get(i)), i);
+    EXPECT_EQ(*reinterpret_cast<uint32_t*>(shadow.Get(i)), i);
+  }
+  mapped.Clear();
+  EXPECT_TRUE(mapped.DeleteSnapshot().inspect());
+}
+
+TEST(PagedPoolTest, MappedDirtySnapshot) {
+  size_t size = 0;
+  uint32_t touched = 0xabcd;
+  {
+    PagedPool<32> pool("unique_mapped_dirty", true);
+    size = pool.capacity() / 16;
+    for(uint32_t i = 0; i < size; i++) {
+      size_t token = pool.New();
+      memcpy(pool.Get(token), reinterpret_cast<char*>(&i), sizeof(uint32_t));
+    }
+    EXPECT_GT(pool.DirtyBytes(), 0);
+    EXPECT_TRUE(pool.MakeSnapshot().inspect());
+    EXPECT_EQ(pool.DirtyBytes(), 0);
+    // only the touched bucket is written back
+    memcpy(pool.Get(7), &touched, sizeof(uint32_t));
+    pool.Touch(7);
+    EXPECT_EQ(pool.DirtyBytes(), 4096);
+    EXPECT_TRUE(pool.MakeSnapshot().inspect());
+    EXPECT_EQ(pool.DirtyBytes(), 0);
+    pool.Clear();
+    pool.Close();
+  }
+  PagedPool<32> shadow("unique_mapped_dirty");
+  EXPECT_TRUE(shadow.ReadSnapshot().inspect());
+  EXPECT_EQ(shadow.size(), size);
+  for(uint32_t i = 0; i < size; i++) {
+    uint32_t expect = i == 7 ? touched : i;
+    EXPECT_EQ(*reinterpret_cast<uint32_t*>(shadow.Get(i)), expect);
+  }
+  EXPECT_TRUE(shadow.DeleteSnapshot().inspect());
+}
+
+TEST(PagedPoolTest, DirtySnapshot) {
+  PagedPool<32> pool("unique_dirty");
+  size_t size = pool.capacity() / 16;
+  for(uint32_t i = 0; i < size; i++) {
+    size_t token = pool.New();
+    memcpy(pool.Get(token), reinterpret_cast<char*>(&i), sizeof(uint32_t));
+  }
+  // fill both buffers
+  EXPECT_TRUE(pool.MakeSnapshot().inspect());
+  EXPECT_TRUE(pool.MakeSnapshot().inspect());
+  // only touched buckets reach next snapshot
+  uint32_t touched = 0xabcd, untouched = 0xdcba;
+  memcpy(pool.Get(7), &touched, sizeof(uint32_t));
+  pool.Touch(7);
+  memcpy(pool.Get(size - 1), &untouched, sizeof(uint32_t));
+  EXPECT_TRUE(pool.MakeSnapshot().inspect());
+  pool.Close();
+  PagedPool<32> shadow("unique_dirty");
+  EXPECT_TRUE(shadow.ReadSnapshot().inspect());
+  EXPECT_EQ(shadow.size(), size);
+  for(uint32_t i = 0; i < size; i++) {
+    uint32_t expect = i == 7 ? touched : i;
+    EXPECT_EQ(*reinterpret_cast<uint32_t*>(shadow.Get(i)), expect);
+  }
+  EXPECT_TRUE(shadow.DeleteSnapshot().inspect());
+}
+
+TEST(PagedPoolTest, PackedSnapshot) {
+  PagedPool<32> pool("unique_packed");
+  size_t size = pool.capacity() / 16;
+  for(uint32_t i = 0; i < size; i++) {
+    size_t token = pool.New();
+    memcpy(pool.Get(token), reinterpret_cast<char*>(&i), sizeof(uint32_t));
+  }
+  size_t raw = size * 32;
+  // mostly zero records, groups are packed to their compressed size
+  EXPECT_TRUE(pool.MakeSnapshot().inspect());
+  EXPECT_TRUE(pool.MakeSnapshot().inspect());
+  for(int k = 0; k < 2; k++) {
+    SequentialFile file(k == 0 ? "unique_packed" : "unique_packed.1");
+    EXPECT_TRUE(file.Open().inspect());
+    EXPECT_LT(file.size(), raw / 4);
+    EXPECT_TRUE(file.Close().inspect());
+  }
+  // changed groups are appended, stale ones repacked away
+  for(uint32_t round = 1; round <= 20; round++) {
+    for(uint32_t i = round; i < size; i += size / 256) {
+      uint32_t value = i + round * 0x1000000;
+      memcpy(pool.Get(i), &value, sizeof(uint32_t));
+      pool.Touch(i);
+    }
+    EXPECT_TRUE(pool.MakeSnapshot().inspect());
+  }
+  pool.Close();
+  PagedPool<32> shadow("unique_packed");
+  EXPECT_TRUE(shadow.ReadSnapshot().inspect());
+  EXPECT_EQ(shadow.size(), size);
+  for(uint32_t i = 0; i < size; i++) {
+    uint32_t expect = i;
+    for(uint32_t round = 1; round <= 20; round++) {
+      if(i >= round && (i - round) % (size / 256) == 0) expect = i + round * 0x1000000;
+    }
+    EXPECT_EQ(*reinterpret_cast<uint32_t*>(shadow.Get(i)), expect);
+  }
+  for(int k = 0; k < 2; k++) {
+    SequentialFile file(k == 0 ? "unique_packed" : "unique_packed.1");
+    EXPECT_TRUE(file.Open().inspect());
+    EXPECT_LT(file.size(), raw / 2);
+    EXPECT_TRUE(file.Close().inspect());
+  }
+  EXPECT_TRUE(shadow.DeleteSnapshot().inspect());
+}
+
+TEST(PagedPoolTest, LegacySnapshot) {
+  // earlier releases: slices (4) then raw 4 KB buckets
+  uint32_t size = 300;
+  size_t bucket = 4096, buckets = (size * 32 + bucket - 1) / bucket;
+  std::vector<char> image(4 + buckets * bucket, 0);
+  memcpy(image.data(), &size, sizeof(uint32_t));
+  for(uint32_t i = 0; i < size; i++) 
+    memcpy(image.data() + 4 + i * 32, &i, sizeof(uint32_t));
+  {
+    SequentialFile file("unique_legacy");
+    EXPECT_TRUE(file.Open().inspect());
+    EXPECT_TRUE(file.SetEnd(image.size()).inspect());
+    EXPECT_TRUE(file.Write(0, image.size(), image.data()).inspect());
+    EXPECT_TRUE(file.Close().inspect());
+  }
+  PagedPool<32> mapped("unique_legacy", true);
+  EXPECT_TRUE(mapped.ReadSnapshot().IsNotSupportedError());
+  mapped.Close();
+  PagedPool<32> pool("unique_legacy");
+  EXPECT_TRUE(pool.ReadSnapshot().inspect());
+  EXPECT_EQ(pool.size(), size);
+  for(uint32_t i = 0; i < size; i++) 
+    EXPECT_EQ(*reinterpret_cast<uint32_t*>(pool.Get(i)), i);
+  // next snapshot is newer than legacy file
+  EXPECT_TRUE(pool.MakeSnapshot().inspect());
+  pool.Close();
+  PagedPool<32> shadow("unique_legacy");
+  EXPECT_TRUE(shadow.ReadSnapshot().inspect());
+  EXPECT_EQ(shadow.size(), size);
+  for(uint32_t i = 0; i < size; i++) 
+    EXPECT_EQ(*reinterpret_cast<uint32_t*>(shadow.Get(i)), i);
+  EXPECT_TRUE(shadow.DeleteSnapshot().inspect());
+}
+
+TEST(PagedPoolTest, CopyOnWriteSnapshot) {
+  PagedPool<32> pool("unique_cow");
+  size_t size = pool.capacity() / 16;
+  for(uint32_t i = 0; i < size; i++) {
+    size_t token = pool.New();
+    memcpy(pool.Get(token), reinterpret_cast<char*>(&i), sizeof(uint32_t));
+  }
+  pool.BeginSnapshot();
+  // rewrites after freeze are not in this snapshot
+  uint32_t updated = 0xabcd;
+  pool.Preserve(7);
+  memcpy(pool.Get(7), &updated, sizeof(uint32_t));
+  pool.Touch(7);
+  uint32_t appended = static_cast<uint32_t>(size);
+  memcpy(pool.Get(pool.New()), &appended, sizeof(uint32_t));
+  EXPECT_TRUE(pool.WriteSnapshot().inspect());
+  {
+    PagedPool<32> shadow("unique_cow");
+    EXPECT_TRUE(shadow.ReadSnapshot().inspect());
+    EXPECT_EQ(shadow.size(), size);
+    for(uint32_t i = 0; i < size; i++) {
+      EXPECT_EQ(*reinterpret_cast<uint32_t*>(shadow.Get(i)), i);
+    }
+    shadow.Close();
+  }
+  EXPECT_TRUE(pool.MakeSnapshot().inspect());
+  pool.Close();
+  PagedPool<32> shadow("unique_cow");
+  EXPECT_TRUE(shadow.ReadSnapshot().inspect());
+  EXPECT_EQ(shadow.size(), size + 1);
+  EXPECT_EQ(*reinterpret_cast<uint32_t*>(shadow.Get(7)), updated);
+  EXPECT_EQ(*reinterpret_cast<uint32_t*>(shadow.Get(size)), appended);
+  EXPECT_TRUE(shadow.DeleteSnapshot().inspect());
+}
+
+TEST(PagedPoolTest, ConcurrentPreserveSnapshot) {
+  PagedPool<32> pool("unique_preserve");
+  size_t size = pool.capacity() / 16;
+  for(uint32_t i = 0; i < size; i++) {
+    size_t token = pool.New();
+    memcpy(pool.Get(token), reinterpret_cast<char*>(&i), sizeof(uint32_t));
+  }
+  uint32_t updated = 0xabcd;
+  size_t thread_num = 4;
+  for(int round = 0; round < 8; round++) {
+    pool.BeginSnapshot();
+    // writers sweep backward from spread starts, crossing the
+    // snapshot thread on its way through frozen buckets
+    std::vector<std::thread> writers;
+    for(size_t t = 0; t < thread_num; t++) {
+      writers.push_back(std::thread([&, t]() {
+        size_t start = size * (t + 1) / thread_num;
+        for(size_t n = 0; n < size; n += 16) {
+          size_t i = (start + size - n) % size;
+          pool.Preserve(i);
+          if(round == 7) memcpy(pool.Get(i), &updated, sizeof(uint32_t));
+          pool.Touch(i);
+        }
+      }));
+    }
+    EXPECT_TRUE(pool.WriteSnapshot().inspect());
+    for(size_t t = 0; t < thread_num; t++) writers[t].join();
+  }
+  pool.Close();
+  // last round rewrote after freeze, snapshot holds frozen content
+  PagedPool<32> shadow("unique_preserve");
+  EXPECT_TRUE(shadow.ReadSnapshot().inspect());
+  EXPECT_EQ(shadow.size(), size);
+  for(uint32_t i = 0; i < size; i++) {
+    EXPECT_EQ(*reinterpret_cast<uint32_t*>(shadow.Get(i)), i);
+  }
+  EXPECT_TRUE(shadow.DeleteSnapshot().inspect());
+}
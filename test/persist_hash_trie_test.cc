@@ -7,10 +7,34 @@
 #include "db/persist_hash_trie.h"
 #include "util.h"
 
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 using namespace portal_db;
 
+// drop snapshot, index and log files of store `name`
+static void DeleteStore(const std::string& name, size_t log_shards = 1) {
+  std::string files[3] = {".snapshot", ".snapshot.1", ".index"};
+  for(int i = 0; i < 3; i++) SequentialFile(name + files[i]).Delete(); // may not exist
+  for(size_t i = 0; i < log_shards; i++) {
+    std::string log = name + ".bin";
+    if(i > 0) log += "." + std::to_string(i);
+    BinLogger(log).Delete();
+  }
+}
+
+// exposes index load to tell image from rebuild
+class IndexedStore : public PersistHashTrie {
+ public:
+  using PersistHashTrie::PersistHashTrie;
+  using HashTrie::LoadIndex;
+};
+
 TEST(PersistHashTrieTest, BasicTest) {
   PersistHashTrie store("test_persist_hash_trie");
   size_t size = 10000;
@@ -68,6 +92,18 @@ TEST(PersistHashTrieTest, PutThenRetrieve) {
   }
 }
 
+TEST(PersistHashTrieTest, FreezeTest) {
+  PersistHashTrie store("test_persist_hash_trie");
+  char buf[256];
+  memset(buf, 'x', sizeof(char) * 256);
+  EXPECT_TRUE(store.Put(Key("freeze  "), Value(buf)).inspect());
+  // refused through base as well, frozen records would not persist
+  HashTrie& base = store;
+  EXPECT_TRUE(base.Freeze().IsNotSupportedError());
+  Value value;
+  EXPECT_TRUE(store.Get(Key("freeze  "), value).inspect());
+}
+
 TEST(PersistHashTrieTest, ScanTest) {
   PersistHashTrie store("test_persist_hash_trie");
   size_t size = 1000;
@@ -95,6 +131,442 @@ TEST(PersistHashTrieTest, ScanTest) {
   EXPECT_EQ(count, size);
 }
 
+TEST(PersistHashTrieTest, RecoverTest) {
+  PersistHashTrie* pstore = new PersistHashTrie("test_recover_hash_trie");
+  size_t size = 10000;
+  char buf[256];
+  for(int round = 0; round < 3; round++) {
+    for(int i = 0; i < size; i++) {
+      std::string tmp = std::to_string(i);
+      tmp += std::string(8-tmp.size(), ' ');
+      *(reinterpret_cast<int*>(buf)) = i * 3 + round;
+      Key key(tmp.c_str());
+      EXPECT_TRUE(pstore->Put(key, Value(buf)).inspect());
+    }
+  }
+  for(int i = 0; i < size; i += 10) {
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    EXPECT_TRUE(pstore->Delete(Key(tmp.c_str())).inspect());
+  }
+  delete pstore;
+  PersistHashTrie store("test_recover_hash_trie");
+  store.RecoverSnapshot(); // may be absent
+  EXPECT_TRUE(store.RecoverBinLog(4).inspect());
+  for(int i = 0; i < size; i++) {
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    Key key(tmp.c_str());
+    Value value;
+    if(i % 10 == 0) {
+      EXPECT_TRUE(store.Get(key, value).IsNotFound());
+    } else {
+      EXPECT_TRUE(store.Get(key, value).inspect());
+      EXPECT_EQ(*(reinterpret_cast<const int*>(value.pointer_to_slice<0,4>())), i * 3 + 2);
+    }
+  }
+}
+
+TEST(PersistHashTrieTest, ParallelReplayTest) {
+  DeleteStore("test_replay_hash_trie");
+  PersistHashTrie* pstore = new PersistHashTrie("test_replay_hash_trie");
+  int size = 100000;
+  char buf[256];
+  for(int i = 0; i < size; i++) {
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    *(reinterpret_cast<int*>(buf)) = i;
+    EXPECT_TRUE(pstore->Put(Key(tmp.c_str()), Value(buf)).inspect());
+  }
+  delete pstore;
+  { // every partition splits nodes while the others grow the trie
+    PersistHashTrie store("test_replay_hash_trie");
+    EXPECT_TRUE(store.RecoverBinLog(16).inspect());
+    for(int i = 0; i < size; i++) {
+      std::string tmp = std::to_string(i);
+      tmp += std::string(8-tmp.size(), ' ');
+      Value value;
+      EXPECT_TRUE(store.Get(Key(tmp.c_str()), value).inspect());
+      EXPECT_EQ(*(reinterpret_cast<const int*>(value.pointer_to_slice<0,4>())), i);
+    }
+  }
+  DeleteStore("test_replay_hash_trie");
+}
+
+TEST(PersistHashTrieTest, CorruptLogTest) {
+  PersistHashTrie* pstore = new PersistHashTrie("test_corrupt_hash_trie");
+  size_t size = 100;
+  char buf[256];
+  memset(buf, 'x', sizeof(char) * 256);
+  for(int i = 0; i < size; i++) {
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    EXPECT_TRUE(pstore->Put(Key(tmp.c_str()), Value(buf)).inspect());
+  }
+  delete pstore;
+  // frame checks out but its entry does not decode, valid ones follow
+  {
+    BinLogger logger("test_corrupt_hash_trie.bin");
+    Key key;
+    char alloc[256];
+    bool put;
+    while(logger.Read(key, alloc, put).ok()) { }
+    char frame[BinLogger::header_ + 1 + 8] = {0};
+    frame[BinLogger::header_] = 0x7f;
+    BinLogger::EncodeHeader(frame, logger.NextLsn(), 1 + 8);
+    EXPECT_TRUE(logger.AppendRaw(frame, sizeof(frame)).inspect());
+    EXPECT_TRUE(logger.AppendPut(Key("after   "), Value(buf)).inspect());
+    EXPECT_TRUE(logger.Close().inspect());
+  }
+  PersistHashTrie store("test_corrupt_hash_trie");
+  EXPECT_TRUE(store.RecoverBinLog(4).IsCorruption());
+}
+
+TEST(PersistHashTrieTest, RecoverSnapshotTest) {
+  PersistHashTrie* pstore = new PersistHashTrie("test_snapshot_hash_trie");
+  size_t size = 100000;
+  char buf[256];
+  for(int i = 0; i < size; i++) {
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    *(reinterpret_cast<int*>(buf)) = i;
+    EXPECT_TRUE(pstore->Put(Key(tmp.c_str()), Value(buf)).inspect());
+  }
+  pstore->RequestSnapshot();
+  delete pstore;
+  PersistHashTrie store("test_snapshot_hash_trie");
+  EXPECT_TRUE(store.RecoverSnapshot(4).inspect());
+  for(int i = 0; i < size; i++) {
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    Value value;
+    EXPECT_TRUE(store.Get(Key(tmp.c_str()), value).inspect());
+    EXPECT_EQ(*(reinterpret_cast<const int*>(value.pointer_to_slice<0,4>())), i);
+  }
+}
+
+TEST(PersistHashTrieTest, CorruptIndexTest) {
+  PersistHashTrie* pstore = new PersistHashTrie("test_index_hash_trie");
+  size_t size = 10000;
+  char buf[256];
+  for(int i = 0; i < size; i++) {
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    *(reinterpret_cast<int*>(buf)) = i;
+    EXPECT_TRUE(pstore->Put(Key(tmp.c_str()), Value(buf)).inspect());
+  }
+  pstore->RequestSnapshot();
+  delete pstore;
+  // damage node image, recovery falls back to rebuild
+  {
+    std::fstream index("test_index_hash_trie.index", 
+      std::ios::in | std::ios::out | std::ios::binary);
+    index.seekp(100);
+    index.write("garbage", 7);
+  }
+  PersistHashTrie store("test_index_hash_trie");
+  EXPECT_TRUE(store.RecoverSnapshot(4).inspect());
+  for(int i = 0; i < size; i++) {
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    Value value;
+    EXPECT_TRUE(store.Get(Key(tmp.c_str()), value).inspect());
+    EXPECT_EQ(*(reinterpret_cast<const int*>(value.pointer_to_slice<0,4>())), i);
+  }
+}
+
+TEST(PersistHashTrieTest, MappedRecoverTest) {
+  PersistHashTrie* pstore = new PersistHashTrie("test_mapped_hash_trie", 
+    false, Durability::kInterval, 1, true);
+  size_t size = 10000;
+  char buf[256];
+  for(int i = 0; i < size; i++) {
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    *(reinterpret_cast<int*>(buf)) = i;
+    EXPECT_TRUE(pstore->Put(Key(tmp.c_str()), Value(buf)).inspect());
+  }
+  pstore->RequestSnapshot();
+  // logged after snapshot
+  for(int i = 0; i < size; i += 10) {
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    EXPECT_TRUE(pstore->Delete(Key(tmp.c_str())).inspect());
+  }
+  delete pstore;
+  PersistHashTrie store("test_mapped_hash_trie", 
+    false, Durability::kInterval, 1, true);
+  EXPECT_TRUE(store.RecoverSnapshot(4).inspect());
+  EXPECT_TRUE(store.RecoverBinLog(4).inspect());
+  for(int i = 0; i < size; i++) {
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    Value value;
+    if(i % 10 == 0) {
+      EXPECT_TRUE(store.Get(Key(tmp.c_str()), value).IsNotFound());
+    } else {
+      EXPECT_TRUE(store.Get(Key(tmp.c_str()), value).inspect());
+      EXPECT_EQ(*(reinterpret_cast<const int*>(value.pointer_to_slice<0,4>())), i);
+    }
+  }
+}
+
+TEST(PersistHashTrieTest, ConcurrentSnapshotTest) {
+  DeleteStore("test_cow_hash_trie");
+  PersistHashTrie* pstore = new PersistHashTrie("test_cow_hash_trie");
+  int size = 20000;
+  int rounds = 3;
+  // op j puts key `KeyOf(j)` with value j, each round strides over
+  // every bucket, so writes after a cut hit buckets not yet written
+  auto KeyOf = [&](int j) -> int { return (j % size) * 7919 % size; };
+  std::atomic<int> progress(0);
+  // snapshots taken while writer runs, stop before it ends so the
+  // last one cuts in the middle
+  std::thread persist([&]() {
+    while(progress.load() < size * rounds * 2 / 3) {
+      pstore->RequestSnapshot();
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+  });
+  char buf[256];
+  for(int j = 0; j < size * rounds; j++) {
+    std::string tmp = std::to_string(KeyOf(j));
+    tmp += std::string(8-tmp.size(), ' ');
+    *(reinterpret_cast<int*>(buf)) = j;
+    EXPECT_TRUE(pstore->Put(Key(tmp.c_str()), Value(buf)).inspect());
+    progress = j + 1;
+  }
+  persist.join();
+  delete pstore;
+  { // snapshot alone, no log replay, closed before files are dropped
+    PersistHashTrie store("test_cow_hash_trie");
+    EXPECT_TRUE(store.RecoverSnapshot(4).inspect());
+    std::vector<int> loaded(size, -1);
+    int cut = 0; // ops before the cut
+    for(int i = 0; i < size; i++) {
+      std::string tmp = std::to_string(i);
+      tmp += std::string(8-tmp.size(), ' ');
+      Value value;
+      if(!store.Get(Key(tmp.c_str()), value).ok()) continue;
+      loaded[i] = *(reinterpret_cast<const int*>(value.pointer_to_slice<0,4>()));
+      cut = max(cut, loaded[i] + 1);
+    }
+    EXPECT_GT(cut, 0);
+    // state after exactly the first `cut` ops
+    std::vector<int> expected(size, -1);
+    for(int j = 0; j < cut; j++) expected[KeyOf(j)] = j;
+    for(int i = 0; i < size; i++) EXPECT_EQ(loaded[i], expected[i]);
+  }
+  { // index image and log checkpoint were taken at the same cut
+    IndexedStore store("test_cow_hash_trie");
+    EXPECT_TRUE(store.RecoverSnapshot(4).inspect());
+    EXPECT_TRUE(store.LoadIndex().inspect());
+    EXPECT_TRUE(store.RecoverBinLog(4).inspect());
+    std::vector<int> expected(size, -1);
+    for(int j = 0; j < size * rounds; j++) expected[KeyOf(j)] = j;
+    for(int i = 0; i < size; i++) {
+      std::string tmp = std::to_string(i);
+      tmp += std::string(8-tmp.size(), ' ');
+      Value value;
+      EXPECT_TRUE(store.Get(Key(tmp.c_str()), value).inspect());
+      EXPECT_EQ(*(reinterpret_cast<const int*>(value.pointer_to_slice<0,4>())), 
+                expected[i]);
+    }
+  }
+  DeleteStore("test_cow_hash_trie");
+}
+
+TEST(PersistHashTrieTest, IndexSnapshotTest) {
+  DeleteStore("test_cut_hash_trie");
+  // heap store, its lock must not rely on zeroed memory
+  PersistHashTrie* pstore = new PersistHashTrie("test_cut_hash_trie");
+  int size = 50000;
+  std::atomic<int> progress(0);
+  // every snapshot cuts while the writer splits nodes
+  std::thread persist([&]() {
+    while(progress.load() < size) {
+      pstore->RequestSnapshot();
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+  });
+  char buf[256];
+  for(int i = 0; i < size; i++) {
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    *(reinterpret_cast<int*>(buf)) = i;
+    EXPECT_TRUE(pstore->Put(Key(tmp.c_str()), Value(buf)).inspect());
+    progress = i + 1;
+  }
+  persist.join();
+  delete pstore;
+  { // recover through last index image, then log past its cut
+    IndexedStore store("test_cut_hash_trie");
+    EXPECT_TRUE(store.RecoverSnapshot(4).inspect());
+    // image of a torn cut is refused and would be rebuilt
+    EXPECT_TRUE(store.LoadIndex().inspect());
+    EXPECT_TRUE(store.RecoverBinLog(4).inspect());
+    for(int i = 0; i < size; i++) {
+      std::string tmp = std::to_string(i);
+      tmp += std::string(8-tmp.size(), ' ');
+      Value value;
+      EXPECT_TRUE(store.Get(Key(tmp.c_str()), value).inspect());
+      EXPECT_EQ(*(reinterpret_cast<const int*>(value.pointer_to_slice<0,4>())), i);
+    }
+  }
+  DeleteStore("test_cut_hash_trie");
+}
+
+TEST(PersistHashTrieTest, ScheduledSnapshotTest) {
+  DeleteStore("test_schedule_hash_trie");
+  PersistHashTrie* pstore = new PersistHashTrie("test_schedule_hash_trie");
+  // any log is over target, scheduler snapshots without request
+  pstore->SetRecoveryTarget(std::chrono::milliseconds(0));
+  size_t size = 10000;
+  char buf[256];
+  for(int i = 0; i < size; i++) {
+    std::string tmp = std::to_string(i);
+    tmp += std::string(8-tmp.size(), ' ');
+    *(reinterpret_cast<int*>(buf)) = i;
+    EXPECT_TRUE(pstore->Put(Key(tmp.c_str()), Value(buf)).inspect());
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+  delete pstore;
+  { // closed before its files are dropped
+    PersistHashTrie store("test_schedule_hash_trie");
+    EXPECT_TRUE(store.RecoverSnapshot(4).inspect());
+    // nothing requested, files started empty
+    EXPECT_GT(store.snapshot_generation(), 0);
+    for(int i = 0; i < size; i++) {
+      std::string tmp = std::to_string(i);
+      tmp += std::string(8-tmp.size(), ' ');
+      Value value;
+      EXPECT_TRUE(store.Get(Key(tmp.c_str()), value).inspect());
+      EXPECT_EQ(*(reinterpret_cast<const int*>(value.pointer_to_slice<0,4>())), i);
+    }
+  }
+  DeleteStore("test_schedule_hash_trie");
+}
+
+TEST(PersistHashTrieTest, AsyncWriteTest) {
+  DeleteStore("test_async_hash_trie", 2);
+  PersistHashTrie* pstore = new PersistHashTrie("test_async_hash_trie", 
+    false, Durability::kCommit, 2);
+  size_t size = 5000;
+  size_t thread_num = 2;
+  std::vector<std::thread> threads;
+  for(int t = 0; t < thread_num; t++) {
+    threads.push_back(std::thread([&, t]() {
+      char buf[256];
+      std::vector<LogToken> tokens;
+      LogToken token;
+      // pipeline writes, wait once for last of this thread
+      for(int i = t * size; i < (t + 1) * size; i++) {
+        std::string tmp = std::to_string(i);
+        tmp += std::string(8-tmp.size(), ' ');
+        *(reinterpret_cast<int*>(buf)) = i;
+        EXPECT_TRUE(pstore->PutAsync(Key(tmp.c_str()), Value(buf), token).inspect());
+        tokens.push_back(token);
+        if(i % 10 == 0) {
+          EXPECT_TRUE(pstore->DeleteAsync(Key(tmp.c_str()), token).inspect());
+          tokens.push_back(token);
+        }
+      }
+      EXPECT_TRUE(pstore->Wait(tokens.back()).inspect());
+      for(size_t i = 0; i < tokens.size(); i++) 
+        EXPECT_TRUE(pstore->Committed(tokens[i]));
+    }));
+  }
+  for(int t = 0; t < thread_num; t++) threads[t].join();
+  delete pstore;
+  {
+    PersistHashTrie store("test_async_hash_trie", false, Durability::kCommit, 2);
+    store.RecoverSnapshot(); // may be absent
+    EXPECT_TRUE(store.RecoverBinLog(4).inspect());
+    for(int i = 0; i < size * thread_num; i++) {
+      std::string tmp = std::to_string(i);
+      tmp += std::string(8-tmp.size(), ' ');
+      Value value;
+      if(i % 10 == 0) {
+        EXPECT_TRUE(store.Get(Key(tmp.c_str()), value).IsNotFound());
+      } else {
+        EXPECT_TRUE(store.Get(Key(tmp.c_str()), value).inspect());
+        EXPECT_EQ(*(reinterpret_cast<const int*>(value.pointer_to_slice<0,4>())), i);
+      }
+    }
+  }
+  DeleteStore("test_async_hash_trie", 2);
+}
+
+TEST(PersistHashTrieTest, AsyncShardedWriteTest) {
+  size_t shards = 4;
+  DeleteStore("test_async_hash_trie", shards);
+  PersistHashTrie* pstore = new PersistHashTrie("test_async_hash_trie", 
+    false, Durability::kInterval, shards);
+  size_t size = 5000;
+  size_t thread_num = 4;
+  // op i puts key i, tokens kept per op, first `done[t]` of thread
+  // t are published
+  std::vector<LogToken> tokens(size * thread_num);
+  std::unique_ptr<std::atomic<size_t>[]> done(new std::atomic<size_t>[thread_num]);
+  for(int t = 0; t < thread_num; t++) done[t] = 0;
+  std::vector<std::thread> threads;
+  for(int t = 0; t < thread_num; t++) {
+    threads.push_back(std::thread([&, t]() {
+      char buf[256];
+      for(int i = t * size; i < (t + 1) * size; i++) {
+        std::string tmp = std::to_string(i);
+        tmp += std::string(8-tmp.size(), ' ');
+        *(reinterpret_cast<int*>(buf)) = i;
+        EXPECT_TRUE(pstore->PutAsync(Key(tmp.c_str()), Value(buf), tokens[i]).inspect());
+        done[t].store(i - t * size + 1, std::memory_order_release);
+      }
+    }));
+  }
+  // poll while shards commit at their own pace, from largest lsn down:
+  // a resolved token covers every smaller lsn on all shards
+  std::vector<bool> resolved(size * thread_num, false);
+  bool writing = true;
+  while(writing) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    writing = false;
+    std::vector<size_t> order;
+    for(int t = 0; t < thread_num; t++) {
+      size_t n = done[t].load(std::memory_order_acquire);
+      for(size_t i = t * size; i < t * size + n; i++) order.push_back(i);
+      writing = writing || n < size;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return tokens[a].lsn > tokens[b].lsn;
+    });
+    bool covered = false;
+    for(size_t k = 0; k < order.size(); k++) {
+      bool committed = pstore->Committed(tokens[order[k]]);
+      if(covered) EXPECT_TRUE(committed);
+      covered = covered || committed;
+      if(committed) resolved[order[k]] = true;
+    }
+  }
+  for(int t = 0; t < thread_num; t++) threads[t].join();
+  delete pstore;
+  {
+    PersistHashTrie store("test_async_hash_trie", false, Durability::kInterval, shards);
+    store.RecoverSnapshot(); // may be absent
+    EXPECT_TRUE(store.RecoverBinLog(4).inspect());
+    size_t count = 0;
+    for(int i = 0; i < size * thread_num; i++) {
+      if(!resolved[i]) continue;
+      count ++;
+      std::string tmp = std::to_string(i);
+      tmp += std::string(8-tmp.size(), ' ');
+      Value value;
+      EXPECT_TRUE(store.Get(Key(tmp.c_str()), value).inspect());
+      EXPECT_EQ(*(reinterpret_cast<const int*>(value.pointer_to_slice<0,4>())), i);
+    }
+    EXPECT_GT(count, 0);
+  }
+  DeleteStore("test_async_hash_trie", shards);
+}
+
 TEST(PersistHashTrieBenchmark, PutGetScan) {
   PersistHashTrie store("test_persist_hash_trie");
   size_t size = 100'0000;
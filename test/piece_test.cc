@@ -19,6 +19,15 @@ TEST(KeyTest, RAII) {
   buffer.clear();
 }
 
+TEST(KeyTest, MoveAssign) {
+  Key key("aaaaaaaa");
+  key = Key("bbbbbbbb"); // releases old buffer
+  EXPECT_EQ(key.to_string(), "bbbbbbbb");
+  Key& alias = key;
+  key = std::move(alias);
+  EXPECT_EQ(key.to_string(), "bbbbbbbb");
+}
+
 TEST(KeyTest, Comparable) {
   size_t size = 100;
   while(size--) {
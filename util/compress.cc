@@ -0,0 +1,145 @@
+#include "util/compress.h"
+
+#include <cstring>
+#include <vector>
+
+namespace portal_db {
+
+namespace lz {
+
+namespace {
+
+const size_t kMinMatch = 4;
+const size_t kLastLiterals = 5; // tail never matched
+const size_t kMatchLimit = 12; // no match starts in last bytes
+const size_t kMaxOffset = 65535;
+const int kHashLog = 12;
+
+inline uint32_t Load32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+inline uint32_t Hash(uint32_t seq) {
+  return (seq * 2654435761u) >> (32 - kHashLog);
+}
+
+// length beyond 15 continues in bytes
+inline uint8_t* PutLength(uint8_t* op, size_t len) {
+  for(; len >= 255; len -= 255) *op++ = 255;
+  *op++ = static_cast<uint8_t>(len);
+  return op;
+}
+
+inline bool GetLength(const uint8_t*& ip, const uint8_t* iend, size_t& len) {
+  uint8_t b;
+  do {
+    if(ip >= iend) return false;
+    b = *ip++;
+    len += b;
+  } while(b == 255);
+  return true;
+}
+
+uint8_t* PutSequence(uint8_t* op,
+                     const uint8_t* literal,
+                     size_t literals,
+                     size_t offset,
+                     size_t match) {
+  uint8_t* token = op++;
+  *token = static_cast<uint8_t>((literals >= 15 ? 15 : literals) << 4);
+  if(literals >= 15) op = PutLength(op, literals - 15);
+  memcpy(op, literal, literals);
+  op += literals;
+  if(offset == 0) return op; // last sequence
+  *op++ = static_cast<uint8_t>(offset);
+  *op++ = static_cast<uint8_t>(offset >> 8);
+  match -= kMinMatch;
+  *token |= static_cast<uint8_t>(match >= 15 ? 15 : match);
+  if(match >= 15) op = PutLength(op, match - 15);
+  return op;
+}
+
+} // namespace
+
+size_t Compress(const char* src, size_t n, char* dst) {
+  const uint8_t* base = reinterpret_cast<const uint8_t*>(src);
+  const uint8_t* ip = base;
+  const uint8_t* anchor = base;
+  const uint8_t* iend = base + n;
+  uint8_t* op = reinterpret_cast<uint8_t*>(dst);
+  if(n > kMatchLimit) {
+    const uint8_t* mflimit = iend - kMatchLimit;
+    const uint8_t* mlimit = iend - kLastLiterals;
+    // position of last sequence of each hash
+    std::vector<uint32_t> table(1 << kHashLog, 0);
+    size_t misses = 0;
+    while(ip < mflimit) {
+      uint32_t seq = Load32(ip);
+      uint32_t h = Hash(seq);
+      const uint8_t* ref = base + table[h];
+      table[h] = static_cast<uint32_t>(ip - base);
+      if(ref >= ip || static_cast<size_t>(ip - ref) > kMaxOffset || 
+         Load32(ref) != seq) {
+        // skip faster through incompressible input
+        ip += 1 + (misses++ >> 6);
+        continue;
+      }
+      misses = 0;
+      while(ip > anchor && ref > base && ip[-1] == ref[-1]) {
+        ip --;
+        ref --;
+      }
+      const uint8_t* m = ip + kMinMatch;
+      const uint8_t* r = ref + kMinMatch;
+      while(m < mlimit && *m == *r) {
+        m ++;
+        r ++;
+      }
+      op = PutSequence(op, anchor, ip - anchor, ip - ref, m - ip);
+      ip = anchor = m;
+    }
+  }
+  op = PutSequence(op, anchor, iend - anchor, 0, 0);
+  return op - reinterpret_cast<uint8_t*>(dst);
+}
+
+bool Decompress(const char* src, size_t n, char* dst, size_t raw) {
+  const uint8_t* ip = reinterpret_cast<const uint8_t*>(src);
+  const uint8_t* iend = ip + n;
+  uint8_t* op = reinterpret_cast<uint8_t*>(dst);
+  uint8_t* obase = op;
+  uint8_t* oend = op + raw;
+  while(ip < iend) {
+    uint8_t token = *ip++;
+    size_t literals = token >> 4;
+    if(literals == 15 && !GetLength(ip, iend, literals)) return false;
+    if(literals > static_cast<size_t>(iend - ip) ||
+       literals > static_cast<size_t>(oend - op)) return false;
+    memcpy(op, ip, literals);
+    op += literals;
+    ip += literals;
+    if(ip == iend) break; // last sequence
+    if(iend - ip < 2) return false;
+    size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8);
+    ip += 2;
+    if(offset == 0 || offset > static_cast<size_t>(op - obase)) return false;
+    size_t match = token & 15;
+    if(match == 15 && !GetLength(ip, iend, match)) return false;
+    match += kMinMatch;
+    if(match > static_cast<size_t>(oend - op)) return false;
+    // chunks of `offset` never overlap their source
+    while(match > 0) {
+      size_t chunk = match < offset ? match : offset;
+      memcpy(op, op - offset, chunk);
+      op += chunk;
+      match -= chunk;
+    }
+  }
+  return op == oend;
+}
+
+} // namespace lz
+
+} // namespace portal_db
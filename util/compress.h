@@ -0,0 +1,34 @@
+#ifndef PORTAL_UTIL_COMPRESS_H_
+#define PORTAL_UTIL_COMPRESS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace portal_db {
+
+// LZ77 block codec in LZ4 block format
+// + sequence: token (1) - [literal length] - literals -
+//    offset (2) - [match length]
+//    token holds literal length (high 4 bits) and match length - 4
+//    (low 4 bits), 15 continues with bytes until one below 255
+// + last sequence has literals only, last 5 bytes are literals
+// Raw length is not stored, caller keeps it.
+namespace lz {
+
+// room of output buffer for `n` bytes of input
+inline size_t MaxCompressedLength(size_t n) {
+  return n + n / 255 + 16;
+}
+
+// compress `n` bytes of `src` into `dst`, return compressed length
+size_t Compress(const char* src, size_t n, char* dst);
+
+// decompress `n` bytes of `src` into exactly `raw` bytes of `dst`
+// false on malformed input, never writes past `dst + raw`
+bool Decompress(const char* src, size_t n, char* dst, size_t raw);
+
+} // namespace lz
+
+} // namespace portal_db
+
+#endif // PORTAL_UTIL_COMPRESS_H_
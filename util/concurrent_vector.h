@@ -1,10 +1,10 @@
 #ifndef PORTAL_UTIL_CONCURRENT_VECTOR_H_
 #define PORTAL_UTIL_CONCURRENT_VECTOR_H_
 
+#include <cassert>
 #include <memory>
 #include <atomic>
 #include <mutex>
-#include <vector>
 
 namespace portal_db {
 
@@ -12,41 +12,58 @@ template <typename ElementType>
 class ConcurrentVector {
  public:
  	using ItemType = std::unique_ptr<ElementType>;
- 	ConcurrentVector() : size_(0) { }
+ 	ConcurrentVector() : size_(0) {
+ 		for(size_t i = 0; i < buffer_num; i++) buffer_[i].store(NULL);
+ 	}
  	~ConcurrentVector() {
- 		for(int i = 0; i < buffer_.size(); i++) {
- 			delete[] buffer_[i];
+ 		for(size_t i = 0; i < buffer_num; i++) {
+ 			delete[] buffer_[i].load();
  		}
  	}
  	size_t push_back(ItemType&& element) {
  		size_t token = std::atomic_fetch_add(&size_, 1);
- 		while(token + 1 >= buffer_.size() * buffer_size) {
- 			mutate();
- 		}
- 		ItemType* p = buffer_[token / buffer_size];
+ 		assert(token < buffer_num * buffer_size);
+ 		ItemType* p = buffer_[token / buffer_size].load(std::memory_order_acquire);
+ 		if(p == NULL) p = mutate(token / buffer_size);
  		p[token % buffer_size] = std::move(element);
  		return token;
  	}
  	ElementType* operator[](size_t idx) const {
- 		return buffer_[idx / buffer_size][idx % buffer_size].get();
+ 		return buffer_[idx / buffer_size].load(std::memory_order_acquire)
+ 			[idx % buffer_size].get();
  	}
  	size_t size() const {
  		return size_.load();
  	}
+ 	// unsafe, no concurrent access allowed
+ 	void clear() {
+ 		for(size_t i = 0; i < buffer_num; i++) {
+ 			delete[] buffer_[i].exchange(NULL);
+ 		}
+ 		size_.store(0);
+ 	}
  	std::unique_ptr<ElementType>&& own(size_t idx) {
  		// std::unique_ptr<ElementType> ret;
  		// ret.swap(buffer_[idx / buffer_size][idx % buffer_size]);
  		// return std::move(ret);
- 		return std::move(buffer_[idx / buffer_size][idx % buffer_size]);
+ 		return std::move(buffer_[idx / buffer_size].load()[idx % buffer_size]);
  	}
  private:
- 	static constexpr size_t buffer_size = 25;
+ 	static constexpr size_t buffer_size = 256;
+ 	// chunk table never moves, so readers index it without the lock
+ 	// while writers add chunks
+ 	static constexpr size_t buffer_num = 1 << 16;
  	std::atomic<size_t> size_;
  	std::mutex lock_;
- 	std::vector<ItemType*> buffer_;
- 	void mutate() {
+ 	std::atomic<ItemType*> buffer_[buffer_num];
+ 	ItemType* mutate(size_t chunk) {
  		std::lock_guard<std::mutex> lk(lock_);
- 		buffer_.push_back(new ItemType[buffer_size]);
+ 		ItemType* p = buffer_[chunk].load();
+ 		if(p == NULL) {
+ 			p = new ItemType[buffer_size];
+ 			buffer_[chunk].store(p, std::memory_order_release);
+ 		}
+ 		return p;
  	}
 };
 
@@ -0,0 +1,124 @@
+#include "util/crc32c.h"
+
+#include <cstring>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <nmmintrin.h>
+#define PORTAL_CRC32C_SSE42
+#define PORTAL_TARGET_SSE42
+#elif (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#include <nmmintrin.h>
+#define PORTAL_CRC32C_SSE42
+#define PORTAL_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+
+namespace portal_db {
+
+namespace crc32c {
+
+namespace {
+
+// reflected Castagnoli polynomial
+const uint32_t kPoly = 0x82f63b78;
+
+struct Table {
+  uint32_t entry[8][256];
+  Table() {
+    for(uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for(int k = 0; k < 8; k++) crc = (crc >> 1) ^ (kPoly & (0 - (crc & 1)));
+      entry[0][i] = crc;
+    }
+    for(uint32_t i = 0; i < 256; i++) {
+      for(int t = 1; t < 8; t++) {
+        entry[t][i] = (entry[t - 1][i] >> 8) ^ entry[0][entry[t - 1][i] & 0xff];
+      }
+    }
+  }
+};
+
+const Table& table() {
+  static const Table table;
+  return table;
+}
+
+// slicing-by-8 fallback
+uint32_t ExtendPortable(uint32_t crc, const char* data, size_t n) {
+  const Table& t = table();
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+  crc = ~crc;
+  while(n >= 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo ^= crc; // little endian
+    crc = t.entry[7][lo & 0xff] ^ t.entry[6][(lo >> 8) & 0xff] ^
+          t.entry[5][(lo >> 16) & 0xff] ^ t.entry[4][lo >> 24] ^
+          t.entry[3][hi & 0xff] ^ t.entry[2][(hi >> 8) & 0xff] ^
+          t.entry[1][(hi >> 16) & 0xff] ^ t.entry[0][hi >> 24];
+    p += 8;
+    n -= 8;
+  }
+  while(n-- > 0) crc = (crc >> 8) ^ t.entry[0][(crc ^ *p++) & 0xff];
+  return ~crc;
+}
+
+#ifdef PORTAL_CRC32C_SSE42
+
+bool CanAccelerate() {
+  unsigned int ecx = 0;
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 1);
+  ecx = static_cast<unsigned int>(info[2]);
+#else
+  unsigned int eax, ebx, edx;
+  if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+#endif
+  return (ecx & (1u << 20)) != 0; // sse4.2
+}
+
+PORTAL_TARGET_SSE42
+uint32_t ExtendSse42(uint32_t crc, const char* data, size_t n) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+  crc = ~crc;
+#if defined(_M_X64) || defined(__x86_64__)
+  uint64_t crc64 = crc;
+  while(n >= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    p += 8;
+    n -= 8;
+  }
+  crc = static_cast<uint32_t>(crc64);
+#endif
+  while(n >= 4) {
+    uint32_t word;
+    memcpy(&word, p, 4);
+    crc = _mm_crc32_u32(crc, word);
+    p += 4;
+    n -= 4;
+  }
+  while(n-- > 0) crc = _mm_crc32_u8(crc, *p++);
+  return ~crc;
+}
+
+#endif // PORTAL_CRC32C_SSE42
+
+} // anonymous namespace
+
+uint32_t Extend(uint32_t crc, const char* data, size_t n) {
+#ifdef PORTAL_CRC32C_SSE42
+  static const bool accelerate = CanAccelerate();
+  if(accelerate) return ExtendSse42(crc, data, n);
+#endif
+  return ExtendPortable(crc, data, n);
+}
+
+} // namespace crc32c
+
+} // namespace portal_db
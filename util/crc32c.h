@@ -0,0 +1,23 @@
+#ifndef PORTAL_UTIL_CRC32C_H_
+#define PORTAL_UTIL_CRC32C_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace portal_db {
+
+namespace crc32c {
+
+// extend `crc` with `n` bytes of `data`
+// uses SSE4.2 crc32 instruction when cpu supports it
+uint32_t Extend(uint32_t crc, const char* data, size_t n);
+
+inline uint32_t Value(const char* data, size_t n) {
+  return Extend(0, data, n);
+}
+
+} // namespace crc32c
+
+} // namespace portal_db
+
+#endif // PORTAL_UTIL_CRC32C_H_
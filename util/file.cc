@@ -2,6 +2,14 @@
 #include "portal_db/status.h"
 #include "util/file.h"
 
+#ifdef LINUX_PLATFORM
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <sys/uio.h>
+#include <vector>
+#endif
+
 namespace portal_db {
 
 #ifdef WIN_PLATFORM
@@ -13,7 +21,7 @@ Status WritableFile::Open(void){
     0,  // share mode
     NULL,  // security
     OPEN_ALWAYS, 
-    FILE_ATTRIBUTE_NORMAL, 
+    FILE_ATTRIBUTE_NORMAL | (direct_ ? FILE_FLAG_NO_BUFFERING : 0), 
     NULL); // template file handle
   if(fhandle_ == INVALID_HANDLE_VALUE)return Status::IOError("Invalid File Handle");
   is_opened_ = true;
@@ -27,6 +35,12 @@ Status WritableFile::Close(void){
   return Status::OK();
 }
 
+Status WritableFile::Sync(void){
+  if(!is_opened_) return Status::IOError("File Not Opened");
+  if(!FlushFileBuffers(fhandle_))return Status::IOError("Flush File Failed");
+  return Status::OK();
+}
+
 Status WritableFile::Delete(void){
   if(is_opened_) return Status::IOError("File Still Opened");
   if(!DeleteFile(fileName.c_str())){
@@ -37,23 +51,20 @@ Status WritableFile::Delete(void){
 }
 
 // Derived Type :: Sequential File //
+// positional read, safe for concurrent readers
 Status SequentialFile::Read(size_t offset, size_t size, char* alloc_ptr){
   if(!is_opened_) return Status::IOError("File Not Opened");
   if(!alloc_ptr)return Status::InvalidArgument("Null data pointer.");
   if(offset + size > file_end_)return Status::InvalidArgument("Exceed file length.");
-  DWORD dwPtr = SetFilePointer(fhandle_, 
-    offset, 
-    NULL, 
-    0); // 0 for starting from beginning
-  DWORD dwError;
-  if(dwPtr == INVALID_SET_FILE_POINTER \
-    && (dwError = GetLastError())!=NO_ERROR)return Status::IOError("Set File Pointer Failed");
+  OVERLAPPED overlapped = {0};
+  overlapped.Offset = static_cast<DWORD>(offset);
+  overlapped.OffsetHigh = static_cast<DWORD>(static_cast<uint64_t>(offset) >> 32);
   DWORD numByteRead;
   bool rfRes = ReadFile(fhandle_, 
     alloc_ptr, 
     size, 
     &numByteRead, // num of bytes read
-    NULL); // overlapped structure
+    &overlapped); // offset of synchronous read
   if(!rfRes)return Status::IOError("Read File Failed");
   return Status::OK();
 }
@@ -62,19 +73,15 @@ Status SequentialFile::Write(size_t offset, size_t size, const char* data_ptr) {
   if(!data_ptr)return Status::InvalidArgument("Null data pointer.");
   if(offset >= file_end_)return Status::OK();
   if(offset + size > file_end_)size = file_end_-offset;
-  DWORD dwPtr = SetFilePointer(fhandle_, 
-    offset, 
-    NULL, 
-    0); // 0 for starting from beginning
-  DWORD dwError;
-  if(dwPtr == INVALID_SET_FILE_POINTER \
-    && (dwError = GetLastError())!=NO_ERROR)return Status::IOError("Set File Pointer Failed");
+  OVERLAPPED overlapped = {0};
+  overlapped.Offset = static_cast<DWORD>(offset);
+  overlapped.OffsetHigh = static_cast<DWORD>(static_cast<uint64_t>(offset) >> 32);
   DWORD numByteWritten;
   bool rfRes = WriteFile(fhandle_, 
     data_ptr, 
     size, 
-    &numByteWritten,  // num of bytes read
-    NULL); // overlapped structure
+    &numByteWritten,  // num of bytes written
+    &overlapped); // offset of synchronous write
   if(!rfRes){
     std::cout << "Windows error: " << GetLastError() << std::endl;
     return Status::IOError("Write File Failed");
@@ -82,21 +89,201 @@ Status SequentialFile::Write(size_t offset, size_t size, const char* data_ptr) {
   return Status::OK();
 }
 
+// no gathered positional write on synchronous handle
+Status SequentialFile::WriteV(size_t offset, const IoSlice* parts, size_t n) {
+  Status ret;
+  for(size_t i = 0; i < n && ret.ok(); i++) {
+    ret *= Write(offset, parts[i].size, parts[i].data);
+    offset += parts[i].size;
+  }
+  return ret;
+}
+
 Status SequentialFile::SetEnd(size_t offset) {
   if(!is_opened_) return Status::IOError("File Not Opened");
-  DWORD dwPtr = SetFilePointer(fhandle_, \
-    offset, \
-    NULL, \
-    0); // 0 for starting from beginning
-  DWORD dwError;
-  if(dwPtr == INVALID_SET_FILE_POINTER \
-    && (dwError = GetLastError())!=NO_ERROR)return Status::IOError("Set File Pointer Failed");
-  SetEndOfFile(fhandle_);
+  // leaves file pointer alone
+  FILE_END_OF_FILE_INFO info;
+  info.EndOfFile.QuadPart = static_cast<LONGLONG>(offset);
+  if(!SetFileInformationByHandle(fhandle_, 
+    FileEndOfFileInfo, 
+    &info, 
+    sizeof(info))) return Status::IOError("Set End Of File Failed");
   file_end_ = offset;
   // SetFileValidData(fhandle_, offset+block_size_)
   return Status::OK();
 }
 
+Status SequentialFile::Map(size_t offset, size_t size, char*& ptr) {
+  if(!is_opened_) return Status::IOError("File Not Opened");
+  if(offset % MapAlignment() != 0) return Status::InvalidArgument("Unaligned map offset.");
+  if(offset + size > file_end_) return Status::InvalidArgument("Exceed file length.");
+  uint64_t end = static_cast<uint64_t>(offset) + size;
+  HANDLE mapping = CreateFileMapping(fhandle_, 
+    NULL, // security
+    PAGE_READWRITE, 
+    static_cast<DWORD>(end >> 32), 
+    static_cast<DWORD>(end), 
+    NULL); // anonymous
+  if(mapping == NULL) return Status::IOError("Create File Mapping Failed");
+  // view holds the mapping object
+  ptr = reinterpret_cast<char*>(MapViewOfFile(mapping, 
+    FILE_MAP_ALL_ACCESS, 
+    static_cast<DWORD>(static_cast<uint64_t>(offset) >> 32), 
+    static_cast<DWORD>(offset), 
+    size));
+  CloseHandle(mapping);
+  if(ptr == NULL) return Status::IOError("Map View Failed");
+  return Status::OK();
+}
+
+Status SequentialFile::Unmap(char* ptr, size_t size) {
+  if(!UnmapViewOfFile(ptr)) return Status::IOError("Unmap View Failed");
+  return Status::OK();
+}
+
+Status SequentialFile::Flush(char* ptr, size_t size) {
+  if(!FlushViewOfFile(ptr, size)) return Status::IOError("Flush View Failed");
+  return Status::OK();
+}
+
+size_t SequentialFile::MapAlignment(void) {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwAllocationGranularity;
+}
+
+#elif defined(LINUX_PLATFORM)
+
+// Base Type :: Writabel File //
+Status WritableFile::Open(void){
+  int flags = O_RDWR | O_CREAT | O_CLOEXEC;
+  fhandle_ = ::open(fileName.c_str(), flags | (direct_ ? O_DIRECT : 0), 0644);
+  if(fhandle_ < 0 && direct_ && errno == EINVAL) { // e.g. tmpfs
+    direct_ = false;
+    fhandle_ = ::open(fileName.c_str(), flags, 0644);
+  }
+  if(fhandle_ < 0)return Status::IOError("Invalid File Handle", strerror(errno));
+  struct stat st;
+  if(fstat(fhandle_, &st) != 0) {
+    ::close(fhandle_);
+    return Status::IOError("Stat File Failed", strerror(errno));
+  }
+  is_opened_ = true;
+  file_end_ = static_cast<size_t>(st.st_size);
+  return Status::OK();
+}
+
+Status WritableFile::Close(void){
+  is_opened_ = false;
+  if(::close(fhandle_) != 0)return Status::IOError("Close File Failed", strerror(errno));
+  return Status::OK();
+}
+
+Status WritableFile::Sync(void){
+  if(!is_opened_) return Status::IOError("File Not Opened");
+  if(fdatasync(fhandle_) != 0)return Status::IOError("Flush File Failed", strerror(errno));
+  return Status::OK();
+}
+
+Status WritableFile::Delete(void){
+  if(is_opened_) return Status::IOError("File Still Opened");
+  if(unlink(fileName.c_str()) != 0)return Status::IOError("Cannot Delete File", strerror(errno));
+  return Status::OK();
+}
+
+// Derived Type :: Sequential File //
+// positional read, safe for concurrent readers
+Status SequentialFile::Read(size_t offset, size_t size, char* alloc_ptr){
+  if(!is_opened_) return Status::IOError("File Not Opened");
+  if(!alloc_ptr)return Status::InvalidArgument("Null data pointer.");
+  if(offset + size > file_end_)return Status::InvalidArgument("Exceed file length.");
+  while(size > 0) {
+    ssize_t n = pread(fhandle_, alloc_ptr, size, offset);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0)return Status::IOError("Read File Failed", strerror(errno));
+    if(n == 0)return Status::IOError("Read File Failed", "unexpected end of file");
+    alloc_ptr += n;
+    offset += n;
+    size -= n;
+  }
+  return Status::OK();
+}
+
+Status SequentialFile::Write(size_t offset, size_t size, const char* data_ptr) {
+  IoSlice part = {data_ptr, size};
+  if(!data_ptr)return Status::InvalidArgument("Null data pointer.");
+  return WriteV(offset, &part, 1);
+}
+
+Status SequentialFile::WriteV(size_t offset, const IoSlice* parts, size_t n) {
+  if(!is_opened_) return Status::IOError("File Not Opened");
+  if(offset >= file_end_)return Status::OK();
+  // clip to end of file, kernel takes at most `IOV_MAX` at once
+  std::vector<struct iovec> iov;
+  size_t room = file_end_ - offset;
+  for(size_t i = 0; i < n && room > 0; i++) {
+    size_t size = std::min(parts[i].size, room);
+    if(size == 0) continue;
+    iov.push_back({const_cast<char*>(parts[i].data), size});
+    room -= size;
+  }
+  size_t first = 0;
+  while(first < iov.size()) {
+    int count = static_cast<int>(std::min(iov.size() - first, (size_t)IOV_MAX));
+    ssize_t written = pwritev(fhandle_, iov.data() + first, count, offset);
+    if(written < 0 && errno == EINTR) continue;
+    if(written < 0)return Status::IOError("Write File Failed", strerror(errno));
+    offset += written;
+    // skip fully written buffers, trim partial one
+    size_t left = static_cast<size_t>(written);
+    while(first < iov.size() && left >= iov[first].iov_len) left -= iov[first++].iov_len;
+    if(first < iov.size()) {
+      iov[first].iov_base = reinterpret_cast<char*>(iov[first].iov_base) + left;
+      iov[first].iov_len -= left;
+    }
+  }
+  return Status::OK();
+}
+
+Status SequentialFile::SetEnd(size_t offset) {
+  if(!is_opened_) return Status::IOError("File Not Opened");
+  int res = -1;
+  if(offset > file_end_) { // allocate blocks, mapped pages never fault on space
+    res = fallocate(fhandle_, 0, file_end_, offset - file_end_);
+    if(res != 0 && errno != EOPNOTSUPP && errno != ENOSYS)
+      return Status::IOError("Allocate File Failed", strerror(errno));
+  }
+  if(res != 0 && ftruncate(fhandle_, offset) != 0)
+    return Status::IOError("Set End Of File Failed", strerror(errno));
+  file_end_ = offset;
+  return Status::OK();
+}
+
+Status SequentialFile::Map(size_t offset, size_t size, char*& ptr) {
+  if(!is_opened_) return Status::IOError("File Not Opened");
+  if(offset % MapAlignment() != 0) return Status::InvalidArgument("Unaligned map offset.");
+  if(offset + size > file_end_) return Status::InvalidArgument("Exceed file length.");
+  void* view = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fhandle_, offset);
+  if(view == MAP_FAILED) return Status::IOError("Map View Failed", strerror(errno));
+  ptr = reinterpret_cast<char*>(view);
+  return Status::OK();
+}
+
+Status SequentialFile::Unmap(char* ptr, size_t size) {
+  if(munmap(ptr, size) != 0) return Status::IOError("Unmap View Failed", strerror(errno));
+  return Status::OK();
+}
+
+Status SequentialFile::Flush(char* ptr, size_t size) {
+  // view starts aligned, so does its page range
+  if(msync(ptr, size, MS_SYNC) != 0) return Status::IOError("Flush View Failed", strerror(errno));
+  return Status::OK();
+}
+
+size_t SequentialFile::MapAlignment(void) {
+  return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
 #else
 #error "file port not implemented"
 #endif // WIN_PLATFORM
@@ -33,18 +33,30 @@ typedef bool OsMapHandle; // custom
 inline void CaptureError(void){std::cout << "OS raise unknown error." << std::endl;}
 #endif // linux
 
-// no synchronization //
+// one buffer of a gathered write
+struct IoSlice {
+  const char* data;
+  size_t size;
+};
+
+// positional io, concurrent `Read` and `Write` need no lock,
+// `Open`, `Close` and `SetEnd` are not synchronized //
 class WritableFile{
  protected:
   OsFileHandle fhandle_;
   size_t file_end_;
   bool is_opened_ = false;
+  // bypass page cache, offsets, sizes and buffers of io must be
+  // multiples of `DirectAlignment`, cleared if device refuses
+  bool direct_ = false;
   // extern data
   const ::std::string fileName;
  public:
   using WritableFilePtr = std::shared_ptr<WritableFile>;
   WritableFile(const char* name):fileName(name),file_end_(0){ }
   WritableFile(const ::std::string name):fileName(name),file_end_(0){ }
+  WritableFile(const ::std::string name, bool direct)
+    :fileName(name),file_end_(0),direct_(direct){ }
   WritableFile():file_end_(0){ }
   bool Empty(void){return file_end_ == 0;}
   virtual ~WritableFile(){ };
@@ -55,7 +67,12 @@ class WritableFile{
   virtual Status Read(size_t offset, size_t size, char* alloc_ptr) = 0;
   virtual Status Write(size_t offset, size_t size, const char* data_ptr) = 0;
   virtual Status SetEnd(size_t offset) = 0;
+  // flush written data to device
+  virtual Status Sync(void);
   inline bool opened() const { return is_opened_; }
+  inline OsFileHandle handle() const { return fhandle_; }
+  inline bool direct() const { return direct_; }
+  static constexpr size_t DirectAlignment(void) { return 4096; }
   inline const ::std::string name(void) const{return fileName;}
   inline size_t size(void) const{return file_end_;}
 };
@@ -64,11 +81,24 @@ class SequentialFile : public WritableFile{
  public:
   SequentialFile(const char* name):WritableFile(name){ }
   SequentialFile(const ::std::string name):WritableFile(name){ }
+  SequentialFile(const ::std::string name, bool direct):WritableFile(name, direct){ }
   SequentialFile():WritableFile(){ }
   virtual ~SequentialFile(){ }
   Status Read(size_t offset, size_t size, char* alloc_ptr);
   Status Write(size_t offset, size_t size, const char* data_ptr);
+  // write `n` buffers back to back from `offset` with one call,
+  // clipped to `size()` like `Write`
+  Status WriteV(size_t offset, const IoSlice* parts, size_t n);
+  // grow with allocated blocks or shrink
   Status SetEnd(size_t offset);
+  // shared mapping family //
+  // view of [offset, offset + size) within `size()`,
+  // `offset` must be multiple of `MapAlignment`
+  Status Map(size_t offset, size_t size, char*& ptr);
+  Status Unmap(char* ptr, size_t size);
+  // write back dirty pages of a view, not durable until `Sync`
+  Status Flush(char* ptr, size_t size);
+  static size_t MapAlignment(void);
 };
 
 
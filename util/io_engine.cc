@@ -0,0 +1,273 @@
+#include "util/io_engine.h"
+
+#ifdef LINUX_PLATFORM
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+namespace portal_db {
+
+#ifdef LINUX_PLATFORM
+
+// raw rings, no liburing dependency
+struct IoEngine::Ring {
+  int fd = -1;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  io_uring_sqe* sqes;
+  io_uring_cqe* cqes;
+  void* sq_ring = MAP_FAILED;
+  void* cq_ring = MAP_FAILED;
+  void* sqe_ring = MAP_FAILED;
+  size_t sq_size = 0;
+  size_t cq_size = 0;
+  size_t sqe_size = 0;
+  // vectors of writes in flight, slot `ticket % depth`
+  std::vector<std::vector<iovec>> iov;
+  ~Ring() {
+    if(sqe_ring != MAP_FAILED) munmap(sqe_ring, sqe_size);
+    if(cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_size);
+    if(sq_ring != MAP_FAILED) munmap(sq_ring, sq_size);
+    if(fd >= 0) close(fd);
+  }
+  bool Setup(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if(fd < 0) return false;
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if(single) sq_size = cq_size = std::max(sq_size, cq_size);
+    sq_ring = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, 
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(sq_ring == MAP_FAILED) return false;
+    cq_ring = single ? sq_ring : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, 
+                                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if(cq_ring == MAP_FAILED) return false;
+    sqe_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqe_ring = mmap(NULL, sqe_size, PROT_READ | PROT_WRITE, 
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(sqe_ring == MAP_FAILED) return false;
+    char* sq = reinterpret_cast<char*>(sq_ring);
+    char* cq = reinterpret_cast<char*>(cq_ring);
+    sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    sqes = reinterpret_cast<io_uring_sqe*>(sqe_ring);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+  }
+  // zeroed entry published on next `Enter`
+  io_uring_sqe* Next() {
+    unsigned tail = *sq_tail;
+    unsigned idx = tail & *sq_mask;
+    sq_array[idx] = idx;
+    memset(&sqes[idx], 0, sizeof(io_uring_sqe));
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return &sqes[idx];
+  }
+  // submit published entries, `wait` blocks for one completion
+  bool Enter(bool wait) {
+    while(true) {
+      unsigned queued = *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+      if(queued == 0 && !wait) return true;
+      long ret = syscall(__NR_io_uring_enter, fd, queued, wait ? 1 : 0, 
+                         wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+      if(ret >= 0) return true;
+      if(errno == EINTR) continue;
+      // completions must be reaped first
+      return errno == EAGAIN || errno == EBUSY;
+    }
+  }
+};
+
+IoEngine::IoEngine(size_t depth, bool async)
+    : depth_(depth > 0 ? depth : 1) {
+  if(!async) return;
+  ring_.reset(new Ring());
+  ring_->iov.resize(depth_);
+  // a write and its sync per op
+  if(!ring_->Setup(static_cast<unsigned>(2 * depth_))) ring_.reset();
+}
+
+Status IoEngine::Write(SequentialFile& file,
+                       size_t offset,
+                       const IoSlice* parts,
+                       size_t n,
+                       bool sync,
+                       uint64_t& ticket) {
+  if(!file.opened()) return Status::IOError("File Not Opened");
+  ticket = ++ issued_;
+  if(!ring_) {
+    Status ret = file.WriteV(offset, parts, n);
+    if(ret.ok() && sync) ret *= file.Sync();
+    failed_ *= ret;
+    completed_ = ticket;
+    return Status::OK();
+  }
+  while(pending_.size() >= depth_) Reap(true);
+  // clip to end of file like `SequentialFile::WriteV`
+  std::vector<iovec>& iov = ring_->iov[ticket % depth_];
+  iov.clear();
+  size_t room = offset < file.size() ? file.size() - offset : 0;
+  for(size_t i = 0; i < n && room > 0; i++) {
+    size_t size = std::min(parts[i].size, room);
+    if(size == 0) continue;
+    iov.push_back({const_cast<char*>(parts[i].data), size});
+    room -= size;
+  }
+  Op op = {ticket, 0, 0, Status::OK()};
+  if(!iov.empty()) {
+    io_uring_sqe* sqe = ring_->Next();
+    int fixed = -1;
+    const char* base = reinterpret_cast<const char*>(iov[0].iov_base);
+    for(size_t i = 0; i < registered_.size() && iov.size() == 1; i++) {
+      if(base >= registered_[i].data && 
+         base + iov[0].iov_len <= registered_[i].data + registered_[i].size) {
+        fixed = static_cast<int>(i);
+        break;
+      }
+    }
+    if(fixed >= 0) {
+      sqe->opcode = IORING_OP_WRITE_FIXED;
+      sqe->addr = reinterpret_cast<uint64_t>(base);
+      sqe->len = static_cast<uint32_t>(iov[0].iov_len);
+      sqe->buf_index = static_cast<uint16_t>(fixed);
+    } else {
+      sqe->opcode = IORING_OP_WRITEV;
+      sqe->addr = reinterpret_cast<uint64_t>(iov.data());
+      sqe->len = static_cast<uint32_t>(iov.size());
+    }
+    sqe->fd = file.handle();
+    sqe->off = offset;
+    sqe->user_data = ticket << 1;
+    // sync starts only after write succeeds
+    if(sync) sqe->flags |= IOSQE_IO_LINK;
+    for(size_t i = 0; i < iov.size(); i++) op.expected += iov[i].iov_len;
+    op.remaining ++;
+  }
+  if(sync) {
+    io_uring_sqe* sqe = ring_->Next();
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = file.handle();
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = (ticket << 1) | 1;
+    op.remaining ++;
+  }
+  pending_.push_back(op);
+  if(!ring_->Enter(false)) 
+    return Status::IOError("Submit Write Failed", strerror(errno));
+  Reap(false);
+  return Status::OK();
+}
+
+void IoEngine::Reap(bool block) {
+  if(!ring_) return;
+  if(block && !ring_->Enter(true)) { // ring unusable, give up on writes
+    failed_ *= Status::IOError("Wait Write Failed", strerror(errno));
+    pending_.clear();
+    completed_ = issued_;
+    return;
+  }
+  unsigned head = *ring_->cq_head;
+  unsigned tail = __atomic_load_n(ring_->cq_tail, __ATOMIC_ACQUIRE);
+  for(; head != tail; head++) {
+    const io_uring_cqe& cqe = ring_->cqes[head & *ring_->cq_mask];
+    uint64_t ticket = cqe.user_data >> 1;
+    bool sync = (cqe.user_data & 1) != 0;
+    Op& op = pending_[ticket - pending_.front().ticket];
+    if(cqe.res < 0) {
+      // sync after failed write is canceled, first failure kept
+      op.status *= Status::IOError(sync ? "Sync File Failed" : "Write File Failed", 
+                                   strerror(-cqe.res));
+    } else if(!sync && static_cast<size_t>(cqe.res) != op.expected) {
+      op.status *= Status::IOError("Write File Failed", "short write");
+    }
+    op.remaining --;
+  }
+  __atomic_store_n(ring_->cq_head, head, __ATOMIC_RELEASE);
+  while(!pending_.empty() && pending_.front().remaining == 0) {
+    failed_ *= pending_.front().status;
+    completed_ = pending_.front().ticket;
+    pending_.pop_front();
+  }
+}
+
+Status IoEngine::Register(const IoSlice* buffers, size_t n) {
+  if(!ring_) return Status::OK();
+  Status ret = Drain(); // no fixed write in flight
+  if(!registered_.empty()) {
+    syscall(__NR_io_uring_register, ring_->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    registered_.clear();
+  }
+  std::vector<iovec> iov;
+  for(size_t i = 0; i < n; i++) 
+    iov.push_back({const_cast<char*>(buffers[i].data), buffers[i].size});
+  if(syscall(__NR_io_uring_register, ring_->fd, IORING_REGISTER_BUFFERS, 
+             iov.data(), static_cast<unsigned>(n)) < 0) 
+    return Status::IOError("Register Buffers Failed", strerror(errno));
+  registered_.assign(buffers, buffers + n);
+  return ret;
+}
+
+#else
+
+struct IoEngine::Ring { };
+
+IoEngine::IoEngine(size_t depth, bool async)
+    : depth_(depth > 0 ? depth : 1) { }
+
+Status IoEngine::Write(SequentialFile& file,
+                       size_t offset,
+                       const IoSlice* parts,
+                       size_t n,
+                       bool sync,
+                       uint64_t& ticket) {
+  if(!file.opened()) return Status::IOError("File Not Opened");
+  ticket = ++ issued_;
+  Status ret = file.WriteV(offset, parts, n);
+  if(ret.ok() && sync) ret *= file.Sync();
+  failed_ *= ret;
+  completed_ = ticket;
+  return Status::OK();
+}
+
+void IoEngine::Reap(bool block) { }
+
+Status IoEngine::Register(const IoSlice* buffers, size_t n) {
+  return Status::OK();
+}
+
+#endif // LINUX_PLATFORM
+
+IoEngine::~IoEngine() {
+  Drain();
+}
+
+Status IoEngine::Wait(uint64_t ticket) {
+  while(completed_ < ticket && !pending_.empty()) Reap(true);
+  Status ret = failed_;
+  failed_ = Status::OK();
+  return ret;
+}
+
+bool IoEngine::Done(uint64_t ticket) {
+  Reap(false);
+  return completed_ >= ticket;
+}
+
+} // namespace portal_db
@@ -0,0 +1,79 @@
+#ifndef PORTAL_UTIL_IO_ENGINE_H_
+#define PORTAL_UTIL_IO_ENGINE_H_
+
+#include "util/file.h"
+#include "util/util.h"
+#include "portal_db/status.h"
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace portal_db {
+
+// Positional writes kept in flight on io_uring, up to `depth` at once.
+// Each write may be linked to a data sync of its file, which starts
+// only after the write succeeds. Tickets complete in issue order.
+// Without io_uring (other platforms, old kernel, sandbox) each write
+// runs blocking on submission and completes at once.
+// Single owner thread, buffers must outlive their ticket.
+class IoEngine : public NoMove {
+ public:
+  // `async` false forces blocking writes
+  explicit IoEngine(size_t depth = default_depth_, bool async = true);
+  ~IoEngine(); // waits for writes in flight
+  bool async() const { return ring_ != nullptr; }
+  // queue write of `n` buffers back to back from `offset`, clipped to
+  // `file.size()`, `sync` syncs data of `file` after it
+  Status Write(SequentialFile& file,
+               size_t offset,
+               const IoSlice* parts,
+               size_t n,
+               bool sync,
+               uint64_t& ticket);
+  Status Write(SequentialFile& file,
+               size_t offset,
+               const char* data,
+               size_t size,
+               bool sync,
+               uint64_t& ticket) {
+    IoSlice part = {data, size};
+    return Write(file, offset, &part, 1, sync, ticket);
+  }
+  // block until every ticket up to `ticket` completes
+  // return first failure completed since last call
+  Status Wait(uint64_t ticket);
+  Status Drain() { return Wait(issued_); }
+  // poll completions, true if `ticket` is complete
+  bool Done(uint64_t ticket);
+  // pin buffers once, later single-part writes inside one of them
+  // skip pinning, best effort, writes work either way
+  Status Register(const IoSlice* buffers, size_t n);
+  // latest ticket handed out, 0 before any
+  uint64_t issued() const { return issued_; }
+ private:
+  static constexpr size_t default_depth_ = 32;
+  // io_uring state, absent in blocking mode
+  struct Ring;
+  // write in flight and its linked sync
+  struct Op {
+    uint64_t ticket;
+    int remaining; // completions to come
+    size_t expected; // bytes to write
+    Status status;
+  };
+  const size_t depth_;
+  std::unique_ptr<Ring> ring_;
+  std::deque<Op> pending_; // in flight, ascending ticket
+  std::vector<IoSlice> registered_;
+  uint64_t issued_ = 0;
+  uint64_t completed_ = 0;
+  Status failed_;
+  // move finished completions into `pending_`, `block` waits for one
+  void Reap(bool block);
+};
+
+} // namespace portal_db
+
+#endif // PORTAL_UTIL_IO_ENGINE_H_
@@ -0,0 +1,48 @@
+#ifndef PORTAL_UTIL_RATE_LIMITER_H_
+#define PORTAL_UTIL_RATE_LIMITER_H_
+
+#include "util.h"
+
+#include <chrono>
+#include <thread>
+
+namespace portal_db {
+
+// token bucket of bytes, refilled at `rate` per second up to `burst`
+// single consumer, no synchronization
+class RateLimiter : public NoCopy {
+ public:
+  RateLimiter(size_t rate, size_t burst)
+      : rate_(rate),
+        burst_(burst),
+        tokens_(static_cast<double>(burst)),
+        last_(std::chrono::steady_clock::now()) { }
+  // block until `bytes` are granted, a request over `burst` runs
+  // the bucket into debt that later requests pay off
+  void Request(size_t bytes) {
+    if(rate_ == 0) return; // unlimited
+    Refill();
+    tokens_ -= static_cast<double>(bytes);
+    if(tokens_ >= 0) return;
+    std::this_thread::sleep_for(std::chrono::microseconds(
+      static_cast<int64_t>(-tokens_ * 1e6 / rate_)
+    ));
+    Refill();
+  }
+  size_t rate() const { return rate_; }
+ private:
+  const size_t rate_; // bytes per second, 0 for unlimited
+  const size_t burst_;
+  double tokens_;
+  std::chrono::steady_clock::time_point last_;
+  void Refill() {
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - last_).count();
+    last_ = now;
+    tokens_ = min(tokens_ + elapsed * rate_, static_cast<double>(burst_));
+  }
+};
+
+} // namespace portal_db
+
+#endif // PORTAL_UTIL_RATE_LIMITER_H_
@@ -11,6 +11,7 @@ namespace portal_db {
 // unfair version (read first)
 class ReadWriteLock : public NoMove {
  public:
+  ReadWriteLock() : reader_(0) { }
   void ReadLock() {
     std::lock_guard<std::mutex> lk(read_);
     reader_ ++;
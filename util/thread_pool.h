@@ -0,0 +1,67 @@
+#ifndef PORTAL_UTIL_THREAD_POOL_H_
+#define PORTAL_UTIL_THREAD_POOL_H_
+
+#include "util.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace portal_db {
+
+// fixed set of workers serving a task queue in submit order
+// workers are spawned on first submit, an idle owner costs no thread
+// queued tasks still run on destruction
+class ThreadPool : public NoMove {
+ public:
+  using Task = std::function<void()>;
+  // `threads` 0 picks hardware concurrency
+  ThreadPool(size_t threads = 0)
+      : size_(threads == 0 ?
+              max((size_t)std::thread::hardware_concurrency(), (size_t)1) :
+              threads) { }
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lk(lock_);
+      closed_ = true;
+      ready_.notify_all();
+    }
+    for(size_t i = 0; i < workers_.size(); i++) workers_[i].join();
+  }
+  void Submit(Task task) {
+    std::lock_guard<std::mutex> lk(lock_);
+    if(workers_.empty()) {
+      for(size_t i = 0; i < size_; i++)
+        workers_.push_back(std::thread([this]() { Work(); }));
+    }
+    tasks_.push_back(std::move(task));
+    ready_.notify_one();
+  }
+  size_t size() const { return size_; }
+ private:
+  const size_t size_;
+  std::mutex lock_;
+  std::condition_variable ready_;
+  std::deque<Task> tasks_;
+  std::vector<std::thread> workers_;
+  bool closed_ = false;
+  void Work() {
+    std::unique_lock<std::mutex> lk(lock_);
+    while(true) {
+      ready_.wait(lk, [&]() -> bool { return closed_ || !tasks_.empty(); });
+      if(tasks_.empty()) return; // closed and drained
+      Task task = std::move(tasks_.front());
+      tasks_.pop_front();
+      lk.unlock();
+      task();
+      lk.lock();
+    }
+  }
+};
+
+} // namespace portal_db
+
+#endif // PORTAL_UTIL_THREAD_POOL_H_
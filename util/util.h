@@ -1,6 +1,13 @@
 #ifndef PORTAL_UTIL_UTIL_H_
 #define PORTAL_UTIL_UTIL_H_
 
+#ifdef _MSC_VER
+#include <xmmintrin.h>
+#define PORTAL_PREFETCH(p)  _mm_prefetch(reinterpret_cast<const char*>(p), _MM_HINT_T0)
+#else
+#define PORTAL_PREFETCH(p)  __builtin_prefetch(p)
+#endif
+
 namespace portal_db {
 
 class NoCopy {